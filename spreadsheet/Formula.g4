@@ -9,6 +9,9 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
+    | FUNC '(' expr (',' expr)* ')'  # Function
+    // only valid as a function argument, the tree builder checks
+    | CELL ':' CELL  # Range
     | CELL  # Cell
     | NUMBER  # Literal
     ;
@@ -27,4 +30,6 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+// a name right before '(': SUM(A1:A3); the parser checks the name
+FUNC: [A-Z]+ {_input->LA(1) == '('}? ;
 WS: [ \t\n\r]+ -> skip ;
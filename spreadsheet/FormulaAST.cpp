@@ -4,11 +4,19 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstring>
+#include <functional>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string_view>
+#include <type_traits>
 
 namespace ASTImpl {
 
@@ -71,13 +79,26 @@ class Expr {
 public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(std::function<CellInterface*(Position)> fcell) const = 0;
+    // cell positions are printed and read shifted by anchor, see
+    // FormulaAST::MakeRelative()
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                                Position anchor) const = 0;
+    virtual ExecResult Evaluate(const CellValueGetter& fcell, const RangeValueGetter& frange,
+                                Position anchor) const = 0;
+    // appends the postfix code of the subtree, returns the stack depth it needs
+    virtual size_t Compile(std::vector<Instruction>& code) const = 0;
+    // appends the subtree in the binary form of FormulaAST::Serialize()
+    virtual void Serialize(std::string& out) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    // the range if the node is a range, which only a function accepts
+    virtual const CellRange* GetRange() const {
+        return nullptr;
+    }
+
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position anchor,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,7 +107,7 @@ public:
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(out, precedence, anchor);
 
         if (parens_needed) {
             out << ')';
@@ -95,6 +116,42 @@ public:
 };
 
 namespace {
+// Node tags of the binary form. Each node is written after its operands,
+// as in the bytecode, so the reader needs no recursion.
+enum class NodeTag : char {
+    Number = 'N',    // double
+    Cell = 'C',      // row, col
+    Range = 'R',     // first row, col, last row, col
+    Unary = 'U',     // UnaryOpExpr::Type
+    Binary = 'B',    // BinaryOpExpr::Type
+    Function = 'F',  // Function, std::uint16_t argument count
+};
+
+template <typename T>
+void AppendBytes(std::string& out, T value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void AppendPosition(std::string& out, Position pos) {
+    AppendBytes(out, static_cast<std::int32_t>(pos.row));
+    AppendBytes(out, static_cast<std::int32_t>(pos.col));
+}
+
+ExecResult CheckFinite(double value) {
+    if (!std::isfinite(value)) {
+        return FormulaError(FormulaError::Category::Div0);
+    }
+    return value;
+}
+
+ExecResult GetCellValue(Position pos, const CellValueGetter& fcell) {
+    if (!pos.IsValid()) {
+        return FormulaError(FormulaError::Category::Ref);
+    }
+    return fcell(pos);
+}
+
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -105,7 +162,7 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, ExprPtr lhs, ExprPtr rhs)
         : type_(type)
         , lhs_(std::move(lhs))
         , rhs_(std::move(rhs)) {
@@ -119,10 +176,11 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                        Position anchor) const override {
+        lhs_->PrintFormula(out, precedence, anchor);
         out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        rhs_->PrintFormula(out, precedence, anchor, /* right_child = */ true);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -142,39 +200,62 @@ public:
         }
     }
 
-    double Evaluate(CellPtr fcell) const override {
-        // Скопируйте ваше решение из предыдущих уроков.
-        double lhs = lhs_.get()->Evaluate(fcell);
-        double rhs = rhs_.get()->Evaluate(fcell);
-        double rs = 0.0;
+    ExecResult Evaluate(const CellValueGetter& fcell, const RangeValueGetter& frange,
+                        Position anchor) const override {
+        ExecResult lhs_result = lhs_->Evaluate(fcell, frange, anchor);
+        if (std::holds_alternative<FormulaError>(lhs_result)) {
+            return lhs_result;
+        }
+        ExecResult rhs_result = rhs_->Evaluate(fcell, frange, anchor);
+        if (std::holds_alternative<FormulaError>(rhs_result)) {
+            return rhs_result;
+        }
+        double lhs = std::get<double>(lhs_result);
+        double rhs = std::get<double>(rhs_result);
         switch (type_) {
         case Add:
-            if(!std::isfinite(rs = lhs + rhs)){
-                throw FormulaError(FormulaError::Category::Div0);
-            }
+            return CheckFinite(lhs + rhs);
+        case Subtract:
+            return CheckFinite(lhs - rhs);
+        case Multiply:
+            return CheckFinite(lhs * rhs);
+        case Divide:
+            return CheckFinite(lhs / rhs);
+        }
+        return 0.0;
+    }
+
+    size_t Compile(std::vector<Instruction>& code) const override {
+        size_t lhs_depth = lhs_->Compile(code);
+        size_t rhs_depth = rhs_->Compile(code);
+        switch (type_) {
+        case Add:
+            code.emplace_back(Instruction::Code::Add);
             break;
         case Subtract:
-            if(!std::isfinite(rs = lhs - rhs)){
-                throw FormulaError(FormulaError::Category::Div0);
-            }
+            code.emplace_back(Instruction::Code::Subtract);
             break;
         case Multiply:
-            if(!std::isfinite(rs = lhs * rhs)){
-                throw FormulaError(FormulaError::Category::Div0);
-            }
+            code.emplace_back(Instruction::Code::Multiply);
             break;
         case Divide:
-            if(!std::isfinite(rs = lhs / rhs)){
-                throw FormulaError(FormulaError::Category::Div0);
-            }
+            code.emplace_back(Instruction::Code::Divide);
+            break;
         }
-        return rs;
+        return std::max(lhs_depth, rhs_depth + 1);
+    }
+
+    void Serialize(std::string& out) const override {
+        lhs_->Serialize(out);
+        rhs_->Serialize(out);
+        AppendBytes(out, NodeTag::Binary);
+        AppendBytes(out, type_);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    ExprPtr lhs_;
+    ExprPtr rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -185,7 +266,7 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, ExprPtr operand)
         : type_(type)
         , operand_(std::move(operand)) {
     }
@@ -196,26 +277,42 @@ public:
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence,
+                        Position anchor) const override {
         out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        operand_->PrintFormula(out, precedence, anchor);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_UNARY;
     }
 
-    double Evaluate(CellPtr fcell) const override {
-        // Скопируйте ваше решение из предыдущих уроков.
-        if (type_ == UnaryMinus){
-            return -(operand_.get()->Evaluate(fcell));
+    ExecResult Evaluate(const CellValueGetter& fcell, const RangeValueGetter& frange,
+                        Position anchor) const override {
+        ExecResult result = operand_->Evaluate(fcell, frange, anchor);
+        if (type_ == UnaryMinus && std::holds_alternative<double>(result)){
+            return -std::get<double>(result);
+        }
+        return result;
+    }
+
+    size_t Compile(std::vector<Instruction>& code) const override {
+        size_t depth = operand_->Compile(code);
+        if (type_ == UnaryMinus) {
+            code.emplace_back(Instruction::Code::Negate);
         }
-        return  operand_.get()->Evaluate(fcell);
+        return depth;
+    }
+
+    void Serialize(std::string& out) const override {
+        operand_->Serialize(out);
+        AppendBytes(out, NodeTag::Unary);
+        AppendBytes(out, type_);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> operand_;
+    ExprPtr operand_;
 };
 
 class CellExpr final : public Expr {
@@ -225,55 +322,42 @@ public:
     }
 
     void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_->ToString();
-        }
+        PrintCell(out, *cell_);
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position anchor) const override {
+        PrintCell(out, Anchored(*cell_, anchor));
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(CellPtr fcell) const override {
-        // реализуйте метод.
-        if(!cell_->IsValid()){
-            throw FormulaError(FormulaError::Category::Ref);
+    ExecResult Evaluate(const CellValueGetter& fcell, const RangeValueGetter& frange,
+                        Position anchor) const override {
+        return GetCellValue(Anchored(*cell_, anchor), fcell);
+    }
 
-        }
-        auto cellptr = fcell(*cell_);
-        if(cellptr == nullptr){
-            return 0;
-        }
-        auto cellvalue = cellptr->GetValue();
-        if(std::holds_alternative<FormulaError>(cellvalue)){
-            throw std::get<FormulaError>(cellvalue);
-        }
-        if(std::holds_alternative<std::string>(cellvalue)){
-            std::string celltext = std::get<std::string>(cellvalue);
-            double rs;
-            try{
-                size_t countchar = 0;
-                celltext.size() == 0 ? rs = 0 : rs = std::stod(celltext,&countchar);
-                if(countchar!=celltext.size()){
-                    throw FormulaError(FormulaError::Category::Value);
-                }
-            } catch(...){
-                throw FormulaError(FormulaError::Category::Value);
-            }
-            return rs;
-        }
-        else {
-            return std::get<double>(cellvalue);
-        }
+    size_t Compile(std::vector<Instruction>& code) const override {
+        code.emplace_back(*cell_);
+        return 1;
+    }
+
+    void Serialize(std::string& out) const override {
+        AppendBytes(out, NodeTag::Cell);
+        AppendPosition(out, *cell_);
     }
 
 private:
+    static void PrintCell(std::ostream& out, Position cell) {
+        if (!cell.IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << cell.ToString();
+        }
+    }
+
     const Position* cell_;
 };
 
@@ -287,7 +371,8 @@ public:
         out << value_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position /* anchor */) const override {
         out << value_;
     }
 
@@ -295,26 +380,253 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(CellPtr fcell) const override {
+    ExecResult Evaluate(const CellValueGetter& /* fcell */, const RangeValueGetter& /* frange */,
+                        Position /* anchor */) const override {
         return value_;
     }
 
+    size_t Compile(std::vector<Instruction>& code) const override {
+        code.emplace_back(value_);
+        return 1;
+    }
+
+    void Serialize(std::string& out) const override {
+        AppendBytes(out, NodeTag::Number);
+        AppendBytes(out, value_);
+    }
+
 private:
     double value_;
 };
 
+using Function = Instruction::Function;
+
+constexpr std::string_view FUNCTION_NAMES[] = {"SUM", "MIN", "MAX", "AVERAGE", "COUNT"};
+
+std::optional<Function> FindFunction(std::string_view name) {
+    for (size_t i = 0; i < std::size(FUNCTION_NAMES); ++i) {
+        if (FUNCTION_NAMES[i] == name) {
+            return static_cast<Function>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+// Without frange every cell is read as an operand, so nothing is skipped.
+std::optional<FormulaError> AddRange(const CellRange& range, const CellValueGetter& fcell,
+                                     const RangeValueGetter& frange, Aggregate& aggregate) {
+    // a deleted range, see DELETED_CELL
+    if (!range.first.IsValid()) {
+        return FormulaError(FormulaError::Category::Ref);
+    }
+    if (frange) {
+        return frange(range, aggregate);
+    }
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            ExecResult value = fcell({row, col});
+            if (std::holds_alternative<FormulaError>(value)) {
+                return std::get<FormulaError>(value);
+            }
+            aggregate.Add(std::get<double>(value));
+        }
+    }
+    return std::nullopt;
+}
+
+ExecResult GetFunctionResult(Function function, const Aggregate& aggregate) {
+    switch (function) {
+    case Function::Sum:
+        return CheckFinite(aggregate.GetSum());
+    case Function::Min:
+        return aggregate.GetMin();
+    case Function::Max:
+        return aggregate.GetMax();
+    case Function::Average:
+        // the average of no numbers is a division by zero
+        return CheckFinite(aggregate.GetSum() / static_cast<double>(aggregate.GetCount()));
+    case Function::Count:
+        return static_cast<double>(aggregate.GetCount());
+    }
+    return 0.0;
+}
+
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(const CellRange* range)
+        : range_(range) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << range_->first.ToString() << ':' << range_->last.ToString();
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position anchor) const override {
+        const CellRange range = Anchored(*range_, anchor);
+        if (!range.first.IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << range.first.ToString() << ':' << range.last.ToString();
+        }
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    const CellRange* GetRange() const override {
+        return range_;
+    }
+
+    // the parser lets a range in only as a function argument, and
+    // FunctionExpr reads it itself
+    ExecResult Evaluate(const CellValueGetter& /* fcell */, const RangeValueGetter& /* frange */,
+                        Position /* anchor */) const override {
+        assert(false);
+        return FormulaError(FormulaError::Category::Value);
+    }
+
+    size_t Compile(std::vector<Instruction>& code) const override {
+        code.emplace_back(range_);
+        return 0;
+    }
+
+    void Serialize(std::string& out) const override {
+        AppendBytes(out, NodeTag::Range);
+        AppendPosition(out, range_->first);
+        AppendPosition(out, range_->last);
+    }
+
+private:
+    const CellRange* range_;
+};
+
+// An aggregate function. Scalar arguments are evaluated first, then the
+// ranges are read, the first error becomes the result.
+class FunctionExpr final : public Expr {
+public:
+    explicit FunctionExpr(Function function, std::pmr::vector<ExprPtr> args)
+        : function_(function)
+        , args_(std::move(args)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << FUNCTION_NAMES[static_cast<size_t>(function_)];
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */,
+                        Position anchor) const override {
+        out << FUNCTION_NAMES[static_cast<size_t>(function_)] << '(';
+        bool first = true;
+        for (const auto& arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            first = false;
+            arg->PrintFormula(out, EP_ATOM, anchor);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    ExecResult Evaluate(const CellValueGetter& fcell, const RangeValueGetter& frange,
+                        Position anchor) const override {
+        Aggregate aggregate;
+        for (const auto& arg : args_) {
+            if (arg->GetRange()) {
+                continue;
+            }
+            ExecResult value = arg->Evaluate(fcell, frange, anchor);
+            if (std::holds_alternative<FormulaError>(value)) {
+                return value;
+            }
+            aggregate.Add(std::get<double>(value));
+        }
+        for (const auto& arg : args_) {
+            if (const CellRange* range = arg->GetRange()) {
+                if (auto error = AddRange(Anchored(*range, anchor), fcell, frange, aggregate)) {
+                    return *error;
+                }
+            }
+        }
+        return GetFunctionResult(function_, aggregate);
+    }
+
+    size_t Compile(std::vector<Instruction>& code) const override {
+        Instruction::Call call{function_, 0, 0};
+        size_t depth = 0;
+        for (const auto& arg : args_) {
+            if (!arg->GetRange()) {
+                depth = std::max(depth, call.scalar_count + arg->Compile(code));
+                ++call.scalar_count;
+            }
+        }
+        for (const auto& arg : args_) {
+            if (arg->GetRange()) {
+                arg->Compile(code);
+                ++call.range_count;
+            }
+        }
+        code.emplace_back(call);
+        return std::max<size_t>(depth, 1);
+    }
+
+    void Serialize(std::string& out) const override {
+        for (const auto& arg : args_) {
+            arg->Serialize(out);
+        }
+        AppendBytes(out, NodeTag::Function);
+        AppendBytes(out, function_);
+        AppendBytes(out, static_cast<std::uint16_t>(args_.size()));
+    }
+
+private:
+    Function function_;
+    std::pmr::vector<ExprPtr> args_;
+};
+
+// B3:A1 and A1:B3 are the same range
+CellRange MakeRange(Position corner1, Position corner2) {
+    return {{std::min(corner1.row, corner2.row), std::min(corner1.col, corner2.col)},
+            {std::max(corner1.row, corner2.row), std::max(corner1.col, corner2.col)}};
+}
+
+// Ranges are only valid as function arguments; the grammar accepts them
+// anywhere an expression is expected, so the tree builders check.
+constexpr const char* MISPLACED_RANGE = "Range outside of a function argument";
+
+void CheckNotRange(const Expr& expr) {
+    if (expr.GetRange()) {
+        throw ParsingError(MISPLACED_RANGE);
+    }
+}
+
+// the argument counts of Instruction::Call are 16 bits wide
+constexpr size_t MAX_FUNCTION_ARGS = 0xffff;
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
+    explicit ParseASTListener(std::pmr::memory_resource* upstream)
+        : storage_(Storage::Create(upstream)) {
+    }
+
+    FormulaAST MoveAST() {
         assert(args_.size() == 1);
         auto root = std::move(args_.front());
         args_.clear();
+        CheckNotRange(*root);
 
-        return root;
-    }
-
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+        storage_->root = std::move(root);
+        return FormulaAST(std::move(storage_));
     }
 
 public:
@@ -322,6 +634,7 @@ public:
         assert(args_.size() >= 1);
 
         auto operand = std::move(args_.back());
+        CheckNotRange(*operand);
 
         UnaryOpExpr::Type type;
         if (ctx->SUB()) {
@@ -331,7 +644,7 @@ public:
             type = UnaryOpExpr::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+        auto node = storage_->MakeExpr<UnaryOpExpr>(type, std::move(operand));
         args_.back() = std::move(node);
     }
 
@@ -344,7 +657,7 @@ public:
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
+        auto node = storage_->MakeExpr<NumberExpr>(value);
         args_.push_back(std::move(node));
     }
 
@@ -355,8 +668,8 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
+        storage_->cells.push_front(value);
+        auto node = storage_->MakeExpr<CellExpr>(&storage_->cells.front());
         args_.push_back(std::move(node));
     }
 
@@ -367,6 +680,8 @@ public:
         args_.pop_back();
 
         auto lhs = std::move(args_.back());
+        CheckNotRange(*lhs);
+        CheckNotRange(*rhs);
 
         BinaryOpExpr::Type type;
         if (ctx->ADD()) {
@@ -380,17 +695,58 @@ public:
             type = BinaryOpExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+        auto node = storage_->MakeExpr<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
         args_.back() = std::move(node);
     }
 
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        Position corners[2];
+        for (size_t i = 0; i < 2; ++i) {
+            auto value_str = ctx->CELL(i)->getSymbol()->getText();
+            corners[i] = Position::FromString(value_str);
+            if (!corners[i].IsValid()) {
+                throw FormulaException("Invalid position: " + value_str);
+            }
+        }
+
+        storage_->ranges.push_front(MakeRange(corners[0], corners[1]));
+        auto node = storage_->MakeExpr<RangeExpr>(&storage_->ranges.front());
+        args_.push_back(std::move(node));
+    }
+
+    void enterFunction(FormulaParser::FunctionContext* /* ctx */) override {
+        function_args_.push_back(args_.size());
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        auto name = ctx->FUNC()->getSymbol()->getText();
+        auto function = FindFunction(name);
+        if (!function) {
+            throw ParsingError("Unknown function: " + name);
+        }
+
+        auto first_arg = args_.begin() + function_args_.back();
+        function_args_.pop_back();
+        if (static_cast<size_t>(args_.end() - first_arg) > MAX_FUNCTION_ARGS) {
+            throw ParsingError("Too many arguments: " + name);
+        }
+        std::pmr::vector<ExprPtr> args(std::make_move_iterator(first_arg),
+                                       std::make_move_iterator(args_.end()), &storage_->arena);
+        args_.erase(first_arg, args_.end());
+
+        auto node = storage_->MakeExpr<FunctionExpr>(*function, std::move(args));
+        args_.push_back(std::move(node));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    Storage::Ptr storage_;
+    std::vector<ExprPtr> args_;
+    // where the arguments of each function being walked start in args_
+    std::vector<size_t> function_args_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -403,10 +759,480 @@ public:
     }
 };
 
+
+// Lexer for the tokens of Formula.g4, reading straight from a string_view.
+// Lexing errors throw ParsingError.
+class Lexer {
+public:
+    enum class TokenType {
+        Number,
+        Cell,
+        Func,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        Colon,
+        Comma,
+        End,
+    };
+
+    struct Token {
+        TokenType type = TokenType::End;
+        std::string_view text;
+    };
+
+    explicit Lexer(std::string_view text)
+        : text_(text) {
+    }
+
+    Token Next() {
+        while (pos_ < text_.size() &&
+               (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+            ++pos_;
+        }
+        if (pos_ == text_.size()) {
+            return {TokenType::End, {}};
+        }
+
+        TokenType type;
+        size_t end = pos_ + 1;
+        switch (text_[pos_]) {
+        case '+':
+            type = TokenType::Add;
+            break;
+        case '-':
+            type = TokenType::Sub;
+            break;
+        case '*':
+            type = TokenType::Mul;
+            break;
+        case '/':
+            type = TokenType::Div;
+            break;
+        case '(':
+            type = TokenType::LeftParen;
+            break;
+        case ')':
+            type = TokenType::RightParen;
+            break;
+        case ':':
+            type = TokenType::Colon;
+            break;
+        case ',':
+            type = TokenType::Comma;
+            break;
+        default:
+            if ((end = MatchNumber()) != pos_) {
+                type = TokenType::Number;
+            } else if ((end = MatchCell()) != pos_) {
+                type = TokenType::Cell;
+            } else if ((end = MatchFunc()) != pos_) {
+                type = TokenType::Func;
+            } else {
+                throw ParsingError("Error when lexing: token recognition error at: '" +
+                                   std::string(1, text_[pos_]) + "'");
+            }
+        }
+        Token token{type, text_.substr(pos_, end - pos_)};
+        pos_ = end;
+        return token;
+    }
+
+private:
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    size_t SkipDigits(size_t pos) const {
+        while (pos < text_.size() && IsDigit(text_[pos])) {
+            ++pos;
+        }
+        return pos;
+    }
+
+    // Longest match of NUMBER at pos_, or pos_ if there is none. Like the
+    // ANTLR lexer, an incomplete exponent ("1e", "1e+") is left out of the
+    // token rather than failing it.
+    size_t MatchNumber() const {
+        size_t pos = SkipDigits(pos_);
+        const bool has_int = pos > pos_;
+        if (pos + 1 < text_.size() && text_[pos] == '.' && IsDigit(text_[pos + 1])) {
+            pos = SkipDigits(pos + 1);
+        } else if (!has_int) {
+            return pos_;
+        }
+        if (pos < text_.size() && (text_[pos] == 'e' || text_[pos] == 'E')) {
+            size_t exponent = pos + 1;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                ++exponent;
+            }
+            if (exponent < text_.size() && IsDigit(text_[exponent])) {
+                pos = SkipDigits(exponent);
+            }
+        }
+        return pos;
+    }
+
+    // CELL: [A-Z]+[0-9]+, pos_ if there is no match
+    size_t MatchCell() const {
+        size_t pos = pos_;
+        while (pos < text_.size() && IsUpper(text_[pos])) {
+            ++pos;
+        }
+        if (pos == pos_ || pos == text_.size() || !IsDigit(text_[pos])) {
+            return pos_;
+        }
+        return SkipDigits(pos);
+    }
+
+    // FUNC: [A-Z]+ right before '(', pos_ if there is no match
+    size_t MatchFunc() const {
+        size_t pos = pos_;
+        while (pos < text_.size() && IsUpper(text_[pos])) {
+            ++pos;
+        }
+        if (pos == pos_ || pos == text_.size() || text_[pos] != '(') {
+            return pos_;
+        }
+        return pos;
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
+};
+
+// Hand-written recursive-descent parser for the grammar in Formula.g4. It
+// builds the same nodes as ParseASTListener, without ANTLR's streams, token
+// objects and parse tree.
+//
+// Errors follow the ANTLR-based path: lexing and syntax errors throw
+// ParsingError. An invalid number or cell position is reported only once
+// the whole text has parsed, like the listener that sees them while walking
+// the finished tree. The first such problem in the text wins.
+class RecursiveDescentParser {
+public:
+    RecursiveDescentParser(std::string_view text, std::pmr::memory_resource* upstream)
+        : lexer_(text)
+        , storage_(Storage::Create(upstream)) {
+    }
+
+    FormulaAST Parse() {
+        NextToken();
+        auto root = ParseExpr(PREC_ADD);
+        if (token_.type != TokenType::End) {
+            FailAtToken();
+        }
+        if (deferred_error_) {
+            deferred_error_();
+        }
+        CheckNotRange(*root);
+        storage_->root = std::move(root);
+        return FormulaAST(std::move(storage_));
+    }
+
+private:
+    using TokenType = Lexer::TokenType;
+
+    // binary operator precedence, unary operators bind tighter than both
+    static constexpr int PREC_ADD = 1;
+    static constexpr int PREC_MUL = 2;
+
+    void NextToken() {
+        token_ = lexer_.Next();
+    }
+
+    [[noreturn]] void FailAtToken() const {
+        if (token_.type == TokenType::End) {
+            throw ParsingError("Error when parsing: <EOF>");
+        }
+        throw ParsingError("Error when parsing: " + std::string(token_.text));
+    }
+
+    ExprPtr ParseExpr(int min_precedence) {
+        auto lhs = ParseUnary();
+        while (true) {
+            int precedence;
+            BinaryOpExpr::Type type;
+            switch (token_.type) {
+            case TokenType::Add:
+                precedence = PREC_ADD;
+                type = BinaryOpExpr::Add;
+                break;
+            case TokenType::Sub:
+                precedence = PREC_ADD;
+                type = BinaryOpExpr::Subtract;
+                break;
+            case TokenType::Mul:
+                precedence = PREC_MUL;
+                type = BinaryOpExpr::Multiply;
+                break;
+            case TokenType::Div:
+                precedence = PREC_MUL;
+                type = BinaryOpExpr::Divide;
+                break;
+            default:
+                return lhs;
+            }
+            if (precedence < min_precedence) {
+                return lhs;
+            }
+            NextToken();
+            // left associative: the right operand takes only tighter operators
+            auto rhs = ParseExpr(precedence + 1);
+            DeferRangeCheck(*lhs);
+            DeferRangeCheck(*rhs);
+            lhs = storage_->MakeExpr<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+        }
+    }
+
+    ExprPtr ParseUnary() {
+        switch (token_.type) {
+        case TokenType::Add:
+        case TokenType::Sub: {
+            auto type = token_.type == TokenType::Sub ? UnaryOpExpr::UnaryMinus : UnaryOpExpr::UnaryPlus;
+            NextToken();
+            auto operand = ParseUnary();
+            DeferRangeCheck(*operand);
+            return storage_->MakeExpr<UnaryOpExpr>(type, std::move(operand));
+        }
+        case TokenType::LeftParen: {
+            NextToken();
+            auto expr = ParseExpr(PREC_ADD);
+            if (token_.type != TokenType::RightParen) {
+                FailAtToken();
+            }
+            NextToken();
+            return expr;
+        }
+        case TokenType::Number: {
+            auto node = storage_->MakeExpr<NumberExpr>(ParseNumber(token_.text));
+            NextToken();
+            return node;
+        }
+        case TokenType::Cell: {
+            auto value = ParsePosition(token_.text);
+            NextToken();
+            if (token_.type == TokenType::Colon) {
+                NextToken();
+                if (token_.type != TokenType::Cell) {
+                    FailAtToken();
+                }
+                storage_->ranges.push_front(MakeRange(value, ParsePosition(token_.text)));
+                NextToken();
+                return storage_->MakeExpr<RangeExpr>(&storage_->ranges.front());
+            }
+            storage_->cells.push_front(value);
+            return storage_->MakeExpr<CellExpr>(&storage_->cells.front());
+        }
+        case TokenType::Func:
+            return ParseFunction();
+        default:
+            FailAtToken();
+        }
+    }
+
+    ExprPtr ParseFunction() {
+        std::string_view name = token_.text;
+        NextToken();  // '(' always follows FUNC
+        std::pmr::vector<ExprPtr> args(&storage_->arena);
+        do {
+            NextToken();
+            args.push_back(ParseExpr(PREC_ADD));
+        } while (token_.type == TokenType::Comma);
+        if (token_.type != TokenType::RightParen) {
+            FailAtToken();
+        }
+        NextToken();
+
+        auto function = FindFunction(name);
+        if (!function) {
+            DeferError<ParsingError>("Unknown function: ", name);
+            function = Function::Sum;
+        } else if (args.size() > MAX_FUNCTION_ARGS) {
+            DeferError<ParsingError>("Too many arguments: ", name);
+        }
+        return storage_->MakeExpr<FunctionExpr>(*function, std::move(args));
+    }
+
+    Position ParsePosition(std::string_view text) {
+        auto value = Position::FromString(text);
+        if (!value.IsValid()) {
+            DeferError<FormulaException>("Invalid position: ", text);
+        }
+        return value;
+    }
+
+    void DeferRangeCheck(const Expr& expr) {
+        if (expr.GetRange()) {
+            DeferError<ParsingError>(MISPLACED_RANGE, {});
+        }
+    }
+
+    // keeps the first error, the one the listener would see first
+    template <typename Error>
+    void DeferError(const char* message, std::string_view text) {
+        if (!deferred_error_) {
+            deferred_error_ = [what = message + std::string(text)] {
+                throw Error(what);
+            };
+        }
+    }
+
+    double ParseNumber(std::string_view text) {
+        double value = 0;
+        auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (ec == std::errc() && ptr == text.data() + text.size()) {
+            return value;
+        }
+        // out of range: istream turns underflow into 0 and rejects overflow,
+        // the listener relies on that, so the rare case goes the same way
+        std::istringstream in{std::string(text)};
+        in >> value;
+        if (!in) {
+            DeferError<ParsingError>("Invalid number: ", text);
+        }
+        return value;
+    }
+
+    Lexer lexer_;
+    Lexer::Token token_;
+    Storage::Ptr storage_;
+    std::function<void()> deferred_error_;
+};
+
+constexpr const char* MALFORMED_TREE = "Malformed formula tree";
+
+// Rebuilds the tree written by FormulaAST::Serialize(). The nodes come in
+// postfix order, so operands wait on a stack for their operator.
+class TreeReader {
+public:
+    TreeReader(std::string_view data, std::pmr::memory_resource* upstream)
+        : data_(data)
+        , storage_(Storage::Create(upstream)) {
+    }
+
+    FormulaAST Read() {
+        while (!data_.empty()) {
+            ReadNode();
+        }
+        if (operands_.size() != 1) {
+            throw ParsingError(MALFORMED_TREE);
+        }
+        storage_->root = PopOperand();
+        return FormulaAST(std::move(storage_));
+    }
+
+private:
+    void ReadNode() {
+        switch (Take<NodeTag>()) {
+        case NodeTag::Number:
+            operands_.push_back(storage_->MakeExpr<NumberExpr>(Take<double>()));
+            break;
+        case NodeTag::Cell:
+            storage_->cells.push_front(TakePosition());
+            operands_.push_back(storage_->MakeExpr<CellExpr>(&storage_->cells.front()));
+            break;
+        case NodeTag::Range: {
+            const Position first = TakePosition();
+            const Position last = TakePosition();
+            if (first.row > last.row || first.col > last.col) {
+                throw ParsingError(MALFORMED_TREE);
+            }
+            storage_->ranges.push_front({first, last});
+            operands_.push_back(storage_->MakeExpr<RangeExpr>(&storage_->ranges.front()));
+            break;
+        }
+        case NodeTag::Unary: {
+            const auto type = Take<UnaryOpExpr::Type>();
+            if (type != UnaryOpExpr::UnaryPlus && type != UnaryOpExpr::UnaryMinus) {
+                throw ParsingError(MALFORMED_TREE);
+            }
+            auto operand = PopOperand();
+            operands_.push_back(storage_->MakeExpr<UnaryOpExpr>(type, std::move(operand)));
+            break;
+        }
+        case NodeTag::Binary: {
+            const auto type = Take<BinaryOpExpr::Type>();
+            if (type != BinaryOpExpr::Add && type != BinaryOpExpr::Subtract &&
+                type != BinaryOpExpr::Multiply && type != BinaryOpExpr::Divide) {
+                throw ParsingError(MALFORMED_TREE);
+            }
+            auto rhs = PopOperand();
+            auto lhs = PopOperand();
+            operands_.push_back(
+                storage_->MakeExpr<BinaryOpExpr>(type, std::move(lhs), std::move(rhs)));
+            break;
+        }
+        case NodeTag::Function: {
+            const auto function = Take<Function>();
+            const size_t arg_count = Take<std::uint16_t>();
+            if (static_cast<size_t>(function) >= std::size(FUNCTION_NAMES) || arg_count == 0 ||
+                arg_count > operands_.size()) {
+                throw ParsingError(MALFORMED_TREE);
+            }
+            auto first_arg = operands_.end() - arg_count;
+            std::pmr::vector<ExprPtr> args(std::make_move_iterator(first_arg),
+                                           std::make_move_iterator(operands_.end()),
+                                           &storage_->arena);
+            operands_.erase(first_arg, operands_.end());
+            operands_.push_back(storage_->MakeExpr<FunctionExpr>(function, std::move(args)));
+            break;
+        }
+        default:
+            throw ParsingError(MALFORMED_TREE);
+        }
+    }
+
+    template <typename T>
+    T Take() {
+        if (data_.size() < sizeof(T)) {
+            throw ParsingError(MALFORMED_TREE);
+        }
+        T value;
+        std::memcpy(&value, data_.data(), sizeof(T));
+        data_.remove_prefix(sizeof(T));
+        return value;
+    }
+
+    // a position or, in a relative AST, an offset between two positions
+    Position TakePosition() {
+        const std::int32_t row = Take<std::int32_t>();
+        const std::int32_t col = Take<std::int32_t>();
+        // DELETED_CELL is the smallest offset
+        if (row < -Position::MAX_ROWS || row >= Position::MAX_ROWS || col < -Position::MAX_COLS ||
+            col >= Position::MAX_COLS) {
+            throw ParsingError(MALFORMED_TREE);
+        }
+        return {row, col};
+    }
+
+    // a range is only an operand of a function
+    ExprPtr PopOperand() {
+        if (operands_.empty() || operands_.back()->GetRange()) {
+            throw ParsingError(MALFORMED_TREE);
+        }
+        auto operand = std::move(operands_.back());
+        operands_.pop_back();
+        return operand;
+    }
+
+    std::string_view data_;
+    Storage::Ptr storage_;
+    // declared after the storage, so destroyed before it
+    std::vector<ExprPtr> operands_;
+};
+
 }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+FormulaAST ParseFormulaAST(std::istream& in, std::pmr::memory_resource* upstream) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -424,39 +1250,273 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     parser.removeErrorListeners();
 
     tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
+    ASTImpl::ParseASTListener listener(upstream);
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return listener.MoveAST();
+}
+
+namespace {
+
+std::atomic<bool> parser_validation{false};
+
+// Everything the two parsers must agree on: the tree with full-precision
+// numbers and the cells, or the kind of error.
+template <typename Parse>
+std::string DescribeParse(Parse parse) {
+    try {
+        FormulaAST ast = parse();
+        std::ostringstream out;
+        out.precision(17);
+        ast.Print(out);
+        out << " | ";
+        ast.PrintCells(out);
+        return out.str();
+    } catch (const FormulaException&) {
+        return "invalid position";
+    } catch (const std::exception&) {
+        return "syntax error";
+    }
+}
+
+}  // namespace
+
+FormulaAST ParseFormulaAST(std::string_view in, std::pmr::memory_resource* upstream) {
+    if (parser_validation.load(std::memory_order_relaxed)) {
+        auto fast = DescribeParse([in] {
+            return ASTImpl::RecursiveDescentParser(in, std::pmr::get_default_resource()).Parse();
+        });
+        auto reference = DescribeParse([in] {
+            std::istringstream in_stream{std::string(in)};
+            return ParseFormulaAST(in_stream);
+        });
+        if (fast != reference) {
+            throw std::logic_error("Formula parsers disagree on \"" + std::string(in) + "\": " + fast +
+                                   " vs ANTLR " + reference);
+        }
+    }
+    return ASTImpl::RecursiveDescentParser(in, upstream).Parse();
+}
+
+void SetParserValidation(bool enabled) {
+    parser_validation.store(enabled, std::memory_order_relaxed);
+}
+
+bool MakeRelativeKey(std::string_view text, Position anchor, std::string& key) {
+    using ASTImpl::Lexer;
+
+    auto append_offset = [&key](int offset) {
+        char buffer[16];
+        key.append(buffer, std::to_chars(std::begin(buffer), std::end(buffer), offset).ptr);
+    };
+    key.clear();
+    try {
+        Lexer lexer(text);
+        for (auto token = lexer.Next(); token.type != Lexer::TokenType::End; token = lexer.Next()) {
+            if (token.type == Lexer::TokenType::Cell) {
+                const Position cell = Position::FromString(token.text);
+                if (!cell.IsValid()) {
+                    return false;
+                }
+                key += 'R';
+                append_offset(cell.row - anchor.row);
+                key += 'C';
+                append_offset(cell.col - anchor.col);
+            } else {
+                key += token.text;
+            }
+            // keeps "1 2" (an error) apart from "12"
+            key += ' ';
+        }
+    } catch (const ParsingError&) {
+        return false;
+    }
+    return true;
+}
+
+namespace ASTImpl {
+
+// One block of the upstream resource holds the storage header and the first
+// part of its arena.
+constexpr size_t STORAGE_BLOCK_SIZE = 512;
+constexpr size_t STORAGE_BLOCK_ALIGN = alignof(std::max_align_t);
+static_assert(sizeof(Storage) <= STORAGE_BLOCK_SIZE / 2, "no room for the nodes");
+
+void ExprDeleter::operator()(Expr* expr) const {
+    expr->~Expr();
+}
+
+Storage::Storage(std::pmr::memory_resource* upstream, void* buffer, size_t buffer_size)
+    : upstream(upstream)
+    , arena(buffer, buffer_size, upstream) {
+}
+
+Storage::Ptr Storage::Create(std::pmr::memory_resource* upstream) {
+    void* block = upstream->allocate(STORAGE_BLOCK_SIZE, STORAGE_BLOCK_ALIGN);
+    char* buffer = static_cast<char*>(block) + sizeof(Storage);
+    return Ptr(new (block) Storage(upstream, buffer, STORAGE_BLOCK_SIZE - sizeof(Storage)));
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+void Storage::Deleter::operator()(Storage* storage) const {
+    std::pmr::memory_resource* upstream = storage->upstream;
+    storage->~Storage();
+    upstream->deallocate(storage, STORAGE_BLOCK_SIZE, STORAGE_BLOCK_ALIGN);
 }
 
+}  // namespace ASTImpl
+
 void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
+    for (auto cell : storage_->cells) {
         out << cell.ToString() << ' ';
     }
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    storage_->root->Print(out);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+    storage_->root->PrintFormula(out, ASTImpl::EP_ATOM, anchor);
+}
+
+ExecResult FormulaAST::Execute(const CellValueGetter& fcell, Position anchor,
+                               const RangeValueGetter& frange) const {
+    using ASTImpl::Instruction;
+
+    // typical formulas fit into the stack buffer, deeper ones go to the heap
+    constexpr size_t INLINE_STACK_SIZE = 32;
+    double inline_stack[INLINE_STACK_SIZE];
+    std::vector<double> heap_stack;
+    double* stack = inline_stack;
+    if (max_stack_depth_ > INLINE_STACK_SIZE) {
+        heap_stack.resize(max_stack_depth_);
+        stack = heap_stack.data();
+    }
+
+    // the first error aborts the evaluation and becomes the result
+    const auto& code = storage_->code;
+    size_t top = 0;
+    for (size_t ip = 0; ip < code.size(); ++ip) {
+        const Instruction& instr = code[ip];
+        double result = 0;
+        switch (instr.code) {
+        case Instruction::Code::Number:
+            stack[top++] = instr.number;
+            continue;
+        case Instruction::Code::Cell: {
+            ExecResult value = ASTImpl::GetCellValue(ASTImpl::Anchored(instr.cell, anchor), fcell);
+            if (std::holds_alternative<FormulaError>(value)) {
+                return value;
+            }
+            stack[top++] = std::get<double>(value);
+            continue;
+        }
+        case Instruction::Code::Negate:
+            stack[top - 1] = -stack[top - 1];
+            continue;
+        case Instruction::Code::Range:
+            continue;
+        case Instruction::Code::Call: {
+            const Instruction::Call call = instr.call;
+            Aggregate aggregate;
+            top -= call.scalar_count;
+            aggregate.Add(stack + top, call.scalar_count);
+            for (size_t i = ip - call.range_count; i < ip; ++i) {
+                const CellRange range = ASTImpl::Anchored(*code[i].range, anchor);
+                if (auto error = ASTImpl::AddRange(range, fcell, frange, aggregate)) {
+                    return *error;
+                }
+            }
+            ExecResult value = ASTImpl::GetFunctionResult(call.function, aggregate);
+            if (std::holds_alternative<FormulaError>(value)) {
+                return value;
+            }
+            stack[top++] = std::get<double>(value);
+            continue;
+        }
+        case Instruction::Code::Add:
+            result = stack[top - 2] + stack[top - 1];
+            break;
+        case Instruction::Code::Subtract:
+            result = stack[top - 2] - stack[top - 1];
+            break;
+        case Instruction::Code::Multiply:
+            result = stack[top - 2] * stack[top - 1];
+            break;
+        case Instruction::Code::Divide:
+            result = stack[top - 2] / stack[top - 1];
+            break;
+        }
+        if (!std::isfinite(result)) {
+            return FormulaError(FormulaError::Category::Div0);
+        }
+        stack[--top - 1] = result;
+    }
+    assert(top == 1);
+    return stack[0];
+}
+
+ExecResult FormulaAST::ExecuteTree(const CellValueGetter& fcell, Position anchor,
+                                   const RangeValueGetter& frange) const {
+    return storage_->root->Evaluate(fcell, frange, anchor);
+}
+
+void FormulaAST::Compile() {
+    // compiled into a reused buffer and copied into the arena at the exact
+    // size, growing the vector right in the arena would waste it
+    static thread_local std::vector<ASTImpl::Instruction> code;
+    code.clear();
+    max_stack_depth_ = storage_->root->Compile(code);
+    storage_->code.assign(code.begin(), code.end());
+}
+
+void FormulaAST::MakeRelative(Position anchor) {
+    const Position shift{-anchor.row, -anchor.col};
+    // the tree points into the cell list, so it follows
+    for (auto& cell : storage_->cells) {
+        cell = ASTImpl::Anchored(cell, shift);
+    }
+    for (auto& range : storage_->ranges) {
+        range = ASTImpl::Anchored(range, shift);
+    }
+    for (auto& instr : storage_->code) {
+        if (instr.code == ASTImpl::Instruction::Code::Cell) {
+            instr.cell = ASTImpl::Anchored(instr.cell, shift);
+        }
+    }
+}
+
+void FormulaAST::RewritePositions(const std::function<Position(Position)>& cell,
+                                  const std::function<CellRange(const CellRange&)>& range) {
+    for (auto& stored : storage_->cells) {
+        stored = cell(stored);
+    }
+    // the nodes point into the list, sorting relinks it without moving them
+    storage_->cells.sort();
+    for (auto& stored : storage_->ranges) {
+        stored = range(stored);
+    }
+    for (auto& instr : storage_->code) {
+        if (instr.code == ASTImpl::Instruction::Code::Cell) {
+            instr.cell = cell(instr.cell);
+        }
+    }
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+FormulaAST::FormulaAST(ASTImpl::Storage::Ptr storage)
+    : storage_(std::move(storage)) {
+    storage_->cells.sort();  // to avoid sorting in GetReferencedCells
+    Compile();
 }
 
-double FormulaAST::Execute(CellPtr fcell) const {
-    return root_expr_->Evaluate(fcell);
+void FormulaAST::Serialize(std::string& out) const {
+    storage_->root->Serialize(out);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+FormulaAST FormulaAST::Deserialize(std::string_view data, std::pmr::memory_resource* upstream) {
+    return ASTImpl::TreeReader(data, upstream).Read();
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
@@ -3,16 +3,213 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
+#include <algorithm>
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <stdexcept>
-using CellPtr = std::function<CellInterface*(Position)>;
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+// Result of an evaluation: errors are returned as values, never thrown.
+using ExecResult = std::variant<double, FormulaError>;
+// Returns the value of a (valid) cell as a formula operand.
+using CellValueGetter = std::function<ExecResult(Position)>;
+
+// Rectangular block of cells A1:C3, both corners included. The parser stores
+// it with first at the top left and last at the bottom right.
+struct CellRange {
+    Position first;
+    Position last;
+
+    bool Contains(Position pos) const {
+        return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col &&
+               pos.col <= last.col;
+    }
+
+    bool operator==(const CellRange& rhs) const {
+        return first == rhs.first && last == rhs.last;
+    }
+};
+
+// Running totals of the numbers an aggregate function (SUM, MIN, ...) has
+// seen. A range adds its values in blocks: Add(values, count) keeps four
+// independent partial results, so the loops carry no dependency from one
+// element to the next and vectorize.
+class Aggregate {
+public:
+    void Add(double value) {
+        Add(&value, 1);
+    }
+
+    void Add(const double* values, size_t count) {
+        double sum[4] = {0, 0, 0, 0};
+        double min[4] = {min_, min_, min_, min_};
+        double max[4] = {max_, max_, max_, max_};
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            for (size_t lane = 0; lane < 4; ++lane) {
+                const double value = values[i + lane];
+                sum[lane] += value;
+                min[lane] = value < min[lane] ? value : min[lane];
+                max[lane] = value > max[lane] ? value : max[lane];
+            }
+        }
+        for (; i < count; ++i) {
+            sum[0] += values[i];
+            min[0] = values[i] < min[0] ? values[i] : min[0];
+            max[0] = values[i] > max[0] ? values[i] : max[0];
+        }
+        sum_ += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+        min_ = std::min(std::min(min[0], min[1]), std::min(min[2], min[3]));
+        max_ = std::max(std::max(max[0], max[1]), std::max(max[2], max[3]));
+        count_ += count;
+    }
+
+    double GetSum() const {
+        return sum_;
+    }
+    // MIN and MAX of no numbers are 0, as in the usual spreadsheets
+    double GetMin() const {
+        return count_ ? min_ : 0.0;
+    }
+    double GetMax() const {
+        return count_ ? max_ : 0.0;
+    }
+    size_t GetCount() const {
+        return count_;
+    }
+
+private:
+    double sum_ = 0;
+    double min_ = std::numeric_limits<double>::infinity();
+    double max_ = -std::numeric_limits<double>::infinity();
+    size_t count_ = 0;
+};
+
+// Adds the numbers of a range to the aggregate. Empty cells and text that is
+// not a number are skipped; the first error stops the walk and is returned.
+using RangeValueGetter = std::function<std::optional<FormulaError>(CellRange, Aggregate&)>;
 
 namespace ASTImpl {
 
 class Expr;
+
+// Absolute position of a cell stored relative to the formula's anchor.
+inline Position Anchored(Position cell, Position anchor) {
+    return {cell.row + anchor.row, cell.col + anchor.col};
 }
 
+inline CellRange Anchored(const CellRange& range, Position anchor) {
+    return {Anchored(range.first, anchor), Anchored(range.last, anchor)};
+}
+
+// Stored position of a reference whose cell was deleted together with its
+// row or column. It stays invalid whatever the anchor, so the reference
+// prints as #REF! and evaluates to a #REF! error. A deleted range has it in
+// both corners.
+inline constexpr Position DELETED_CELL{-Position::MAX_ROWS, -Position::MAX_COLS};
+
+// Instruction of the postfix bytecode the AST is compiled to.
+// Operands are pushed onto the evaluation stack, operators pop their
+// arguments and push the result.
+struct Instruction {
+    enum class Code : std::uint8_t {
+        Number,  // push number
+        Cell,    // push value of cell
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+        Range,  // argument of the next Call, skipped on its own
+        Call,   // aggregate function
+    };
+
+    enum class Function : std::uint8_t { Sum, Min, Max, Average, Count };
+
+    // Operands of an aggregate call: scalar_count values popped from the
+    // stack and range_count Range instructions right before the Call.
+    struct Call {
+        Function function;
+        std::uint16_t scalar_count;
+        std::uint16_t range_count;
+    };
+
+    Instruction(Code code)
+        : code(code)
+        , number(0) {
+    }
+    Instruction(double value)
+        : code(Code::Number)
+        , number(value) {
+    }
+    Instruction(Position pos)
+        : code(Code::Cell)
+        , cell(pos) {
+    }
+    Instruction(const CellRange* range)
+        : code(Code::Range)
+        , range(range) {
+    }
+    Instruction(Call call)
+        : code(Code::Call)
+        , call(call) {
+    }
+
+    Code code;
+    union {
+        double number;
+        Position cell;
+        const CellRange* range;  // points into FormulaAST::ranges_
+        Call call;
+    };
+};
+
+// Destroys a node allocated in a Storage. The memory itself is released
+// together with the storage.
+struct ExprDeleter {
+    void operator()(Expr* expr) const;
+};
+
+using ExprPtr = std::unique_ptr<Expr, ExprDeleter>;
+
+// Everything one AST allocates: the nodes, the cell and range lists and the
+// bytecode are bump-allocated in one arena and freed all at once. The
+// storage is a single block taken from the upstream resource, with room for
+// a typical formula right after the header; larger formulas take further
+// blocks from upstream.
+struct Storage {
+    struct Deleter {
+        void operator()(Storage* storage) const;
+    };
+    using Ptr = std::unique_ptr<Storage, Deleter>;
+
+    static Ptr Create(std::pmr::memory_resource* upstream);
+
+    Storage(std::pmr::memory_resource* upstream, void* buffer, size_t buffer_size);
+
+    template <typename Node, typename... Args>
+    ExprPtr MakeExpr(Args&&... args) {
+        void* memory = arena.allocate(sizeof(Node), alignof(Node));
+        return ExprPtr(new (memory) Node(std::forward<Args>(args)...));
+    }
+
+    std::pmr::memory_resource* upstream;
+    std::pmr::monotonic_buffer_resource arena;
+    // declared after the arena, so destroyed before it
+    ExprPtr root;
+    std::pmr::forward_list<Position> cells{&arena};
+    std::pmr::forward_list<CellRange> ranges{&arena};
+    std::pmr::vector<Instruction> code{&arena};
+};
+}  // namespace ASTImpl
+
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
@@ -20,29 +217,83 @@ class ParsingError : public std::runtime_error {
 class FormulaAST {
 public:
 
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    // storage holds the tree and the cells and ranges it points to
+    explicit FormulaAST(ASTImpl::Storage::Ptr storage);
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(CellPtr fcell) const;
+    // Evaluates the compiled bytecode. Cell positions are shifted by anchor,
+    // which is only non-zero for relative ASTs (see MakeRelative()).
+    // Ranges are read through frange; without it every cell of a range is
+    // read through fcell and nothing is skipped.
+    ExecResult Execute(const CellValueGetter& fcell, Position anchor = {0, 0},
+                       const RangeValueGetter& frange = {}) const;
+    // Evaluates by walking the tree; kept as a reference implementation.
+    ExecResult ExecuteTree(const CellValueGetter& fcell, Position anchor = {0, 0},
+                           const RangeValueGetter& frange = {}) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void PrintFormula(std::ostream& out, Position anchor = {0, 0}) const;
 
-    std::forward_list<Position>& GetCells() {
-        return cells_;
+    // Stores every cell relative to anchor, so that the AST can be shared by
+    // all formulas with the same relative form: each of them passes its own
+    // cell as the anchor.
+    void MakeRelative(Position anchor);
+
+    // Replaces every stored cell position p with cell(p) and every range r
+    // with range(r) in place, without rebuilding the tree. Used when rows or
+    // columns of the sheet are inserted or deleted.
+    void RewritePositions(const std::function<Position(Position)>& cell,
+                          const std::function<CellRange(const CellRange&)>& range);
+
+    std::pmr::forward_list<Position>& GetCells() {
+        return storage_->cells;
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    const std::pmr::forward_list<Position>& GetCells() const {
+        return storage_->cells;
     }
 
+    // ranges passed to functions
+    const std::pmr::forward_list<CellRange>& GetRanges() const {
+        return storage_->ranges;
+    }
+
+    const std::pmr::vector<ASTImpl::Instruction>& GetCode() const {
+        return storage_->code;
+    }
+
+    // Appends the tree to out in a compact binary form: the nodes in postfix
+    // order, numbers and positions in native byte order.
+    void Serialize(std::string& out) const;
+    // Rebuilds an AST written by Serialize() without parsing any text.
+    // Malformed data throws ParsingError.
+    static FormulaAST Deserialize(std::string_view data,
+                                  std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    void Compile();
+
+    ASTImpl::Storage::Ptr storage_;
+    size_t max_stack_depth_ = 0;
 };
 
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+// Parses with the ANTLR-generated parser, the reference implementation.
+// The AST memory comes from upstream (see ASTImpl::Storage).
+FormulaAST ParseFormulaAST(std::istream& in,
+                           std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+// Parses with the hand-written recursive-descent parser. Accepts and rejects
+// exactly what the ANTLR parser does: syntax errors throw ParsingError,
+// invalid cell positions throw FormulaException.
+FormulaAST ParseFormulaAST(std::string_view in,
+                           std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+// In validation mode every ParseFormulaAST(std::string_view) call also runs
+// the ANTLR parser and throws std::logic_error if the results differ.
+void SetParserValidation(bool enabled);
+
+// Writes to key a canonical form of the formula in which cell references are
+// offsets from anchor (R1C1 style): =A1*B1 in C1 and =A2*B2 in C2 get the
+// same key. Returns false if the text does not lex or refers to an invalid
+// position; such formulas are not shared.
+bool MakeRelativeKey(std::string_view text, Position anchor, std::string& key);
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Простейший раннер для замеров производительности. Каждый бенчмарк - функция,
+// принимающая BenchRunner&, внутри которой отдельные замеры делаются через
+// Measure(). Результаты печатаются в std::cerr и запоминаются, чтобы в конце
+// их можно было выгрузить в JSON через WriteJson().
+class BenchRunner {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit BenchRunner(std::string filter = {}) :
+        filter_(std::move(filter)){
+    }
+
+    template <class BenchFunc>
+    void RunBench(BenchFunc func, const std::string& bench_name) {
+        if (!filter_.empty() && bench_name.find(filter_) == std::string::npos){
+            return;
+        }
+        bench_name_ = bench_name;
+        std::cerr << bench_name << std::endl;
+        func(*this);
+    }
+
+    template <class Func>
+    double Measure(const std::string& name, Func func) {
+        auto start = Clock::now();
+        func();
+        double ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        Report(name, ms, "ms");
+        return ms;
+    }
+
+    // Печатает пропускную способность замера, в котором обработано bytes байт.
+    void ReportThroughput(const std::string& name, size_t bytes, double ms) {
+        Report(name, bytes / 1e6 / (ms / 1e3), "MB/s");
+    }
+
+    // Печатает произвольную величину замера с единицей измерения.
+    void Report(const std::string& name, double value, const std::string& unit) {
+        std::cerr << "    " << name << ": " << value << " " << unit << std::endl;
+        results_.push_back({bench_name_, name, value, unit});
+    }
+
+    // Выгружает все результаты одним JSON-объектом: условия запуска и массив
+    // results с полями bench, name, value, unit. Имена замеров стабильны,
+    // так что файлы разных запусков можно сравнивать построчно.
+    void WriteJson(std::ostream& output) const {
+        output << "{\n";
+        output << "  \"compiler\": ";
+        WriteString(output, COMPILER);
+        output << ",\n  \"build\": ";
+#ifdef NDEBUG
+        WriteString(output, "release");
+#else
+        WriteString(output, "debug");
+#endif
+        output << ",\n  \"hardware_threads\": " << std::thread::hardware_concurrency();
+        output << ",\n  \"filter\": ";
+        WriteString(output, filter_);
+        output << ",\n  \"results\": [";
+        const auto precision = output.precision(10);
+        for (size_t i = 0; i < results_.size(); ++i){
+            const Result& result = results_[i];
+            output << (i ? ",\n" : "\n") << "    {\"bench\": ";
+            WriteString(output, result.bench);
+            output << ", \"name\": ";
+            WriteString(output, result.name);
+            output << ", \"value\": ";
+            // inf и nan в JSON не бывает
+            if (std::isfinite(result.value)){
+                output << result.value;
+            }
+            else{
+                output << "null";
+            }
+            output << ", \"unit\": ";
+            WriteString(output, result.unit);
+            output << "}";
+        }
+        output.precision(precision);
+        output << "\n  ]\n}\n";
+    }
+
+    // Не даёт компилятору выбросить вычисление, результат которого не используется.
+    template <class T>
+    static void DoNotOptimize(const T& value) {
+#if defined(__GNUC__)
+        asm volatile("" : : "g"(&value) : "memory");
+#else
+        static volatile const void* sink;
+        sink = &value;
+#endif
+    }
+
+private:
+    struct Result {
+        std::string bench;
+        std::string name;
+        double value;
+        std::string unit;
+    };
+
+#if defined(__clang__)
+    static constexpr const char* COMPILER = "clang " __clang_version__;
+#elif defined(__GNUC__)
+    static constexpr const char* COMPILER = "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+    static constexpr const char* COMPILER = "msvc";
+#else
+    static constexpr const char* COMPILER = "unknown";
+#endif
+
+    static void WriteString(std::ostream& output, const std::string& text) {
+        output << '"';
+        for (char ch : text){
+            if (ch == '"' || ch == '\\'){
+                output << '\\' << ch;
+            }
+            else if (static_cast<unsigned char>(ch) < 0x20){
+                output << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                       << static_cast<int>(ch) << std::dec << std::setfill(' ');
+            }
+            else{
+                output << ch;
+            }
+        }
+        output << '"';
+    }
+
+    std::string filter_;
+    std::string bench_name_;
+    std::vector<Result> results_;
+};
+
+#define RUN_BENCH(br, func) br.RunBench(func, #func)
@@ -0,0 +1,1221 @@
+#include "../celltable.h"
+#include "../common.h"
+#include "../formula.h"
+#include "../FormulaAST.h"
+#include "../importer.h"
+#include "../sheet.h"
+#include "bench_runner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// Занятая куча в байтах. Размер блока operator new хранит перед самим блоком.
+std::atomic<std::int64_t> heap_bytes{0};
+// Число вызовов operator new.
+std::atomic<std::int64_t> heap_allocations{0};
+const std::size_t HEAP_HEADER_SIZE = alignof(std::max_align_t);
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+    void* block = std::malloc(size + HEAP_HEADER_SIZE);
+    if (!block){
+        throw std::bad_alloc();
+    }
+    *static_cast<std::size_t*>(block) = size;
+    heap_bytes += size;
+    ++heap_allocations;
+    return static_cast<char*>(block) + HEAP_HEADER_SIZE;
+}
+
+void operator delete(void* ptr) noexcept {
+    if (!ptr){
+        return;
+    }
+    char* block = static_cast<char*>(ptr) - HEAP_HEADER_SIZE;
+    heap_bytes -= *reinterpret_cast<std::size_t*>(block);
+    std::free(block);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    operator delete(ptr);
+}
+
+namespace {
+
+const int FILL_ROWS = 1000;
+const int FILL_COLS = 100;
+
+std::vector<Position> MakePositions(bool shuffle) {
+    std::vector<Position> positions;
+    positions.reserve(FILL_ROWS * FILL_COLS);
+    for (int row = 0; row < FILL_ROWS; ++row){
+        for (int col = 0; col < FILL_COLS; ++col){
+            positions.push_back({row, col});
+        }
+    }
+    if (shuffle){
+        std::shuffle(positions.begin(), positions.end(), std::mt19937(42));
+    }
+    return positions;
+}
+
+// Хеш, который использовался в cell.h до перехода на CellTable.
+struct OldPositionHash {
+    std::size_t operator()(const Position& position) const noexcept {
+        return (position.row < 12) + position.col;
+    }
+};
+
+// Прежняя схема хранения: отдельная аллокация на каждую ячейку в хеш-таблице.
+template <class Hash>
+class MapStorage {
+public:
+    Cell& Insert(Position pos) {
+        auto& cell = table_[pos];
+        if (!cell){
+            cell = std::make_unique<Cell>();
+        }
+        return *cell;
+    }
+
+    const Cell* Find(Position pos) const {
+        auto it = table_.find(pos);
+        return it == table_.end() ? nullptr : it->second.get();
+    }
+
+private:
+    std::unordered_map<Position, std::unique_ptr<Cell>, Hash> table_;
+};
+
+template <class Storage>
+void BenchStorage(BenchRunner& br, const std::string& name) {
+    const auto sequential = MakePositions(false);
+    const auto random = MakePositions(true);
+
+    Storage seq_storage;
+    br.Measure(name + " sequential fill", [&] {
+        for (Position pos : sequential){
+            seq_storage.Insert(pos);
+        }
+    });
+
+    Storage rnd_storage;
+    br.Measure(name + " random fill", [&] {
+        for (Position pos : random){
+            rnd_storage.Insert(pos);
+        }
+    });
+
+    br.Measure(name + " column scan", [&] {
+        int found = 0;
+        for (int col = 0; col < FILL_COLS; ++col){
+            for (int row = 0; row < FILL_ROWS; ++row){
+                found += seq_storage.Find({row, col}) != nullptr;
+            }
+        }
+        BenchRunner::DoNotOptimize(found);
+    });
+}
+
+void BenchCellStorage(BenchRunner& br) {
+    BenchStorage<MapStorage<OldPositionHash>>(br, "unordered_map (old hash)");
+    BenchStorage<MapStorage<std::hash<Position>>>(br, "unordered_map");
+    BenchStorage<CellTable>(br, "CellTable");
+
+    br.Measure("Sheet SetCell + GetCell", [] {
+        auto sheet = CreateSheet();
+        for (Position pos : MakePositions(true)){
+            sheet->SetCell(pos, "1");
+        }
+        int found = 0;
+        for (Position pos : MakePositions(false)){
+            found += sheet->GetCell(pos) != nullptr;
+        }
+        BenchRunner::DoNotOptimize(found);
+    });
+}
+
+void BenchFormulaEvaluation(BenchRunner& br) {
+    Sheet sheet;
+    for (int row = 0; row < 10; ++row){
+        sheet.SetCell({row, 0}, std::to_string(row + 1));
+    }
+    const FormulaAST ast = ParseFormulaAST(
+        "(A1+A2*A3-A4/A5)*(A6+A7)-(A8-A9)/A10+1.5*(2+3*(4-5/(6+7)))-(A1*A2+A3*A4)/(A5-A6*A7)");
+    const CellValueGetter fcell = [&sheet](Position pos) {
+        return sheet.GetCellNumber(pos);
+    };
+    const int iterations = 200000;
+
+    br.Measure("tree", [&] {
+        double sum = 0;
+        for (int i = 0; i < iterations; ++i){
+            sum += std::get<double>(ast.ExecuteTree(fcell));
+        }
+        BenchRunner::DoNotOptimize(sum);
+    });
+    br.Measure("bytecode", [&] {
+        double sum = 0;
+        for (int i = 0; i < iterations; ++i){
+            sum += std::get<double>(ast.Execute(fcell));
+        }
+        BenchRunner::DoNotOptimize(sum);
+    });
+}
+
+void BenchErrorPropagation(BenchRunner& br) {
+    const int rows = 10000;
+    const int cols = 5;
+    const int cells = rows * cols;
+    auto sheet = CreateSheet();
+    sheet->SetCell({0, 0}, "=1/0");
+    for (int row = 0; row < rows; ++row){
+        for (int col = 1; col <= cols; ++col){
+            sheet->SetCell({row, col}, "=A1+1");
+        }
+    }
+
+    br.Measure("read 50k error cells", [&] {
+        int errors = 0;
+        for (int row = 0; row < rows; ++row){
+            for (int col = 1; col <= cols; ++col){
+                errors += std::holds_alternative<FormulaError>(sheet->GetCell({row, col})->GetValue());
+            }
+        }
+        BenchRunner::DoNotOptimize(errors);
+    });
+
+    // Раньше #DIV/0 бросался дважды на каждое чтение: при делении в A1 и при
+    // чтении A1 из формулы. Замер показывает цену этих исключений.
+    br.Measure("old path: 2 throws per read", [&] {
+        int errors = 0;
+        for (int i = 0; i < 2 * cells; ++i){
+            try{
+                throw FormulaError(FormulaError::Category::Div0);
+            }
+            catch (const FormulaError&){
+                ++errors;
+            }
+        }
+        BenchRunner::DoNotOptimize(errors);
+    });
+}
+
+void BenchRecalculateChain(BenchRunner& br) {
+    const int length = 50000;
+    auto chain_pos = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+    Sheet sheet;
+    for (int i = length - 1; i > 0; --i){
+        sheet.SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+    }
+    sheet.SetCell(chain_pos(0), "1");
+
+    br.Measure("first evaluation of 50k chain", [&] {
+        BenchRunner::DoNotOptimize(sheet.GetCell(chain_pos(length - 1))->GetValue());
+    });
+    br.Measure("edit head + Recalculate", [&] {
+        sheet.SetCell(chain_pos(0), "2");
+        sheet.Recalculate();
+    });
+}
+
+void BenchParallelRecalculation(BenchRunner& br) {
+    const int rows = Position::MAX_ROWS;
+    const int formula_cols = 6;
+    const size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < max_threads; threads *= 2){
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    for (size_t threads : thread_counts){
+        Sheet sheet;
+        sheet.SetRecalculationThreads(threads);
+        for (int row = 0; row < rows; ++row){
+            const std::string data = Position{row, 0}.ToString();
+            sheet.SetCell({row, 0}, std::to_string(row % 100));
+            for (int col = 1; col <= formula_cols; ++col){
+                sheet.SetCell({row, col}, "=" + data + "*2+" + data + "/3-" + std::to_string(col));
+            }
+        }
+        br.Measure("Recalculate ~100k independent formulas, threads=" + std::to_string(threads), [&] {
+            sheet.Recalculate();
+        });
+    }
+}
+
+void BenchBatchImport(BenchRunner& br) {
+    // нарастающий итог: каждая строка ссылается на предыдущую
+    const int rows = 4000;
+    auto make_cells = [&] {
+        std::vector<std::pair<Position, std::string>> cells;
+        cells.push_back({{0, 0}, "1"});
+        for (int row = 1; row < rows; ++row){
+            cells.push_back({{row, 0}, "=A" + std::to_string(row) + "+1"});
+        }
+        return cells;
+    };
+
+    br.Measure("SetCell x 4000 running totals", [&] {
+        Sheet sheet;
+        for (auto& [pos, text] : make_cells()){
+            sheet.SetCell(pos, std::move(text));
+        }
+    });
+    br.Measure("SetCells 4000 running totals", [&] {
+        Sheet sheet;
+        sheet.SetCells(make_cells());
+    });
+}
+
+void BenchCachedValues(BenchRunner& br) {
+    const int rows = 10000;
+    const int passes = 20;
+    Sheet sheet;
+    sheet.SetCell({0, 0}, "=1/0");
+    sheet.SetCell({0, 1}, "'12.5");
+    for (int row = 1; row <= rows; ++row){
+        sheet.SetCell({row, 0}, "=A1*2");
+        sheet.SetCell({row, 1}, "=B1*2");
+    }
+
+    auto read_column = [&](int col) {
+        int errors = 0;
+        for (int pass = 0; pass < passes; ++pass){
+            for (int row = 1; row <= rows; ++row){
+                errors += std::holds_alternative<FormulaError>(sheet.GetCell({row, col})->GetValue());
+            }
+        }
+        BenchRunner::DoNotOptimize(errors);
+    };
+    br.Measure("20 reads of 10k formulas over an error cell", [&] {
+        read_column(0);
+    });
+    br.Measure("20 reads of 10k formulas over a text cell", [&] {
+        read_column(1);
+    });
+    br.Measure("200k reads of an escaped text cell", [&] {
+        size_t length = 0;
+        for (int i = 0; i < passes * rows; ++i){
+            length += std::get<std::string>(sheet.GetCell({0, 1})->GetValue()).size();
+        }
+        BenchRunner::DoNotOptimize(length);
+    });
+
+    // длинный текст не помещается внутри std::string: формулы читают его
+    // число, вычисленное при записи, а печать - сам текст, без копий
+    const std::string long_number(40, '1');
+    sheet.SetCell({0, 2}, long_number);
+    for (int row = 1; row <= rows; ++row){
+        sheet.SetCell({row, 2}, "=C1*2");
+        sheet.SetCell({row, 3}, std::string(40, 'a' + row % 26));
+    }
+    std::int64_t allocations = 0;
+    // пересчёт над текстом выделяет память не больше, чем над числом
+    auto recalculate_over = [&](const std::string& name, const std::string& text) {
+        sheet.Recalculate();
+        sheet.SetCell({0, 2}, text);
+        allocations = heap_allocations;
+        sheet.Recalculate();
+        br.Report("heap allocations per formula recalculated over " + name,
+                  static_cast<double>(heap_allocations - allocations) / rows, "allocs");
+    };
+    recalculate_over("a number cell", "5");
+    recalculate_over("a long text cell", "'" + long_number);
+    br.Measure("20 reads of 10k formulas over a long text cell", [&] {
+        read_column(2);
+    });
+    std::ostringstream output;
+    allocations = heap_allocations;
+    sheet.PrintValues(output);
+    br.Report("heap allocations per long text cell printed",
+              static_cast<double>(heap_allocations - allocations) / rows, "allocs");
+}
+
+void BenchTextOperands(BenchRunner& br) {
+    // числа, импортированные из CSV как текст
+    Sheet sheet;
+    for (int row = 0; row < 10; ++row){
+        sheet.SetCell({row, 0}, std::to_string(row * 1.25 + 1000.125));
+    }
+    const FormulaAST ast = ParseFormulaAST("A1+A2+A3+A4+A5+A6+A7+A8+A9+A10");
+    const int iterations = 200000;
+
+    // так число получалось, пока его не стали вычислять при записи текста
+    const CellValueGetter parse_every_time = [&sheet](Position pos) -> ExecResult {
+        const CellInterface* cell = sheet.GetCell(pos);
+        return TextToNumber(std::get<std::string>(cell->GetValue()));
+    };
+    const CellValueGetter cached = [&sheet](Position pos) {
+        return sheet.GetCellNumber(pos);
+    };
+    br.Measure("parse text on every read", [&] {
+        double sum = 0;
+        for (int i = 0; i < iterations; ++i){
+            sum += std::get<double>(ast.Execute(parse_every_time));
+        }
+        BenchRunner::DoNotOptimize(sum);
+    });
+    br.Measure("pre-parsed number", [&] {
+        double sum = 0;
+        for (int i = 0; i < iterations; ++i){
+            sum += std::get<double>(ast.Execute(cached));
+        }
+        BenchRunner::DoNotOptimize(sum);
+    });
+}
+
+}  // namespace
+
+// Поток, который только считает записанные байты.
+class CountingBuffer : public std::streambuf {
+public:
+    size_t GetCount() const {
+        return count_;
+    }
+
+protected:
+    std::streamsize xsputn(const char*, std::streamsize count) override {
+        count_ += count;
+        return count;
+    }
+    int_type overflow(int_type ch) override {
+        ++count_;
+        return ch;
+    }
+
+private:
+    size_t count_ = 0;
+};
+
+void MeasurePrint(BenchRunner& br, const std::string& name, const Sheet& sheet) {
+    for (bool values : {true, false}){
+        CountingBuffer buffer;
+        std::ostream output(&buffer);
+        const std::string print_name = name + (values ? ", PrintValues" : ", PrintTexts");
+        double ms = br.Measure(print_name, [&] {
+            values ? sheet.PrintValues(output) : sheet.PrintTexts(output);
+        });
+        br.ReportThroughput(print_name, buffer.GetCount(), ms);
+    }
+}
+
+void BenchPrint(BenchRunner& br) {
+    {
+        Sheet sheet;
+        std::mt19937 generator(17);
+        for (int row = 0; row < FILL_ROWS; ++row){
+            for (int col = 0; col < FILL_COLS; ++col){
+                switch (generator() % 3){
+                case 0:
+                    sheet.SetCell({row, col}, std::to_string(generator() % 100000 / 7.0));
+                    break;
+                case 1:
+                    sheet.SetCell({row, col}, "cell text " + std::to_string(row));
+                    break;
+                default:
+                    sheet.SetCell({row, col}, "=" + Position{row, (col + 1) % FILL_COLS}.ToString() + "/3");
+                }
+            }
+        }
+        // формулы вычисляются при первой печати, в замер это не входит
+        CountingBuffer warm_up;
+        std::ostream warm_up_output(&warm_up);
+        sheet.PrintValues(warm_up_output);
+        MeasurePrint(br, "dense 1000x100", sheet);
+    }
+    {
+        Sheet sheet;
+        for (int i = 0; i < 1000; ++i){
+            sheet.SetCell({i * 4, i * 4}, std::to_string(i));
+        }
+        MeasurePrint(br, "sparse 4000x4000, 1000 cells", sheet);
+    }
+}
+
+void BenchClearReverse(BenchRunner& br) {
+    // Очистка с правого нижнего угла: каждая ячейка на момент очистки
+    // крайняя, и размер листа пересчитывается после каждой
+    const int rows = 200;
+    const int cols = 100;
+    auto fill = [](Sheet& sheet) {
+        for (int row = 0; row < rows; ++row){
+            for (int col = 0; col < cols; ++col){
+                sheet.SetCell({row, col}, "x");
+            }
+        }
+    };
+    {
+        Sheet sheet;
+        fill(sheet);
+        br.Measure("clear 200x100 in reverse, row by row", [&] {
+            for (int row = rows - 1; row >= 0; --row){
+                for (int col = cols - 1; col >= 0; --col){
+                    sheet.ClearCell({row, col});
+                    BenchRunner::DoNotOptimize(sheet.GetPrintableSize());
+                }
+            }
+        });
+    }
+    {
+        Sheet sheet;
+        fill(sheet);
+        br.Measure("clear 200x100 in reverse, column by column", [&] {
+            for (int col = cols - 1; col >= 0; --col){
+                for (int row = rows - 1; row >= 0; --row){
+                    sheet.ClearCell({row, col});
+                    BenchRunner::DoNotOptimize(sheet.GetPrintableSize());
+                }
+            }
+        });
+    }
+}
+
+void BenchParse(BenchRunner& br) {
+    const int count = 100000;
+    std::vector<std::string> formulas;
+    formulas.reserve(count);
+    for (int i = 0; i < count; ++i){
+        formulas.push_back("(A" + std::to_string(i % 1000 + 1) + "+B" + std::to_string(i % 77 + 1) +
+                           ")*2.5-C3/(" + std::to_string(i) + "+1e-3)");
+    }
+    br.Measure("parse 100k formulas, recursive descent", [&] {
+        for (const auto& text : formulas){
+            BenchRunner::DoNotOptimize(ParseFormulaAST(text));
+        }
+    });
+    br.Measure("parse 100k formulas, ANTLR", [&] {
+        for (const auto& text : formulas){
+            std::istringstream in(text);
+            BenchRunner::DoNotOptimize(ParseFormulaAST(in));
+        }
+    });
+}
+
+void BenchFillDown(BenchRunner& br) {
+    // одна и та же относительная формула, скопированная вниз по столбцам
+    const int rows = 16000;
+    const int columns = 6;
+    Sheet sheet;
+    br.Measure("fill down =A1*B1 pattern, 96k formulas", [&] {
+        for (int col = 0; col < columns; ++col){
+            const std::string lhs = Position{0, col * 3}.ToString();
+            const std::string rhs = Position{0, col * 3 + 1}.ToString();
+            const std::string lhs_col = lhs.substr(0, lhs.size() - 1);
+            const std::string rhs_col = rhs.substr(0, rhs.size() - 1);
+            for (int row = 0; row < rows; ++row){
+                const std::string r = std::to_string(row + 1);
+                sheet.SetCell({row, col * 3 + 2}, "=" + lhs_col + r + "*" + rhs_col + r);
+            }
+        }
+    });
+    br.Measure("evaluate 96k formulas", [&] {
+        for (int col = 0; col < columns; ++col){
+            for (int row = 0; row < rows; ++row){
+                BenchRunner::DoNotOptimize(sheet.GetCell({row, col * 3 + 2})->GetValue());
+            }
+        }
+    });
+}
+
+void BenchRangeSum(BenchRunner& br) {
+    // 64k чисел и формулы, суммирующие их целиком
+    const int rows = 16000;
+    const int columns = 4;
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row){
+        for (int col = 0; col < columns; ++col){
+            sheet.SetCell({row, col}, std::to_string(row % 100 + col));
+        }
+    }
+    const std::string range = "A1:" + Position{rows - 1, columns - 1}.ToString();
+    const int formulas = 100;
+    br.Measure("set 100 x SUM over 64k cells", [&] {
+        for (int i = 0; i < formulas; ++i){
+            sheet.SetCell({i, 10}, "=SUM(" + range + ")+" + std::to_string(i));
+        }
+    });
+    br.Measure("evaluate 100 x SUM over 64k cells", [&] {
+        for (int i = 0; i < formulas; ++i){
+            BenchRunner::DoNotOptimize(sheet.GetCell({i, 10})->GetValue());
+        }
+    });
+
+    FormulaAST ast = ParseFormulaAST("SUM(" + range + ")");
+    auto fcell = [&sheet](Position pos) {
+        return sheet.GetCellNumber(pos);
+    };
+    auto frange = [&sheet](CellRange cells, Aggregate& aggregate) {
+        return sheet.AddRangeNumbers(cells, aggregate);
+    };
+    br.Measure("100 x SUM over 64k cells, cell by cell", [&] {
+        for (int i = 0; i < formulas; ++i){
+            BenchRunner::DoNotOptimize(ast.Execute(fcell));
+        }
+    });
+    br.Measure("100 x SUM over 64k cells, range kernel", [&] {
+        for (int i = 0; i < formulas; ++i){
+            BenchRunner::DoNotOptimize(ast.Execute(fcell, {0, 0}, frange));
+        }
+    });
+}
+
+void BenchRangeDependences(BenchRunner& br) {
+    // столбец чисел во всю высоту листа, скользящие суммы по 64 строки и
+    // сумма всего столбца: каждая правка числа задевает 65 формул из 16k
+    const int rows = Position::MAX_ROWS;
+    const int window = 64;
+    Sheet sheet;
+    for (int row = 0; row < rows; ++row){
+        sheet.SetCell({row, 0}, std::to_string(row % 10));
+    }
+    br.Measure("set 16k window sums + column sum", [&] {
+        for (int row = 0; row + window <= rows; ++row){
+            sheet.SetCell({row, 1}, "=SUM(" + Position{row, 0}.ToString() + ":" +
+                                        Position{row + window - 1, 0}.ToString() + ")");
+        }
+        sheet.SetCell({0, 2}, "=SUM(A1:" + Position{rows - 1, 0}.ToString() + ")");
+    });
+    sheet.Recalculate();
+    br.Measure("edit 16k numbers under range formulas", [&] {
+        for (int row = 0; row < rows; ++row){
+            sheet.SetCell({row, 0}, std::to_string(row % 7));
+        }
+    });
+    br.Measure("recalculate", [&] {
+        sheet.Recalculate();
+    });
+}
+
+void BenchCycleCheck(BenchRunner& br) {
+    const int length = 5000;
+    auto build_chain = [](Sheet& sheet, int col) {
+        // каждая новая формула ссылается на предыдущую: проверка на циклы
+        // проходит всю цепочку выше
+        sheet.SetCell({0, col}, "1");
+        for (int row = 1; row < length; ++row){
+            sheet.SetCell({row, col}, "=" + Position{row - 1, col}.ToString() + "+1");
+        }
+    };
+    {
+        Sheet sheet;
+        br.Measure("5k chain, depth-first check", [&] {
+            build_chain(sheet, 0);
+        });
+    }
+    {
+        Sheet sheet;
+        std::vector<std::pair<Position, std::string>> ballast;
+        for (int i = 0; i < 101000; ++i){
+            ballast.push_back({{i / 100, 100 + i % 100}, "=A1"});
+        }
+        sheet.SetCells(std::move(ballast));
+        br.Measure("5k chain, 100k+ edges, incremental order", [&] {
+            build_chain(sheet, 1);
+        });
+    }
+}
+
+void BenchCellMemory(BenchRunner& br) {
+    // Сколько байт кучи приходится на ячейку каждого вида: сама ячейка в
+    // блоке CellTable и всё, что она выделяет отдельно
+    const int rows = 1024;
+    const int cols = 64;
+    const double cells = rows * cols;
+    br.Report("sizeof(Cell)", sizeof(Cell), "bytes");
+
+    {
+        CellTable table;
+        const std::int64_t before = heap_bytes;
+        for (int row = 0; row < rows; ++row){
+            for (int col = 0; col < cols; ++col){
+                table.Insert({row, col});
+            }
+        }
+        br.Report("empty", (heap_bytes - before) / cells, "bytes/cell");
+    }
+
+    auto measure = [&](const std::string& name, auto make_text) {
+        Sheet sheet;
+        const std::int64_t before = heap_bytes;
+        for (int row = 0; row < rows; ++row){
+            for (int col = 0; col < cols; ++col){
+                sheet.SetCell({row, col}, make_text(row, col));
+            }
+        }
+        br.Report(name, (heap_bytes - before) / cells, "bytes/cell");
+    };
+    measure("numeric text", [](int row, int col) {
+        return std::to_string(row * 1.25 + col);
+    });
+    measure("short text", [](int, int) {
+        return std::string("label");
+    });
+    measure("long text (32 chars)", [](int, int) {
+        return std::string(32, 'x');
+    });
+    // каждая формула ссылается на соседа слева: у всех, кроме последнего
+    // столбца, есть одна зависимая ячейка
+    measure("formula", [](int row, int col) {
+        return col == 0 ? std::string("=1") : "=" + Position{row, col - 1}.ToString() + "+1";
+    });
+}
+
+void BenchAllocations(BenchRunner& br) {
+    const int rows = 4096;
+    auto measure = [&](const std::string& name, auto make_text) {
+        std::vector<std::string> texts;
+        for (int row = 0; row < rows; ++row){
+            texts.push_back(make_text(row));
+        }
+        Sheet sheet;
+        const std::int64_t before = heap_allocations;
+        const AllocationStats sheet_before = sheet.GetAllocationStats();
+        for (int row = 0; row < rows; ++row){
+            sheet.SetCell({row, 0}, std::move(texts[row]));
+        }
+        br.Report(name, double(heap_allocations - before) / rows, "heap allocations/SetCell");
+        br.Report(name + ", sheet pool", double(sheet.GetAllocationStats().allocations -
+                                                sheet_before.allocations) / rows,
+                  "allocations/SetCell");
+    };
+    measure("text", [](int row) {
+        return std::to_string(row);
+    });
+    measure("shared formula", [](int row) {
+        return "=" + Position{row, 1}.ToString() + "*2+1";
+    });
+    measure("distinct formulas", [](int row) {
+        const std::string suffix = std::to_string(row + 1);
+        return "=B" + suffix + "*" + suffix + "+C" + suffix + "/(D" + suffix + "-2)";
+    });
+}
+
+void BenchSnapshotLoad(BenchRunner& br) {
+    // Восстановление листа из снимка против повторного ввода текстов ячеек:
+    // столбец чисел, формулы, скопированные вдоль строк, и сумма по строке
+    const int rows = 15625;
+    const int cols = 16;
+    std::vector<std::pair<Position, std::string>> texts;
+    for (int row = 0; row < rows; ++row){
+        const std::string suffix = std::to_string(row + 1);
+        texts.push_back({{row, 0}, std::to_string(row * 0.5)});
+        for (int col = 1; col < cols - 1; ++col){
+            texts.push_back({{row, col}, "=" + Position{row, col - 1}.ToString() + "*2+" +
+                                             std::to_string(col)});
+        }
+        texts.push_back({{row, cols - 1}, "=SUM(A" + suffix + ":" + Position{row, cols - 2}.ToString() + ")"});
+    }
+    const std::string path = "bench_snapshot.bin";
+    {
+        Sheet sheet;
+        sheet.SetCells(texts);
+        sheet.Recalculate();
+        br.Measure("save snapshot", [&] {
+            sheet.SaveSnapshot(path);
+        });
+    }
+    {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        br.Report("snapshot size", static_cast<double>(in.tellg()) / (rows * cols), "bytes/cell");
+    }
+
+    br.Measure("text replay: SetCells + Recalculate", [&] {
+        Sheet sheet;
+        sheet.SetCells(texts);
+        sheet.Recalculate();
+        BenchRunner::DoNotOptimize(sheet);
+    });
+    br.Measure("load snapshot", [&] {
+        auto sheet = Sheet::LoadSnapshot(path);
+        BenchRunner::DoNotOptimize(sheet);
+    });
+    br.Measure("load snapshot + read all values", [&] {
+        auto sheet = Sheet::LoadSnapshot(path);
+        double sum = 0;
+        for (int row = 0; row < rows; ++row){
+            sum += std::get<double>(sheet->GetCell({row, cols - 1})->GetValue());
+        }
+        BenchRunner::DoNotOptimize(sum);
+    });
+    std::remove(path.c_str());
+}
+
+void BenchImport(BenchRunner& br) {
+    // TSV-выгрузка: числа, текст и формулы, скопированные вдоль строк
+    const int rows = 15625;
+    const int cols = 16;
+    std::string tsv;
+    for (int row = 0; row < rows; ++row){
+        tsv += std::to_string(row * 0.25);
+        tsv += "\titem " + std::to_string(row);
+        for (int col = 2; col < cols; ++col){
+            tsv += "\t=" + Position{row, col - 2}.ToString() + "*2+" + Position{row, col - 1}.ToString();
+        }
+        tsv += '\n';
+    }
+
+    double ms = br.Measure("SetCell per field", [&] {
+        Sheet sheet;
+        std::istringstream in(tsv);
+        std::string line;
+        for (int row = 0; std::getline(in, line); ++row){
+            std::istringstream fields(line);
+            std::string field;
+            for (int col = 0; std::getline(fields, field, '\t'); ++col){
+                sheet.SetCell({row, col}, field);
+            }
+        }
+    });
+    br.ReportThroughput("SetCell per field", tsv.size(), ms);
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t threads : {size_t{1}, hardware}){
+        const std::string name = "ImportTable, " + std::to_string(threads) + " threads";
+        ms = br.Measure(name, [&] {
+            Sheet sheet;
+            std::istringstream in(tsv);
+            ImportOptions options;
+            options.threads = threads;
+            ImportTable(sheet, in, options);
+        });
+        br.ReportThroughput(name, tsv.size(), ms);
+    }
+}
+
+void BenchFill(BenchRunner& br) {
+    // Плотное заполнение подряд и разреженное: те же 100k ячеек, разбросанные
+    // по всему листу. Позиции случайные, но с фиксированным зерном.
+    const int cells = FILL_ROWS * FILL_COLS;
+    std::vector<Position> sparse;
+    sparse.reserve(cells);
+    std::mt19937 generator(7);
+    for (int i = 0; i < cells; ++i){
+        sparse.push_back({static_cast<int>(generator() % Position::MAX_ROWS),
+                          static_cast<int>(generator() % Position::MAX_COLS)});
+    }
+    const auto dense = MakePositions(false);
+    auto measure = [&](const std::string& name, const std::vector<Position>& positions, auto make_text) {
+        Sheet sheet;
+        br.Measure(name, [&] {
+            for (size_t i = 0; i < positions.size(); ++i){
+                sheet.SetCell(positions[i], make_text(positions[i], i));
+            }
+        });
+    };
+    auto number = [](Position, size_t i) {
+        return std::to_string(i % 1000);
+    };
+    // ссылка на соседа слева не замыкает циклов при любом наборе позиций
+    auto formula = [](Position pos, size_t i) {
+        const std::string factor = std::to_string(i % 1000);
+        return pos.col == 0 ? "=" + factor : "=" + Position{pos.row, pos.col - 1}.ToString() + "*" + factor;
+    };
+    measure("dense 1000x100, numbers", dense, number);
+    measure("sparse 100k cells over 16384x16384, numbers", sparse, number);
+    measure("dense 1000x100, formulas", dense, formula);
+    measure("sparse 100k cells over 16384x16384, formulas", sparse, formula);
+}
+
+void BenchFanOut(BenchRunner& br) {
+    // одна ячейка, на которую ссылаются 100k формул
+    const int formulas = 100000;
+    auto formula_pos = [](int i) {
+        return Position{i % Position::MAX_ROWS, 1 + i / Position::MAX_ROWS};
+    };
+    Sheet sheet;
+    sheet.SetCell({0, 0}, "1");
+    br.Measure("set 100k formulas over A1", [&] {
+        for (int i = 0; i < formulas; ++i){
+            sheet.SetCell(formula_pos(i), "=A1+" + std::to_string(i));
+        }
+    });
+    auto read_all = [&] {
+        double sum = 0;
+        for (int i = 0; i < formulas; ++i){
+            sum += std::get<double>(sheet.GetCell(formula_pos(i))->GetValue());
+        }
+        BenchRunner::DoNotOptimize(sum);
+    };
+    br.Measure("evaluate 100k formulas", read_all);
+    br.Measure("edit A1", [&] {
+        sheet.SetCell({0, 0}, "2");
+    });
+    br.Measure("evaluate 100k formulas after edit", read_all);
+    br.Measure("edit A1 + Recalculate", [&] {
+        sheet.SetCell({0, 0}, "3");
+        sheet.Recalculate();
+    });
+}
+
+void BenchClearLarge(BenchRunner& br) {
+    // ClearCell в листе на 100k ячеек: числа и формулы, ссылающиеся на
+    // соседа слева, очищаются в случайном порядке
+    auto fill = [](Sheet& sheet) {
+        std::vector<std::pair<Position, std::string>> texts;
+        for (Position pos : MakePositions(false)){
+            texts.push_back({pos, pos.col % 2 == 0 ? std::to_string(pos.row) :
+                                  "=" + Position{pos.row, pos.col - 1}.ToString() + "*2"});
+        }
+        sheet.SetCells(std::move(texts));
+    };
+    const auto positions = MakePositions(true);
+    const size_t clears = 10000;
+    {
+        Sheet sheet;
+        fill(sheet);
+        br.Measure("clear 10k random cells of 100k", [&] {
+            for (size_t i = 0; i < clears; ++i){
+                sheet.ClearCell(positions[i]);
+            }
+        });
+    }
+    {
+        Sheet sheet;
+        fill(sheet);
+        br.Measure("clear all 100k cells in random order", [&] {
+            for (Position pos : positions){
+                sheet.ClearCell(pos);
+                BenchRunner::DoNotOptimize(sheet.GetPrintableSize());
+            }
+        });
+    }
+}
+
+void BenchVersions(BenchRunner& br) {
+    // Читатели из многих потоков и один писатель. Раньше чтения и правки
+    // шли под одним мьютексом; с версиями читатель берёт опубликованную
+    // версию на каждый запрос из 100 чтений, а писатель публикует версию
+    // после каждых 16 правок.
+    auto fill = [](Sheet& sheet) {
+        std::vector<std::pair<Position, std::string>> texts;
+        for (Position pos : MakePositions(false)){
+            texts.push_back({pos, pos.col == 0 ? std::to_string(pos.row) :
+                                  "=" + Position{pos.row, pos.col - 1}.ToString() + "+1"});
+        }
+        sheet.SetCells(std::move(texts));
+        sheet.Recalculate();
+    };
+    {
+        Sheet sheet;
+        fill(sheet);
+        br.Measure("first publish, 100k cells", [&] {
+            sheet.PublishVersion();
+        });
+        br.Measure("publish after editing one row of 100 formulas", [&] {
+            sheet.SetCell({500, 0}, "-1");
+            sheet.PublishVersion();
+        });
+    }
+
+    const size_t readers = std::max(2u, std::thread::hardware_concurrency());
+    const auto duration = std::chrono::milliseconds(300);
+    const int reads_per_request = 100;
+    const int edits_per_publish = 16;
+    auto run = [&](const std::string& name, auto read_request, auto write) {
+        std::atomic<bool> done{false};
+        std::atomic<std::int64_t> reads{0};
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < readers; ++i){
+            threads.emplace_back([&, i] {
+                std::mt19937 generator(static_cast<unsigned>(i));
+                std::int64_t count = 0;
+                while (!done){
+                    read_request(generator);
+                    count += reads_per_request;
+                }
+                reads += count;
+            });
+        }
+        std::mt19937 generator(1000);
+        std::int64_t edits = 0;
+        const auto start = std::chrono::steady_clock::now();
+        while (std::chrono::steady_clock::now() - start < duration){
+            write(generator, edits++);
+        }
+        done = true;
+        for (auto& thread : threads){
+            thread.join();
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        br.Report(name + ", " + std::to_string(readers) + " readers", reads / seconds / 1e6, "M reads/s");
+        br.Report(name + ", writer", edits / seconds, "edits/s");
+    };
+    auto random_pos = [](std::mt19937& generator) {
+        return Position{static_cast<int>(generator() % FILL_ROWS), static_cast<int>(generator() % FILL_COLS)};
+    };
+    {
+        Sheet sheet;
+        fill(sheet);
+        std::mutex mutex;
+        run("one mutex", [&](std::mt19937& generator) {
+            std::lock_guard lock(mutex);
+            double sum = 0;
+            for (int i = 0; i < reads_per_request; ++i){
+                const auto value = sheet.GetCell(random_pos(generator))->GetValue();
+                sum += std::holds_alternative<double>(value) ? std::get<double>(value) : 0;
+            }
+            BenchRunner::DoNotOptimize(sum);
+        }, [&](std::mt19937& generator, std::int64_t) {
+            std::lock_guard lock(mutex);
+            sheet.SetCell({static_cast<int>(generator() % FILL_ROWS), 0}, std::to_string(generator() % 1000));
+        });
+    }
+    {
+        Sheet sheet;
+        fill(sheet);
+        sheet.PublishVersion();
+        run("versions", [&](std::mt19937& generator) {
+            const auto version = sheet.GetPublishedVersion();
+            double sum = 0;
+            for (int i = 0; i < reads_per_request; ++i){
+                const auto& value = version->GetCell(random_pos(generator))->value;
+                sum += std::holds_alternative<double>(value) ? std::get<double>(value) : 0;
+            }
+            BenchRunner::DoNotOptimize(sum);
+        }, [&](std::mt19937& generator, std::int64_t edit) {
+            sheet.SetCell({static_cast<int>(generator() % FILL_ROWS), 0}, std::to_string(generator() % 1000));
+            if (edit % edits_per_publish == edits_per_publish - 1){
+                sheet.PublishVersion();
+            }
+        });
+    }
+}
+
+void BenchConcurrentEvaluation(BenchRunner& br) {
+    // первое чтение 96k формул: столбцы чисел и формулы над ними, каждая
+    // третья ссылается на формулу строкой выше
+    const int rows = 16000;
+    auto fill = [](Sheet& sheet) {
+        std::vector<std::pair<Position, std::string>> texts;
+        for (int row = 0; row < rows; ++row){
+            const std::string r = std::to_string(row + 1);
+            texts.push_back({{row, 0}, std::to_string(row % 100)});
+            for (int col = 1; col <= 6; ++col){
+                const std::string up = row > 0 && col % 3 == 0 ? "+" + Position{row - 1, col}.ToString() : "";
+                texts.push_back({{row, col}, "=A" + r + "*" + std::to_string(col) + up});
+            }
+        }
+        sheet.SetCells(std::move(texts));
+    };
+    auto read_all = [](const Sheet& sheet, size_t threads) {
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < threads; ++i){
+            workers.emplace_back([&sheet, i, threads] {
+                double sum = 0;
+                // потоки начинают с разных строк и встречаются на общих формулах
+                for (int k = 0; k < rows; ++k){
+                    const int row = static_cast<int>((k + i * rows / threads) % rows);
+                    for (int col = 1; col <= 6; ++col){
+                        const auto value = sheet.GetCell({row, col})->GetValue();
+                        sum += std::holds_alternative<double>(value) ? std::get<double>(value) : 0;
+                    }
+                }
+                BenchRunner::DoNotOptimize(sum);
+            });
+        }
+        for (auto& worker : workers){
+            worker.join();
+        }
+    };
+    {
+        Sheet sheet;
+        fill(sheet);
+        br.Measure("96k formulas, default mode, 1 thread", [&] {
+            read_all(sheet, 1);
+        });
+    }
+    const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t threads : {size_t{1}, std::max<size_t>(hardware, 4)}){
+        Sheet sheet;
+        fill(sheet);
+        sheet.SetConcurrentEvaluation(true);
+        br.Measure("96k formulas, concurrent mode, " + std::to_string(threads) + " threads", [&] {
+            read_all(sheet, threads);
+        });
+    }
+}
+
+void BenchUndo(BenchRunner& br) {
+    // Память журнала на правку: прежнее содержимое ячеек хранится как есть,
+    // формула - общим деревом, без копии листа
+    const int edits = 10000;
+    auto fill = [](Sheet& sheet) {
+        std::vector<std::pair<Position, std::string>> texts;
+        for (Position pos : MakePositions(false)){
+            texts.push_back({pos, pos.col == 0 ? std::to_string(pos.row) :
+                                  "=" + Position{pos.row, pos.col - 1}.ToString() + "+1"});
+        }
+        sheet.SetCells(std::move(texts));
+        sheet.Recalculate();
+    };
+    auto measure = [&](const std::string& name, int cells_per_edit, auto edit) {
+        Sheet sheet;
+        fill(sheet);
+        sheet.SetUndoLimit(edits);
+        const std::int64_t before = heap_bytes;
+        for (int i = 0; i < edits; ++i){
+            edit(sheet, i);
+        }
+        br.Report(name + ", heap", static_cast<double>(heap_bytes - before) / edits, "bytes/edit");
+        br.Report(name + ", journal", static_cast<double>(sheet.GetJournalMemory()) / edits, "bytes/edit");
+        if (cells_per_edit > 1){
+            br.Report(name + ", journal per cell",
+                      static_cast<double>(sheet.GetJournalMemory()) / edits / cells_per_edit, "bytes/cell");
+        }
+    };
+    auto pos_of = [](int i) {
+        return Position{i % FILL_ROWS, i / FILL_ROWS % FILL_COLS};
+    };
+    measure("number over formula", 1, [&](Sheet& sheet, int i) {
+        sheet.SetCell(pos_of(i), std::to_string(i));
+    });
+    measure("formula over formula", 1, [&](Sheet& sheet, int i) {
+        const Position pos = pos_of(i);
+        sheet.SetCell(pos, pos.col == 0 ? "=1" : "=" + Position{pos.row, pos.col - 1}.ToString() + "*2");
+    });
+    measure("long text over long text", 1, [&](Sheet& sheet, int i) {
+        sheet.SetCell({i % FILL_ROWS, FILL_COLS}, std::string(64, 'a' + i % 26));
+    });
+    measure("clear formula", 1, [&](Sheet& sheet, int i) {
+        sheet.ClearCell(pos_of(i));
+    });
+    measure("batch of 100 numbers", 100, [&](Sheet& sheet, int i) {
+        std::vector<std::pair<Position, std::string>> texts;
+        for (int k = 0; k < 100; ++k){
+            texts.push_back({pos_of((i * 100 + k) % (FILL_ROWS * FILL_COLS)), std::to_string(k)});
+        }
+        sheet.SetCells(std::move(texts));
+    });
+
+    // отмена пересчитывает только формулы, зависящие от возвращённых ячеек
+    Sheet sheet;
+    fill(sheet);
+    sheet.SetUndoLimit(edits);
+    for (int i = 0; i < edits; ++i){
+        sheet.SetCell({i % FILL_ROWS, FILL_COLS - 1}, std::to_string(i));
+    }
+    sheet.Recalculate();
+    br.Measure("undo 10k edits and recalculate", [&] {
+        while (sheet.Undo()){
+        }
+        sheet.Recalculate();
+    });
+    br.Measure("redo 10k edits and recalculate", [&] {
+        while (sheet.Redo()){
+        }
+        sheet.Recalculate();
+    });
+}
+
+void BenchInsertDeleteRows(BenchRunner& br) {
+    // Вставка и удаление строк и столбцов в листе на 1M ячеек: числа и
+    // формулы со ссылкой на строку выше. Ячейки переносятся целиком, ссылки
+    // в деревьях формул переписываются без разбора текста
+    const int rows = 15625;
+    const int cols = 64;
+    Sheet sheet;
+    std::vector<std::pair<Position, std::string>> texts;
+    texts.reserve(rows * cols);
+    for (int row = 0; row < rows; ++row){
+        for (int col = 0; col < cols; ++col){
+            texts.push_back({{row, col}, row == 0 || col % 2 == 0 ? std::to_string(row + col) :
+                                         "=" + Position{row - 1, col}.ToString() + "+1"});
+        }
+    }
+    sheet.SetCells(std::move(texts));
+    sheet.Recalculate();
+    br.Measure("insert 10 rows at top of 1M cells", [&] {
+        sheet.InsertRows(10, 10);
+    });
+    br.Measure("recalculate after insert", [&] {
+        sheet.Recalculate();
+    });
+    br.Measure("delete 10 rows at top of 1M cells", [&] {
+        sheet.DeleteRows(10, 10);
+    });
+    br.Measure("insert column in 1M cells", [&] {
+        sheet.InsertCols(1);
+    });
+    br.Measure("delete column in 1M cells", [&] {
+        sheet.DeleteCols(1);
+    });
+    sheet.Recalculate();
+    BenchRunner::DoNotOptimize(sheet.GetCell({rows - 1, cols - 1})->GetValue());
+}
+
+// spreadsheet_bench [фильтр] [--json файл]: фильтр - подстрока имени
+// бенчмарка, с --json результаты дополнительно пишутся в файл ("-" - stdout).
+int main(int argc, char* argv[]) {
+    std::string filter;
+    std::string json_path;
+    for (int i = 1; i < argc; ++i){
+        const std::string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc){
+            json_path = argv[++i];
+        }
+        else{
+            filter = arg;
+        }
+    }
+    BenchRunner br(filter);
+    RUN_BENCH(br, BenchCellStorage);
+    RUN_BENCH(br, BenchFill);
+    RUN_BENCH(br, BenchFormulaEvaluation);
+    RUN_BENCH(br, BenchErrorPropagation);
+    RUN_BENCH(br, BenchRecalculateChain);
+    RUN_BENCH(br, BenchFanOut);
+    RUN_BENCH(br, BenchParallelRecalculation);
+    RUN_BENCH(br, BenchBatchImport);
+    RUN_BENCH(br, BenchCachedValues);
+    RUN_BENCH(br, BenchTextOperands);
+    RUN_BENCH(br, BenchCycleCheck);
+    RUN_BENCH(br, BenchPrint);
+    RUN_BENCH(br, BenchClearReverse);
+    RUN_BENCH(br, BenchClearLarge);
+    RUN_BENCH(br, BenchParse);
+    RUN_BENCH(br, BenchFillDown);
+    RUN_BENCH(br, BenchRangeSum);
+    RUN_BENCH(br, BenchRangeDependences);
+    RUN_BENCH(br, BenchCellMemory);
+    RUN_BENCH(br, BenchAllocations);
+    RUN_BENCH(br, BenchSnapshotLoad);
+    RUN_BENCH(br, BenchImport);
+    RUN_BENCH(br, BenchVersions);
+    RUN_BENCH(br, BenchConcurrentEvaluation);
+    RUN_BENCH(br, BenchUndo);
+    RUN_BENCH(br, BenchInsertDeleteRows);
+
+    if (json_path == "-"){
+        br.WriteJson(std::cout);
+    }
+    else if (!json_path.empty()){
+        std::ofstream output(json_path);
+        br.WriteJson(output);
+        if (!output){
+            std::cerr << "Cannot write " << json_path << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Номер младшего установленного бита value; value не равно нулю.
+inline int CountTrailingZeros(std::uint64_t value){
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+// Число нулевых битов value перед старшим установленным; value не равно нулю.
+inline int CountLeadingZeros(std::uint64_t value){
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return 63 - static_cast<int>(index);
+#else
+    return __builtin_clzll(value);
+#endif
+}
+
+// Вызывает func(index) для каждого установленного бита bits, от младших к
+// старшим.
+template <typename Func>
+void ForEachSetBit(std::uint64_t bits, Func func){
+    for (; bits; bits &= bits - 1){
+        func(CountTrailingZeros(bits));
+    }
+}
@@ -1,48 +1,275 @@
 #include "cell.h"
+#include "sheet.h"
+#include "tableprinter.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <string>
 #include <optional>
+#include <thread>
 
-Cell::Cell() : impl_(std::make_unique<EmptyImpl>()){}
+PositionSet::PositionSet(const PositionSet& other) {
+    *this = other;
+}
+
+PositionSet::PositionSet(PositionSet&& other) noexcept {
+    *this = std::move(other);
+}
+
+PositionSet& PositionSet::operator=(const PositionSet& other) {
+    if (this == &other){
+        return *this;
+    }
+    Reset();
+    if (other.size_ == LARGE){
+        large_ = new std::unordered_set<Position>(*other.large_);
+    }
+    else{
+        std::copy(other.small_, other.small_ + other.size_, small_);
+    }
+    size_ = other.size_;
+    return *this;
+}
+
+PositionSet& PositionSet::operator=(PositionSet&& other) noexcept {
+    if (this == &other){
+        return *this;
+    }
+    Reset();
+    if (other.size_ == LARGE){
+        large_ = other.large_;
+    }
+    else{
+        std::copy(other.small_, other.small_ + other.size_, small_);
+    }
+    size_ = other.size_;
+    other.size_ = 0;
+    return *this;
+}
+
+PositionSet::~PositionSet() {
+    Reset();
+}
+
+void PositionSet::Reset() {
+    if (size_ == LARGE){
+        delete large_;
+    }
+    size_ = 0;
+}
+
+bool PositionSet::Insert(Position pos) {
+    if (size_ == LARGE){
+        return large_->insert(pos).second;
+    }
+    if (std::find(small_, small_ + size_, pos) != small_ + size_){
+        return false;
+    }
+    if (size_ < SMALL_CAPACITY){
+        small_[size_++] = pos;
+        return true;
+    }
+    auto large = new std::unordered_set<Position>(small_, small_ + size_);
+    large->insert(pos);
+    large_ = large;
+    size_ = LARGE;
+    return true;
+}
+
+size_t PositionSet::Erase(Position pos) {
+    if (size_ == LARGE){
+        const size_t erased = large_->erase(pos);
+        if (large_->empty()){
+            Reset();
+        }
+        return erased;
+    }
+    Position* found = std::find(small_, small_ + size_, pos);
+    if (found == small_ + size_){
+        return 0;
+    }
+    *found = small_[--size_];
+    return 1;
+}
 
-void Cell::Set(std::string text,SheetInterface& sheet) {
+void Cell::Set(std::string text,Sheet& sheet, Position pos) {
     if(text.size() > 1 && text[0] == FORMULA_SIGN){
-        impl_ = std::make_unique<FormulaImpl>(text.substr(1),sheet);
+        content_ = ParseCellFormula(text.substr(1), pos, sheet.formula_cache_);
+        sheet_ = &sheet;
     }
     else {
-        impl_ = std::make_unique<TextImpl>(std::move(text));
+        SetText(std::move(text));
+    }
+    cache_state_.Store(CacheState::INVALID);
+}
+
+void Cell::SetText(std::string text) {
+    content_ = std::move(text);
+    number_ = TextToNumber(GetVisibleText());
+    sheet_ = nullptr;
+    cache_state_.Store(CacheState::INVALID);
+}
+
+void Cell::SetFormula(const std::string& key, std::string_view tree, Sheet& sheet, Position pos) {
+    content_ = RestoreCellFormula(key, tree, pos, sheet.formula_cache_);
+    sheet_ = &sheet;
+    cache_state_.Store(CacheState::INVALID);
+}
+
+void Cell::SetContent(Content content, Sheet& sheet) {
+    if (std::string* text = std::get_if<std::string>(&content)){
+        SetText(std::move(*text));
+    }
+    else if (std::holds_alternative<Formula>(content)){
+        content_ = std::move(content);
+        sheet_ = &sheet;
+        cache_state_.Store(CacheState::INVALID);
+    }
+    else{
+        Clear();
     }
 }
 
 void Cell::Clear() {
-    impl_.reset();
-    impl_ = std::make_unique<EmptyImpl>();
+    content_ = std::monostate{};
+    number_ = 0.0;
+    cache_state_.Store(CacheState::INVALID);
+    sheet_ = nullptr;
 }
 
 Cell::Value Cell::GetValue() const {
-    if (cashvalue_){
-        return cashvalue_.value();
+    if (std::holds_alternative<std::string>(content_)){
+        return std::string(GetVisibleText());
+    }
+    if (!sheet_){
+        return 0.0;
+    }
+    if (!IsCached()){
+        PERF_COUNT(sheet_->perf_, cache_misses, 1);
+        if (!sheet_->concurrent_evaluation_){
+            // сначала без рекурсии вычисляем всё, от чего зависит формула
+            sheet_->CalculateReferences(*this);
+            return Calculate();
+        }
+        sheet_->CalculateConcurrently(*this);
     }
-    else{     
-        Value rs = impl_->GetValue();
-        if (std::holds_alternative<double>(rs))
-            cashvalue_ = std::get<double>(rs);
-        return rs;
+    else{
+        PERF_COUNT(sheet_->perf_, cache_hits, 1);
     }
+    if (const double* number = std::get_if<double>(&number_)){
+        return *number;
+    }
+    return std::get<FormulaError>(number_);
+}
+
+Cell::Value Cell::Calculate() const {
+    if (is_dirty_){
+        is_dirty_ = false;
+        --sheet_->dirty_count_;
+    }
+    return CalculateValue();
+}
+Cell::Value Cell::CalculateValue() const {
+    PERF_COUNT(sheet_->perf_, formula_evaluations, 1);
+    number_ = GetFormula()->Evaluate(*sheet_);
+    cache_state_.Store(CacheState::VALID);
+    if (const double* number = std::get_if<double>(&number_)){
+        return *number;
+    }
+    return std::get<FormulaError>(number_);
 }
+
+void Cell::WaitCalculated() const {
+    for (CacheState::State state; (state = cache_state_.Load()) != CacheState::VALID; ){
+        if (state == CacheState::INVALID){
+            GetValue();
+            return;
+        }
+        std::this_thread::yield();
+    }
+}
+
 std::string Cell::GetText() const {  
-    return impl_->GetText();
+    if (const std::string* text = std::get_if<std::string>(&content_)){
+        return *text;
+    }
+    if (const Formula* formula = GetFormula()){
+        return FORMULA_SIGN + formula->GetExpression();
+    }
+    return {};
 }
 std::vector<Position> Cell::GetReferencedCells() const{
-    return impl_->GetReferencedCells();
+    if (const Formula* formula = GetFormula()){
+        return formula->GetReferencedCells();
+    }
+    return {};
+}
+void Cell::ForEachReferencedCell(const std::function<void(Position)>& visit) const{
+    if (const Formula* formula = GetFormula()){
+        formula->ForEachReferencedCell(visit);
+    }
 }
+ExecResult Cell::GetNumber() const{
+    // у пустой ячейки и текста число уже лежит в number_
+    if (sheet_ && !IsCached()){
+        GetValue();
+    }
+    return number_;
+}
+
+std::optional<ExecResult> Cell::GetRangeNumber() const{
+    if (sheet_){
+        return GetNumber();
+    }
+    // в диапазоне пустые ячейки, пустой текст и текст, не являющийся
+    // числом, пропускаются
+    if (GetVisibleText().empty() || std::holds_alternative<FormulaError>(number_)){
+        return std::nullopt;
+    }
+    return number_;
+}
+
+void Cell::PrintValue(std::string& buffer, ValuePrinter& print_value) const{
+    if (std::holds_alternative<std::string>(content_)){
+        buffer += GetVisibleText();
+        return;
+    }
+    print_value(buffer, GetValue());
+}
+
+std::vector<CellRange> Cell::GetReferencedRanges() const{
+    if (const Formula* formula = GetFormula()){
+        return formula->GetReferencedRanges();
+    }
+    return {};
+}
+
+bool Cell::IsFormula() const{
+    return GetFormula() != nullptr;
+}
+
+const Formula* Cell::GetFormula() const{
+    return std::get_if<Formula>(&content_);
+}
+
+std::string_view Cell::GetVisibleText() const{
+    const std::string* text = std::get_if<std::string>(&content_);
+    if (!text){
+        return {};
+    }
+    std::string_view visible = *text;
+    if (!visible.empty() && visible[0] == ESCAPE_SIGN){
+        visible.remove_prefix(1);
+    }
+    return visible;
+}
+
 std::vector<Position> Cell::GetUpDependencesCells() const{
     std::vector<Position> rs;
-    for (const auto& el : cell_depend_up_){
-        rs.push_back(el);
-    }
+    cell_depend_up_.ForEach([&rs](Position pos){
+        rs.push_back(pos);
+    });
     std::sort(rs.begin(), rs.end());
     return rs;
 }
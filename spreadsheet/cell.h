@@ -2,140 +2,188 @@
 
 #include "common.h"
 #include "formula.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <optional>
+#include <string_view>
+#include <unordered_set>
+#include <variant>
 
 template <>
 struct std::hash<Position>
 {
     std::size_t operator()(const Position& position) const noexcept
     {
-        return (position.row < 12) + position.col;
+        return (static_cast<std::size_t>(position.row) << 14) + position.col;
     }
 };
 
 using Value = CellInterface::Value;
 
-class Impl {
-public:
-    virtual ~Impl() = default;
-    virtual void Set(std::string text) = 0;
-    virtual Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
-    virtual void Clear() = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-};
-
-class EmptyImpl : public Impl {
-public:
-    EmptyImpl() = default;
-    virtual ~EmptyImpl() = default;
-
-    virtual void Set(std::string text) override
-    {}
-
-    virtual void Clear() override
-    {}
-
-    virtual Value GetValue() const override{
-        return 0.0;
-    }
-
-    virtual std::string GetText() const override{
-        return {};
-    }
+class Sheet;
+class ValuePrinter;
 
-    virtual std::vector<Position> GetReferencedCells() const override    {
-        return {};
-    }
-};
-class TextImpl : public Impl{
+// Множество позиций формул, ссылающихся на ячейку. Обычно таких формул одна
+// или две, и позиции лежат прямо в объекте, без аллокаций. Когда их больше,
+// множество переезжает в хеш-таблицу, чтобы вставка и удаление оставались O(1).
+class PositionSet {
 public:
-    TextImpl() = default;
-    ~TextImpl() = default;
-
-    explicit TextImpl(std::string value) :
-        value_(std::move(value)){
-    }
-    void Set(std::string text) override{
-        value_ = std::move(text);
-    }
-    Value GetValue()const override{
-        if(value_[0] == '\''){
-            return value_.substr(1);
+    PositionSet() :
+        large_(nullptr){
+    }
+    PositionSet(const PositionSet& other);
+    PositionSet(PositionSet&& other) noexcept;
+    PositionSet& operator=(const PositionSet& other);
+    PositionSet& operator=(PositionSet&& other) noexcept;
+    ~PositionSet();
+
+    // Возвращает true, если позиции в множестве ещё не было.
+    bool Insert(Position pos);
+    // Возвращает число удалённых позиций: 0 или 1.
+    size_t Erase(Position pos);
+
+    bool Empty() const{
+        return size_ == 0;
+    }
+
+    template <typename Func>
+    void ForEach(Func func) const{
+        if (size_ == LARGE){
+            for (const Position& pos : *large_){
+                func(pos);
+            }
+            return;
+        }
+        for (std::uint32_t i = 0; i < size_; ++i){
+            func(small_[i]);
         }
-        return value_;
-    }
-    std::string GetText() const override{
-        return value_;
-    }
-    void Clear() override{
-        value_.clear();
-    }
-    std::vector<Position> GetReferencedCells() const override{
-        return {};
     }
 
 private:
-    std::string value_;
-};
+    static const std::uint32_t SMALL_CAPACITY = 2;
+    // size_ равен LARGE, пока позиции хранятся в хеш-таблице
+    static const std::uint32_t LARGE = UINT32_MAX;
 
-class FormulaImpl : public Impl{
-public:
-    FormulaImpl(const SheetInterface& sheet) :
-        sheet_(sheet)
-        {};
+    void Reset();
 
-    ~FormulaImpl() = default;
+    union {
+        std::unordered_set<Position>* large_;
+        Position small_[SMALL_CAPACITY];
+    };
+    std::uint32_t size_ = 0;
+};
 
-    explicit FormulaImpl(std::string value, const SheetInterface& sheet) :
-        sheet_(sheet){
-        formula_ = ParseFormula(value);
-    }
+// Состояние кеша формулы: INVALID -> COMPUTING -> VALID. Атомарное, чтобы
+// значения можно было вычислять из многих потоков сразу (см.
+// Sheet::SetConcurrentEvaluation): ячейку считает только тот поток, который
+// перевёл её в COMPUTING. Копируется как обычное значение.
+class CacheState {
+public:
+    enum State : std::uint8_t {
+        INVALID,
+        COMPUTING,
+        VALID,
+    };
 
-    void Set(std::string text) override{
-        formula_ = ParseFormula(text);
+    CacheState() = default;
+    CacheState(const CacheState& other) :
+        state_(other.Load()){
     }
-
-    Value GetValue()const override{
-        auto result = formula_->Evaluate(sheet_);
-        if(std::holds_alternative<double>(result)){
-            return std::get<double>(result);
-        }
-        return std::get<FormulaError>(result);
+    CacheState& operator=(const CacheState& other){
+        Store(other.Load());
+        return *this;
     }
 
-    std::string GetText() const override{
-        return FORMULA_SIGN + formula_->GetExpression();
+    State Load() const{
+        return static_cast<State>(state_.load(std::memory_order_acquire));
     }
-
-    void Clear() override{
-        formula_.reset();
+    // VALID публикует значение кеша для других потоков
+    void Store(State state){
+        state_.store(state, std::memory_order_release);
     }
-
-    std::vector<Position> GetReferencedCells() const override {
-        return formula_->GetReferencedCells();
+    // INVALID -> COMPUTING; true, если переход сделал этот поток
+    bool TryStartComputing(){
+        std::uint8_t expected = INVALID;
+        return state_.compare_exchange_strong(expected, COMPUTING, std::memory_order_acquire);
     }
 
 private:
-    std::unique_ptr<FormulaInterface> formula_;
-    const SheetInterface& sheet_;
+    std::atomic<std::uint8_t> state_{INVALID};
 };
 
 class Cell : public CellInterface {
 public:
     friend class Sheet;
-    Cell();
+    Cell() = default;
+    Cell(Cell&&) = default;
+    Cell& operator=(Cell&&) = default;
     ~Cell() = default;
-    void Set(std::string text, SheetInterface& sheet);
+    void Set(std::string text, Sheet& sheet, Position pos);
+    // Записывает текст, не являющийся формулой. Лист не нужен, поэтому
+    // ячейки с текстом можно готовить в разных потоках.
+    void SetText(std::string text);
+    // Записывает формулу, разобранную заранее (см. RestoreCellFormula).
+    void SetFormula(const std::string& key, std::string_view tree, Sheet& sheet, Position pos);
     void Clear();
     Value GetValue() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
     std::vector<Position> GetUpDependencesCells() const;
+    bool IsFormula() const;
+    // Значение ячейки как операнда формулы: число или ошибка. У текста
+    // числовое значение вычислено заранее, при записи.
+    ExecResult GetNumber() const;
+    // Значение ячейки как элемента диапазона в функции: пустые ячейки и
+    // текст, не являющийся числом, пропускаются (nullopt).
+    std::optional<ExecResult> GetRangeNumber() const;
+    // Диапазоны из аргументов функций формулы.
+    std::vector<CellRange> GetReferencedRanges() const;
+    // Дописывает значение в буфер, как print_value(buffer, GetValue()), но
+    // текст ячейки копируется прямо из содержимого, без промежуточной строки.
+    void PrintValue(std::string& buffer, ValuePrinter& print_value) const;
 
 private:
-    std::unique_ptr<Impl> impl_;
-    mutable std::optional<double> cashvalue_;
-    std::unordered_set<Position> cell_depend_up_;
+    // Содержимое ячейки, тип задаётся номером альтернативы: пустая ячейка,
+    // текст или формула. Короткий текст хранится внутри std::string, а
+    // формула - прямо в ячейке, без отдельных аллокаций.
+    using Content = std::variant<std::monostate, std::string, Formula>;
+
+    // Возвращает ячейке содержимое, сохранённое раньше (журнал отмены
+    // листа): формула не разбирается заново, дерево остаётся общим.
+    void SetContent(Content content, Sheet& sheet);
+
+    // Вычисляет значение по формуле и кеширует его. Ячейки, на которые
+    // ссылается формула, к этому моменту должны быть уже вычислены.
+    Value Calculate() const;
+    // То же, но без учёта в счётчике грязных ячеек листа. Пишет только в
+    // собственный кеш, поэтому безопасна для вызова из разных потоков на
+    // разных ячейках.
+    Value CalculateValue() const;
+    bool IsCached() const{
+        return cache_state_.Load() == CacheState::VALID;
+    }
+    // Ждёт значения, которое считает другой поток; если тот не досчитал
+    // (исключение), считает само.
+    void WaitCalculated() const;
+    void ForEachReferencedCell(const std::function<void(Position)>& visit) const;
+    const Formula* GetFormula() const;
+    std::string_view GetVisibleText() const;
+
+    Content content_;
+    // у текста - его числовое значение, вычисленное при записи, у формулы -
+    // последнее вычисленное значение, если кеш в состоянии VALID
+    mutable ExecResult number_ = 0.0;
+    PositionSet cell_depend_up_;
+    // лист задан только у формул
+    const Sheet* sheet_ = nullptr;
+    // номер в топологическом порядке: ячейка идёт раньше всех, кто на неё
+    // ссылается. Поддерживается листом только на больших графах
+    std::int64_t topo_order_ = 0;
+    // отметка обхода графа: равна поколению обхода листа, если ячейка
+    // уже посещена в текущем обходе
+    mutable std::uint32_t visit_mark_ = 0;
+    mutable bool is_dirty_ = false;
+    mutable CacheState cache_state_;
 };
@@ -0,0 +1,111 @@
+#include "celltable.h"
+
+#include <utility>
+
+const CellTable::Block* CellTable::FindBlock(Position pos) const {
+    size_t index = BlockIndex(pos);
+    if (index >= blocks_.size()){
+        return nullptr;
+    }
+    return blocks_[index].get();
+}
+
+Cell* CellTable::Find(Position pos) {
+    return const_cast<Cell*>(std::as_const(*this).Find(pos));
+}
+
+const Cell* CellTable::Find(Position pos) const {
+    const Block* block = FindBlock(pos);
+    if (!block){
+        return nullptr;
+    }
+    int slot = block->slots[InBlockIndex(pos)];
+    if (!slot){
+        return nullptr;
+    }
+    return &*block->Slot(slot - 1);
+}
+
+Cell& CellTable::Insert(Position pos) {
+    size_t index = BlockIndex(pos);
+    if (index >= blocks_.size()){
+        blocks_.resize(index + 1);
+    }
+    if (!blocks_[index]){
+        blocks_[index] = std::make_unique<Block>();
+    }
+    Block& block = *blocks_[index];
+    std::uint16_t& slot = block.slots[InBlockIndex(pos)];
+    if (slot){
+        return *block.Slot(slot - 1);
+    }
+    int new_slot;
+    if (!block.free_slots.empty()){
+        new_slot = block.free_slots.back();
+        block.free_slots.pop_back();
+    }
+    else{
+        new_slot = block.count;
+        if (new_slot % CHUNK_SIZE == 0){
+            block.chunks.push_back(std::make_unique<Chunk>());
+        }
+    }
+    slot = static_cast<std::uint16_t>(new_slot + 1);
+    block.row_bits[pos.row % BLOCK_ROWS] |= std::uint64_t{1} << (pos.col % BLOCK_COLS);
+    ++block.count;
+    ++size_;
+    rows_.Add(pos.row);
+    cols_.Add(pos.col);
+    return block.Slot(new_slot).emplace();
+}
+
+void CellTable::Erase(Position pos) {
+    size_t index = BlockIndex(pos);
+    if (index >= blocks_.size() || !blocks_[index]){
+        return;
+    }
+    Block& block = *blocks_[index];
+    std::uint16_t& slot = block.slots[InBlockIndex(pos)];
+    if (!slot){
+        return;
+    }
+    block.Slot(slot - 1).reset();
+    block.free_slots.push_back(slot - 1);
+    slot = 0;
+    rows_.Remove(pos.row);
+    cols_.Remove(pos.col);
+    block.row_bits[pos.row % BLOCK_ROWS] &= ~(std::uint64_t{1} << (pos.col % BLOCK_COLS));
+    --size_;
+    if (--block.count == 0){
+        blocks_[index].reset();
+    }
+}
+
+void CellTable::LineCounter::Add(int line) {
+    if (counts_.size() <= static_cast<size_t>(line)){
+        counts_.resize(line + 1);
+    }
+    if (counts_[line]++ == 0){
+        bits_[line / 64] |= std::uint64_t{1} << (line % 64);
+        summary_[line / 64 / 64] |= std::uint64_t{1} << (line / 64 % 64);
+    }
+}
+
+void CellTable::LineCounter::Remove(int line) {
+    if (--counts_[line] == 0){
+        bits_[line / 64] &= ~(std::uint64_t{1} << (line % 64));
+        if (!bits_[line / 64]){
+            summary_[line / 64 / 64] &= ~(std::uint64_t{1} << (line / 64 % 64));
+        }
+    }
+}
+
+int CellTable::LineCounter::GetEnd() const {
+    for (int i = static_cast<int>(summary_.size()) - 1; i >= 0; --i){
+        if (summary_[i]){
+            const int word = i * 64 + 63 - CountLeadingZeros(summary_[i]);
+            return word * 64 + 63 - CountLeadingZeros(bits_[word]) + 1;
+        }
+    }
+    return 0;
+}
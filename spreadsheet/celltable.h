@@ -0,0 +1,199 @@
+#pragma once
+
+#include "bits.h"
+#include "cell.h"
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+// Хранилище ячеек таблицы. Лист разбит на плотные блоки BLOCK_ROWS x BLOCK_COLS,
+// блоки создаются по мере необходимости и адресуются через разреженный каталог.
+// Ячейки лежат внутри блока пачками по CHUNK_SIZE штук, отдельной аллокации на
+// каждую ячейку нет. Указатель на ячейку остаётся валидным до её удаления.
+class CellTable {
+public:
+    static const int BLOCK_ROWS = 64;
+    static const int BLOCK_COLS = 64;
+
+    CellTable() = default;
+    CellTable(CellTable&&) = default;
+    CellTable& operator=(CellTable&&) = default;
+
+    // Возвращает ячейку или nullptr, если её нет.
+    Cell* Find(Position pos);
+    const Cell* Find(Position pos) const;
+
+    // Возвращает существующую ячейку или создаёт пустую.
+    Cell& Insert(Position pos);
+    void Erase(Position pos);
+
+    bool Contains(Position pos) const {
+        return Find(pos) != nullptr;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Наименьший прямоугольник с углом в A1, содержащий все ячейки. O(1).
+    ::Size GetBounds() const {
+        return {rows_.GetEnd(), cols_.GetEnd()};
+    }
+
+    // Вызывает func(pos, cell) для каждой ячейки по строкам листа, в строке -
+    // слева направо. Пустые места не просматриваются: в блоке для каждой
+    // строки хранится битовая маска занятых столбцов.
+    template <typename Func>
+    void ForEach(Func func) {
+        ForEachCell(*this, func);
+    }
+    template <typename Func>
+    void ForEach(Func func) const {
+        ForEachCell(*this, func);
+    }
+
+    // То же для ячеек диапазона range. Если func вернёт false, обход
+    // прекращается и возвращается false. Пустые блоки и строки пропускаются
+    // целиком, поэтому огромный разреженный диапазон обходится быстро.
+    template <typename Func>
+    bool ForEachInRange(const CellRange& range, Func func) const;
+
+private:
+    static const int BLOCK_SIZE = BLOCK_ROWS * BLOCK_COLS;
+    static const int CHUNK_SIZE = 64;
+    static const int BLOCKS_PER_ROW = Position::MAX_COLS / BLOCK_COLS;
+    static_assert(BLOCK_COLS == 64, "строка блока должна помещаться в std::uint64_t");
+
+    using Chunk = std::array<std::optional<Cell>, CHUNK_SIZE>;
+
+    struct Block {
+        // 0 - ячейки нет, иначе номер слота + 1
+        std::array<std::uint16_t, BLOCK_SIZE> slots{};
+        // бит col - занята ли ячейка (row, col) блока
+        std::array<std::uint64_t, BLOCK_ROWS> row_bits{};
+        std::vector<std::unique_ptr<Chunk>> chunks;
+        std::vector<std::uint16_t> free_slots;
+        int count = 0;
+
+        std::optional<Cell>& Slot(int slot) {
+            return (*chunks[slot / CHUNK_SIZE])[slot % CHUNK_SIZE];
+        }
+        const std::optional<Cell>& Slot(int slot) const {
+            return (*chunks[slot / CHUNK_SIZE])[slot % CHUNK_SIZE];
+        }
+    };
+
+    static int BlockIndex(Position pos) {
+        return pos.row / BLOCK_ROWS * BLOCKS_PER_ROW + pos.col / BLOCK_COLS;
+    }
+    static int InBlockIndex(Position pos) {
+        return pos.row % BLOCK_ROWS * BLOCK_COLS + pos.col % BLOCK_COLS;
+    }
+
+    // Число ячеек в каждой строке (или в каждом столбце). Непустые линии
+    // отмечены в битовой маске, над ней - маска непустых слов, так что
+    // последняя непустая линия находится за несколько операций.
+    class LineCounter {
+    public:
+        void Add(int line);
+        void Remove(int line);
+        // номер последней непустой линии + 1, 0 - если пусты все
+        int GetEnd() const;
+
+    private:
+        static const int MAX_LINES = std::max(Position::MAX_ROWS, Position::MAX_COLS);
+        static const int WORDS = MAX_LINES / 64;
+        static_assert(WORDS <= 64 * 64, "маска слов должна помещаться в summary_");
+
+        std::vector<int> counts_;
+        std::array<std::uint64_t, WORDS> bits_{};
+        std::array<std::uint64_t, (WORDS + 63) / 64> summary_{};
+    };
+
+    const Block* FindBlock(Position pos) const;
+    // Обход для обоих ForEach: Table - CellTable или const CellTable, от
+    // этого зависит, изменяемые ли ячейки получает func.
+    template <typename Table, typename Func>
+    static void ForEachCell(Table& table, Func& func);
+
+    std::vector<std::unique_ptr<Block>> blocks_;
+    size_t size_ = 0;
+    LineCounter rows_;
+    LineCounter cols_;
+};
+
+template <typename Table, typename Func>
+void CellTable::ForEachCell(Table& table, Func& func) {
+    using BlockPtr = std::conditional_t<std::is_const_v<Table>, const Block*, Block*>;
+    std::vector<std::pair<int, BlockPtr>> row_blocks;
+    const auto& blocks = table.blocks_;
+    for (size_t first = 0; first < blocks.size(); first += BLOCKS_PER_ROW){
+        row_blocks.clear();
+        const size_t last = std::min(first + BLOCKS_PER_ROW, blocks.size());
+        for (size_t index = first; index < last; ++index){
+            if (blocks[index]){
+                const int first_col = static_cast<int>(index - first) * BLOCK_COLS;
+                row_blocks.push_back({first_col, blocks[index].get()});
+            }
+        }
+        if (row_blocks.empty()){
+            continue;
+        }
+        const int first_row = static_cast<int>(first) / BLOCKS_PER_ROW * BLOCK_ROWS;
+        for (int row = 0; row < BLOCK_ROWS; ++row){
+            for (auto [first_col, block] : row_blocks){
+                ForEachSetBit(block->row_bits[row], [&, first_col = first_col, block = block](int col){
+                    const int slot = block->slots[row * BLOCK_COLS + col];
+                    func(Position{first_row + row, first_col + col}, *block->Slot(slot - 1));
+                });
+            }
+        }
+    }
+}
+
+template <typename Func>
+bool CellTable::ForEachInRange(const CellRange& range, Func func) const {
+    const int first_block_col = range.first.col / BLOCK_COLS;
+    const int last_block_col = range.last.col / BLOCK_COLS;
+    for (int block_row = range.first.row / BLOCK_ROWS; block_row <= range.last.row / BLOCK_ROWS; ++block_row){
+        const size_t first_index = static_cast<size_t>(block_row) * BLOCKS_PER_ROW;
+        if (first_index >= blocks_.size()){
+            break;
+        }
+        const int first_row = std::max(range.first.row, block_row * BLOCK_ROWS);
+        const int last_row = std::min(range.last.row, (block_row + 1) * BLOCK_ROWS - 1);
+        for (int row = first_row; row <= last_row; ++row){
+            for (int block_col = first_block_col; block_col <= last_block_col; ++block_col){
+                const size_t index = first_index + block_col;
+                if (index >= blocks_.size()){
+                    break;
+                }
+                const Block* block = blocks_[index].get();
+                if (!block){
+                    continue;
+                }
+                // столбцы диапазона внутри блока: биты с low по high
+                const int first_col = block_col * BLOCK_COLS;
+                const int low = std::max(range.first.col - first_col, 0);
+                const int high = std::min(range.last.col - first_col, BLOCK_COLS - 1);
+                const std::uint64_t mask = (~std::uint64_t{0} >> (BLOCK_COLS - 1 - high)) &
+                                           (~std::uint64_t{0} << low);
+                const int block_row_offset = row % BLOCK_ROWS;
+                for (std::uint64_t bits = block->row_bits[block_row_offset] & mask; bits; bits &= bits - 1){
+                    const int col = CountTrailingZeros(bits);
+                    const int slot = block->slots[block_row_offset * BLOCK_COLS + col];
+                    if (!func(Position{row, first_col + col}, *block->Slot(slot - 1))){
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
@@ -55,7 +55,14 @@ public:
     }
     std::string_view ToString() const {
     using namespace std::string_view_literals;
-        return { "#ARITHM!"sv};
+        switch (category_){
+        case Category::Ref:
+            return "#REF!"sv;
+        case Category::Value:
+            return "#VALUE!"sv;
+        default:
+            return "#ARITHM!"sv;
+        }
     }
 private:
     Category category_;
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+
+// Статистика выделений памяти через CountingResource.
+struct AllocationStats {
+    // число вызовов allocate и deallocate
+    size_t allocations = 0;
+    size_t deallocations = 0;
+    // занято сейчас и наибольшее занятое за всё время, в байтах
+    size_t bytes_in_use = 0;
+    size_t peak_bytes = 0;
+};
+
+// Ресурс памяти, который передаёт запросы в upstream и считает их. Не
+// потокобезопасен, как и пул, перед которым обычно стоит.
+class CountingResource : public std::pmr::memory_resource {
+public:
+    explicit CountingResource(std::pmr::memory_resource* upstream) :
+        upstream_(upstream){
+    }
+
+    const AllocationStats& GetStats() const {
+        return stats_;
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+    std::pmr::memory_resource* upstream_;
+    AllocationStats stats_;
+};
@@ -1,10 +1,16 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "sheet.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
+#include <iterator>
+#include <optional>
 #include <sstream>
 
 using namespace std::literals;
@@ -13,55 +19,348 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe){
     return output << fe.ToString();
 }
 
+ExecResult TextToNumber(std::string_view text){
+    if (text.empty()){
+        return 0.0;
+    }
+    double value = 0;
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec == std::errc() && ptr == text.data() + text.size()){
+        return value;
+    }
+    // Формы, которые понимает strtod, но не from_chars: ведущие пробелы,
+    // знак '+', шестнадцатеричная запись. Для них сохраняем прежнее поведение.
+    std::string str(text);
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtod(str.c_str(), &end);
+    if (end != str.c_str() + str.size() || errno == ERANGE){
+        return FormulaError(FormulaError::Category::Value);
+    }
+    return value;
+}
+
 namespace {
-class Formula : public FormulaInterface {
-public:
-    explicit Formula(std::string expression) try : ast_(ParseFormulaAST(expression))
-    {}
+ExecResult CellValueToNumber(const CellInterface* cell){
+    if (!cell){
+        return 0.0;
+    }
+    auto value = cell->GetValue();
+    if (std::holds_alternative<FormulaError>(value)){
+        return std::get<FormulaError>(value);
+    }
+    if (std::holds_alternative<std::string>(value)){
+        return TextToNumber(std::get<std::string>(value));
+    }
+    return std::get<double>(value);
+}
+
+// Диапазон чужой таблицы читается по ячейкам: пустые ячейки и текст, не
+// являющийся числом, пропускаются, как и в Sheet::AddRangeNumbers().
+std::optional<FormulaError> AddRangeNumbers(const SheetInterface& sheet, CellRange range,
+                                            Aggregate& aggregate){
+    for (int row = range.first.row; row <= range.last.row; ++row){
+        for (int col = range.first.col; col <= range.last.col; ++col){
+            const CellInterface* cell = sheet.GetCell({row, col});
+            if (!cell){
+                continue;
+            }
+            auto value = cell->GetValue();
+            if (std::holds_alternative<FormulaError>(value)){
+                return std::get<FormulaError>(value);
+            }
+            if (std::holds_alternative<double>(value)){
+                aggregate.Add(std::get<double>(value));
+                continue;
+            }
+            const auto& text = std::get<std::string>(value);
+            auto number = TextToNumber(text);
+            if (!text.empty() && std::holds_alternative<double>(number)){
+                aggregate.Add(std::get<double>(number));
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+FormulaAST ParseAST(std::string_view expression,
+                    std::pmr::memory_resource* resource = std::pmr::get_default_resource()){
+    try{
+        return ParseFormulaAST(expression, resource);
+    }
     catch (const std::exception& re){
         throw FormulaException(re.what());
     }
+}
+
+}  // namespace
+
+Formula::Formula(std::string expression) :
+    ast_(std::make_shared<const FormulaAST>(ParseAST(expression)))
+{}
+
+Formula::Formula(std::shared_ptr<const FormulaAST> ast, Position anchor) :
+    ast_(std::move(ast)),
+    anchor_(anchor)
+{}
 
-    Value Evaluate(const SheetInterface& sheet) const override {
-        try{
-            auto a = [&sheet](const Position& pos)->CellInterface*{
-                return const_cast<CellInterface*>(sheet.GetCell(pos));
-            };
-            auto rs = ast_.Execute(a);
-            return rs;
+Formula::Value Formula::Evaluate(const SheetInterface& sheet) const {
+    // у своей таблицы числовое значение ячейки берётся готовым
+    if (const Sheet* our_sheet = dynamic_cast<const Sheet*>(&sheet)){
+        return ast_->Execute([our_sheet](Position pos){
+            return our_sheet->GetCellNumber(pos);
+        }, anchor_, [our_sheet](CellRange range, Aggregate& aggregate){
+            return our_sheet->AddRangeNumbers(range, aggregate);
+        });
+    }
+    return ast_->Execute([&sheet](Position pos){
+        return CellValueToNumber(sheet.GetCell(pos));
+    }, anchor_, [&sheet](CellRange range, Aggregate& aggregate){
+        return AddRangeNumbers(sheet, range, aggregate);
+    });
+}
+
+std::string Formula::GetExpression() const {
+    try{
+        std::ostringstream str;
+        ast_->PrintFormula(str, anchor_);
+        return str.str();
+    }
+    catch(FormulaException()){
+        throw FormulaException("");
+    }
+}
+
+std::vector<Position> Formula::GetReferencedCells() const {
+    // сдвиг не меняет порядок, список остаётся отсортированным; ссылки на
+    // удалённые ячейки (#REF!) пропускаются
+    std::vector<Position> rs;
+    for (const auto& pos : ast_->GetCells()){
+        const Position cell = ASTImpl::Anchored(pos, anchor_);
+        if (cell.IsValid()){
+            rs.push_back(cell);
         }
-        catch(FormulaError& err){
-            return err;
+    }
+    rs.erase(std::unique(rs.begin(), rs.end()), rs.end());
+    return rs;
+}
+
+void Formula::ForEachReferencedCell(const std::function<void(Position)>& visit) const {
+    for (const auto& pos : ast_->GetCells()){
+        const Position cell = ASTImpl::Anchored(pos, anchor_);
+        if (cell.IsValid()){
+            visit(cell);
         }
     }
+}
 
-    std::string GetExpression() const override {
-        try{
-            std::ostringstream str;
-            ast_.PrintFormula(str);
-            return str.str();
+std::vector<CellRange> Formula::GetReferencedRanges() const {
+    std::vector<CellRange> rs;
+    for (const auto& range : ast_->GetRanges()){
+        const CellRange anchored = ASTImpl::Anchored(range, anchor_);
+        if (anchored.first.IsValid() && std::find(rs.begin(), rs.end(), anchored) == rs.end()){
+            rs.push_back(anchored);
         }
-        catch(FormulaException()){
-            throw FormulaException("");
+    }
+    return rs;
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
+    return std::make_unique<Formula>(std::move(expression));
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor,
+                                               FormulaCache& cache) {
+    return std::make_unique<Formula>(ParseCellFormula(std::move(expression), anchor, cache));
+}
+
+Formula ParseCellFormula(std::string expression, Position anchor, FormulaCache& cache) {
+    // ключ нужен только на время поиска, буфер под него не выделяется заново
+    static thread_local std::string key;
+    if (!MakeRelativeKey(expression, anchor, key)){
+        return Formula(std::move(expression));
+    }
+    auto ast = cache.Get(key, [&](std::pmr::memory_resource* resource){
+#ifdef SPREADSHEET_INSTRUMENTATION
+        std::optional<PerfDuration> parse_time;
+        if (PerfRecorder* recorder = cache.GetRecorder()){
+            PERF_COUNT(*recorder, parses, 1);
+            parse_time.emplace(recorder->parse_ns);
+        }
+#endif
+        FormulaAST ast = ParseAST(expression, resource);
+        ast.MakeRelative(anchor);
+        return ast;
+    });
+    return Formula(std::move(ast), anchor);
+}
+
+Formula RestoreCellFormula(const std::string& key, std::string_view tree, Position anchor,
+                           FormulaCache& cache) {
+    auto ast = cache.Get(key, [tree](std::pmr::memory_resource* resource){
+        return FormulaAST::Deserialize(tree, resource);
+    });
+    return Formula(std::move(ast), anchor);
+}
+
+std::shared_ptr<const FormulaAST> FormulaCache::Get(const std::string& key,
+                                                    const Parser& parse){
+#ifdef SPREADSHEET_INSTRUMENTATION
+    if (recorder_){
+        PERF_COUNT(*recorder_, hash_probes, 1);
+    }
+#endif
+    auto& entry = asts_[key];
+    if (auto ast = entry.lock()){
+        return ast;
+    }
+    // дерево вместе со счётчиком ссылок - одна аллокация из resource_
+    std::shared_ptr<const FormulaAST> ast = std::allocate_shared<FormulaAST>(
+        std::pmr::polymorphic_allocator<FormulaAST>(resource_), parse(resource_));
+    entry = ast;
+    if (asts_.size() >= sweep_size_){
+        for (auto it = asts_.begin(); it != asts_.end(); ){
+            it = it->second.expired() ? asts_.erase(it) : std::next(it);
         }
+        sweep_size_ = std::max<size_t>(64, asts_.size() * 2);
+    }
+    return ast;
+}
+
+size_t FormulaCache::Size() const{
+    size_t size = 0;
+    for (const auto& [key, ast] : asts_){
+        size += !ast.expired();
+    }
+    return size;
+}
+
+void FormulaCache::Forget(const std::unordered_set<const FormulaAST*>& asts){
+    if (asts.empty()){
+        return;
+    }
+    for (auto it = asts_.begin(); it != asts_.end(); ){
+        const auto ast = it->second.lock();
+        it = !ast || asts.count(ast.get()) ? asts_.erase(it) : std::next(it);
+    }
+}
+
+ReferenceShift::ReferenceShift(Axis axis, int first, int count, bool insert,
+                               std::pmr::memory_resource* resource) :
+    axis_(axis),
+    first_(first),
+    count_(count),
+    insert_(insert),
+    limit_(axis == Axis::ROWS ? Position::MAX_ROWS : Position::MAX_COLS),
+    resource_(resource){
+}
+
+int ReferenceShift::MoveLine(int line) const{
+    if (line < first_){
+        return line;
+    }
+    if (insert_){
+        return line + count_ < limit_ ? line + count_ : -1;
+    }
+    return line < first_ + count_ ? -1 : line - count_;
+}
+
+std::optional<Position> ReferenceShift::MovePosition(Position pos) const{
+    int& line = axis_ == Axis::ROWS ? pos.row : pos.col;
+    line = MoveLine(line);
+    if (line < 0){
+        return std::nullopt;
     }
+    return pos;
+}
 
-    std::vector<Position> GetReferencedCells() const override {
-        const std::forward_list<Position> formulacells(ast_.GetCells());
-        if (formulacells.empty()){
-            return {};
+std::optional<CellRange> ReferenceShift::MoveRange(const CellRange& range) const{
+    CellRange moved = range;
+    int& first = axis_ == Axis::ROWS ? moved.first.row : moved.first.col;
+    int& last = axis_ == Axis::ROWS ? moved.last.row : moved.last.col;
+    if (insert_){
+        // часть диапазона, ушедшая за край листа, отрезается
+        if (first >= first_){
+            first += count_;
+        }
+        if (last >= first_){
+            last = std::min(last + count_, limit_ - 1);
         }
-        else{
-            std::vector<Position> rs{ formulacells.begin(), formulacells.end() };
-            return { rs.begin(), std::unique(rs.begin(), rs.end()) };
+        if (first >= limit_){
+            return std::nullopt;
         }
+        return moved;
     }
+    const int end = first_ + count_;
+    first = first < first_ ? first : first >= end ? first - count_ : first_;
+    last = last < first_ ? last : last >= end ? last - count_ : first_ - 1;
+    if (first > last){
+        return std::nullopt;
+    }
+    return moved;
+}
 
-private:
-    FormulaAST ast_;
-};
-}  // namespace
+bool ReferenceShift::MoveFormula(Formula& formula, Position anchor){
+    const Position old_anchor = formula.anchor_;
+    formula.anchor_ = anchor;
+    auto relative = [anchor](Position pos){
+        return Position{pos.row - anchor.row, pos.col - anchor.col};
+    };
+    auto move_cell = [&](Position cell){
+        const Position target = ASTImpl::Anchored(cell, old_anchor);
+        const auto moved = target.IsValid() ? MovePosition(target) : std::nullopt;
+        return moved ? relative(*moved) : ASTImpl::DELETED_CELL;
+    };
+    auto move_range = [&](const CellRange& range){
+        const CellRange target = ASTImpl::Anchored(range, old_anchor);
+        const auto moved = target.first.IsValid() ? MoveRange(target) : std::nullopt;
+        return moved ? CellRange{relative(moved->first), relative(moved->last)} :
+                       CellRange{ASTImpl::DELETED_CELL, ASTImpl::DELETED_CELL};
+    };
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
+    // обычно ссылки сдвигаются вместе с формулой и дерево не меняется
+    const FormulaAST& ast = *formula.ast_;
+    const auto& cells = ast.GetCells();
+    const auto& ranges = ast.GetRanges();
+    const bool changed =
+        std::any_of(cells.begin(), cells.end(), [&](Position cell){
+            return !(move_cell(cell) == cell);
+        }) ||
+        std::any_of(ranges.begin(), ranges.end(), [&](const CellRange& range){
+            return !(move_range(range) == range);
+        });
+    if (!changed){
+        return false;
+    }
+    if (formula.ast_.use_count() == 1){
+        // меняется только память дерева (Storage), сам объект FormulaAST нет
+        const_cast<FormulaAST&>(ast).RewritePositions(move_cell, move_range);
+        rewritten_.insert(&ast);
+        return true;
+    }
+
+    const FormulaAST* source = &ast;
+    std::string key(reinterpret_cast<const char*>(&source), sizeof(source));
+    auto append = [&key](Position pos){
+        key.append(reinterpret_cast<const char*>(&pos), sizeof(pos));
+    };
+    for (const auto& cell : cells){
+        append(move_cell(cell));
+    }
+    for (const auto& range : ranges){
+        const CellRange moved = move_range(range);
+        append(moved.first);
+        append(moved.last);
+    }
+    auto& copy = copies_[key];
+    if (!copy){
+        std::string tree;
+        ast.Serialize(tree);
+        auto ast_copy = std::allocate_shared<FormulaAST>(std::pmr::polymorphic_allocator<FormulaAST>(resource_),
+                                                         FormulaAST::Deserialize(tree, resource_));
+        ast_copy->RewritePositions(move_cell, move_range);
+        copy = std::move(ast_copy);
+    }
+    formula.ast_ = copy;
+    return true;
 }
@@ -3,14 +3,22 @@
 #include "common.h"
 
 #include "FormulaAST.h"
+#include "perfcounters.h"
 
+#include <functional>
 #include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
+// * Функции SUM, MIN, MAX, AVERAGE, COUNT от чисел и диапазонов: SUM(A1:B3,2)
 class FormulaInterface {
 public:
     using Value = std::variant<double, FormulaError>;
@@ -33,8 +41,156 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Вызывает visit для каждой ячейки из формулы, не создавая промежуточных
+    // контейнеров. Порядок возрастающий, повторы возможны.
+    virtual void ForEachReferencedCell(const std::function<void(Position)>& visit) const = 0;
+
+    // Возвращает диапазоны из аргументов функций. Их ячейки не попадают в
+    // GetReferencedCells(): диапазон может покрывать миллионы ячеек.
+    virtual std::vector<CellRange> GetReferencedRanges() const = 0;
+};
+
+// Интерпретирует текст ячейки как число для использования в формуле:
+// пустой текст - 0, текст, целиком являющийся числом, - это число,
+// всё остальное - ошибка #VALUE!.
+ExecResult TextToNumber(std::string_view text);
+
+// Разобранные формулы листа, общие для формул с одинаковой относительной
+// записью: =A1*B1 в ячейке C1 и =A2*B2 в C2 используют одно дерево, каждая
+// формула хранит лишь свою позицию. Деревья живут, пока ими пользуются.
+class FormulaCache {
+public:
+    // Деревья и их счётчики ссылок размещаются в resource.
+    explicit FormulaCache(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) :
+        resource_(resource){
+    }
+
+    // Разбирает формулу, размещая дерево в переданном ресурсе.
+    using Parser = std::function<FormulaAST(std::pmr::memory_resource*)>;
+
+    // Дерево по ключу MakeRelativeKey() или результат parse(), если его нет.
+    std::shared_ptr<const FormulaAST> Get(const std::string& key, const Parser& parse);
+    // Число деревьев, которые сейчас используются.
+    size_t Size() const;
+    // Убирает из кеша деревья asts: их позиции переписаны, и ключи к ним
+    // больше не подходят. Формулы продолжают ими пользоваться.
+    void Forget(const std::unordered_set<const FormulaAST*>& asts);
+    // Вызывает func(key, ast) для каждого используемого дерева.
+    template <typename Func>
+    void ForEach(Func func) const{
+        for (const auto& [key, entry] : asts_){
+            if (auto ast = entry.lock()){
+                func(key, *ast);
+            }
+        }
+    }
+
+#ifdef SPREADSHEET_INSTRUMENTATION
+    // Счётчики листа, которому принадлежит кеш; nullptr - не считать.
+    void SetRecorder(PerfRecorder* recorder){
+        recorder_ = recorder;
+    }
+    PerfRecorder* GetRecorder() const{
+        return recorder_;
+    }
+#endif
+
+private:
+    std::pmr::memory_resource* resource_;
+#ifdef SPREADSHEET_INSTRUMENTATION
+    PerfRecorder* recorder_ = nullptr;
+#endif
+    std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> asts_;
+    // при таком размере из словаря убираются ключи умерших деревьев
+    size_t sweep_size_ = 64;
+};
+
+// Формула ячейки. Дерево может быть общим для многих ячеек: тогда позиции в
+// нём хранятся относительно anchor_, позиции ячейки с этой формулой. Объект
+// небольшой, ячейка хранит его у себя, без отдельной аллокации.
+class Formula final : public FormulaInterface {
+public:
+    explicit Formula(std::string expression);
+    Formula(std::shared_ptr<const FormulaAST> ast, Position anchor);
+
+    Value Evaluate(const SheetInterface& sheet) const override;
+    std::string GetExpression() const override;
+    std::vector<Position> GetReferencedCells() const override;
+    void ForEachReferencedCell(const std::function<void(Position)>& visit) const override;
+    std::vector<CellRange> GetReferencedRanges() const override;
+
+    // Дерево формулы и позиция, относительно которой записаны его ячейки.
+    const FormulaAST& GetAST() const{
+        return *ast_;
+    }
+    Position GetAnchor() const{
+        return anchor_;
+    }
+
+private:
+    friend class ReferenceShift;
+
+    std::shared_ptr<const FormulaAST> ast_;
+    Position anchor_{0, 0};
+};
+
+// Сдвиг ячеек листа при вставке или удалении строк (столбцов): count линий,
+// начиная с first, вставлены перед линией first или удалены. Переносит
+// позиции, диапазоны и формулы; ссылки на удалённые ячейки становятся #REF!.
+class ReferenceShift {
+public:
+    enum class Axis {
+        ROWS,
+        COLS,
+    };
+
+    // Копии деревьев размещаются в resource.
+    ReferenceShift(Axis axis, int first, int count, bool insert, std::pmr::memory_resource* resource);
+
+    // Новая позиция ячейки; nullopt - ячейка удалена или ушла за край листа.
+    std::optional<Position> MovePosition(Position pos) const;
+    // Новый диапазон: вставка внутри него его расширяет, удаление сужает;
+    // nullopt - диапазон удалён целиком.
+    std::optional<CellRange> MoveRange(const CellRange& range) const;
+    // Переносит формулу в ячейку anchor. Если ссылки формулы сдвинулись не
+    // так, как она сама, позиции в дереве переписываются без разбора текста:
+    // на месте, если дерево больше никому не нужно, иначе в копии. Копии с
+    // одинаковыми ссылками общие. Возвращает true, если ссылки изменились.
+    bool MoveFormula(Formula& formula, Position anchor);
+    // Деревья, переписанные на месте (см. FormulaCache::Forget).
+    const std::unordered_set<const FormulaAST*>& GetRewritten() const{
+        return rewritten_;
+    }
+
+private:
+    // новый номер строки или столбца; -1 - линия удалена или ушла за край
+    int MoveLine(int line) const;
+
+    Axis axis_;
+    int first_;
+    int count_;
+    bool insert_;
+    int limit_;
+    std::pmr::memory_resource* resource_;
+    // копии по исходному дереву и новым позициям в нём
+    std::unordered_map<std::string, std::shared_ptr<const FormulaAST>> copies_;
+    std::unordered_set<const FormulaAST*> rewritten_;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+// То же для формулы из ячейки anchor: дерево берётся из cache, если там
+// уже есть формула с той же относительной записью.
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor,
+                                               FormulaCache& cache);
+// То же, но формула возвращается по значению, чтобы её можно было хранить
+// прямо в ячейке.
+Formula ParseCellFormula(std::string expression, Position anchor, FormulaCache& cache);
+// То же для формулы, разобранной заранее, например в другом потоке: дерево
+// берётся из cache по ключу MakeRelativeKey(), а если его там нет,
+// собирается из tree - результата FormulaAST::Serialize() для дерева,
+// приведённого MakeRelative() к anchor. Текст формулы не разбирается.
+Formula RestoreCellFormula(const std::string& key, std::string_view tree, Position anchor,
+                           FormulaCache& cache);
@@ -0,0 +1,271 @@
+#include "importer.h"
+
+#include "cell.h"
+#include "formula.h"
+#include "sheet.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ios>
+#include <istream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// столько строк блока разбирает одна задача
+const size_t ROWS_PER_TASK = 256;
+// формула разбирается при записи, обычным Cell::Set
+const size_t NO_TREE = SIZE_MAX;
+
+// Строка входа без перевода строки; row - её номер от начала входа.
+struct Record {
+    std::string_view text;
+    int row = 0;
+};
+
+// Ячейки, которые разобрала одна задача. Формулы ещё не записаны: их
+// деревья попадают в кеш листа только при записи, в одном потоке.
+struct ParsedRows {
+    struct PendingFormula {
+        // номер ячейки в cells
+        size_t cell;
+        // номер ключа и дерева или NO_TREE
+        size_t tree;
+        // текст формулы, если дерева нет
+        std::string text;
+    };
+
+    std::vector<std::pair<Position, Cell>> cells;
+    std::vector<PendingFormula> formulas;
+    // различные формулы задачи: ключ MakeRelativeKey() и сериализованное
+    // относительное дерево
+    std::vector<std::string> keys;
+    std::vector<std::string> trees;
+};
+
+// Делит data на строки. Возвращает конец последней полной строки; если
+// last, незаконченный остаток тоже считается строкой. Перевод строки
+// внутри кавычек строку не заканчивает. Кавычки понимаются как в
+// ForEachField: поле в кавычках открывает только кавычка в его начале.
+size_t SplitRecords(std::string_view data, const ImportOptions& options, bool last,
+                    std::vector<Record>& records){
+    const char quote = options.quote;
+    auto add_record = [&records](std::string_view text){
+        if (!text.empty() && text.back() == '\r'){
+            text.remove_suffix(1);
+        }
+        records.push_back({text, 0});
+    };
+    size_t start = 0;
+    if (!quote){
+        for (size_t end; (end = data.find('\n', start)) != std::string_view::npos; start = end + 1){
+            add_record(data.substr(start, end - start));
+        }
+    }
+    else{
+        bool quoted = false;
+        bool field_start = true;
+        for (size_t i = 0; i < data.size(); ++i){
+            const char ch = data[i];
+            if (quoted){
+                if (ch == quote){
+                    // две кавычки подряд - кавычка в тексте поля
+                    if (i + 1 < data.size() && data[i + 1] == quote){
+                        ++i;
+                    }
+                    else{
+                        quoted = false;
+                    }
+                }
+                continue;
+            }
+            if (ch == quote && field_start){
+                quoted = true;
+            }
+            else if (ch == '\n'){
+                add_record(data.substr(start, i - start));
+                start = i + 1;
+            }
+            field_start = ch == options.delimiter || ch == '\n';
+        }
+    }
+    if (last && start < data.size()){
+        add_record(data.substr(start));
+        start = data.size();
+    }
+    return start;
+}
+
+// Вызывает func(col, field) для каждого поля строки. Поле в кавычках
+// раскодируется в buffer, так что func должна скопировать его сразу.
+template <typename Func>
+void ForEachField(std::string_view line, const ImportOptions& options, std::string& buffer, Func func){
+    const char quote = options.quote;
+    size_t start = 0;
+    for (int col = 0; ; ++col){
+        size_t end;
+        if (quote && start < line.size() && line[start] == quote){
+            buffer.clear();
+            size_t pos = start + 1;
+            while (pos < line.size()){
+                const size_t next = std::min(line.find(quote, pos), line.size());
+                buffer.append(line, pos, next - pos);
+                pos = next + 1;
+                // две кавычки подряд - одна кавычка в тексте поля
+                if (pos < line.size() && line[pos] == quote){
+                    buffer += quote;
+                    ++pos;
+                    continue;
+                }
+                break;
+            }
+            // после закрывающей кавычки поле продолжается до разделителя
+            end = std::min(line.find(options.delimiter, std::min(pos, line.size())), line.size());
+            if (pos < end){
+                buffer.append(line, pos, end - pos);
+            }
+            func(col, std::string_view(buffer));
+        }
+        else{
+            end = std::min(line.find(options.delimiter, start), line.size());
+            func(col, line.substr(start, end - start));
+        }
+        if (end == line.size()){
+            return;
+        }
+        start = end + 1;
+    }
+}
+
+// Разбирает строки [first, last): тексты записываются в ячейки сразу,
+// формулы одной относительной записи разбираются один раз. Не бросает
+// исключений, кроме нехватки памяти: формулы с ошибками оставляются
+// Cell::Set, который бросит то же исключение, что и SetCell.
+void ParseRows(const Record* first, const Record* last, const ImportOptions& options,
+               ParsedRows& out){
+    out = {};
+    std::unordered_map<std::string, size_t> tree_of;
+    std::string buffer;
+    std::string key;
+    auto prepare_formula = [&](std::string_view expression, Position pos){
+        if (!MakeRelativeKey(expression, pos, key)){
+            return NO_TREE;
+        }
+        auto [it, inserted] = tree_of.emplace(key, out.keys.size());
+        if (!inserted){
+            return it->second;
+        }
+        try{
+            FormulaAST ast = ParseFormulaAST(expression);
+            ast.MakeRelative(pos);
+            std::string tree;
+            ast.Serialize(tree);
+            out.keys.push_back(key);
+            out.trees.push_back(std::move(tree));
+            return it->second;
+        }
+        catch (const std::exception&){
+            tree_of.erase(it);
+            return NO_TREE;
+        }
+    };
+    for (const Record* record = first; record != last; ++record){
+        ForEachField(record->text, options, buffer, [&](int col, std::string_view field){
+            if (field.empty()){
+                return;
+            }
+            const Position pos{options.origin.row + record->row, options.origin.col + col};
+            out.cells.emplace_back(std::piecewise_construct, std::forward_as_tuple(pos),
+                                   std::forward_as_tuple());
+            if (field.size() > 1 && field[0] == FORMULA_SIGN){
+                const size_t tree = prepare_formula(field.substr(1), pos);
+                out.formulas.push_back({out.cells.size() - 1, tree,
+                                        tree == NO_TREE ? std::string(field) : std::string()});
+            }
+            else{
+                out.cells.back().second.SetText(std::string(field));
+            }
+        });
+    }
+}
+
+}  // namespace
+
+ImportStats ImportTable(Sheet& sheet, std::istream& in, const ImportOptions& options){
+    const size_t threads = options.threads ? options.threads :
+                           std::max<size_t>(1, std::thread::hardware_concurrency());
+    ThreadPool pool(threads);
+    const size_t chunk_size = std::max<size_t>(options.chunk_size, 1);
+
+    ImportStats stats;
+    std::string buffer;
+    // байт незаконченной строки из прошлого блока в начале buffer
+    size_t carried = 0;
+    std::vector<Record> records;
+    std::vector<ParsedRows> parsed;
+    for (bool last = false; !last; ){
+        buffer.resize(carried + chunk_size);
+        in.read(buffer.data() + carried, static_cast<std::streamsize>(chunk_size));
+        const size_t read = static_cast<size_t>(in.gcount());
+        if (in.bad()){
+            throw std::ios_base::failure("Cannot read the imported table");
+        }
+        stats.bytes += read;
+        last = read < chunk_size;
+        const std::string_view data(buffer.data(), carried + read);
+
+        records.clear();
+        const size_t end = SplitRecords(data, options, last, records);
+        for (auto& record : records){
+            record.row = static_cast<int>(stats.rows++);
+        }
+
+        const size_t tasks = (records.size() + ROWS_PER_TASK - 1) / ROWS_PER_TASK;
+        parsed.resize(tasks);
+        pool.ParallelFor(tasks, [&](size_t task){
+            const Record* first = records.data() + task * ROWS_PER_TASK;
+            const Record* last_record = records.data() + std::min(records.size(), (task + 1) * ROWS_PER_TASK);
+            ParseRows(first, last_record, options, parsed[task]);
+        });
+
+        // запись блока: деревья формул попадают в кеш листа
+        size_t cell_count = 0;
+        for (const auto& rows : parsed){
+            cell_count += rows.cells.size();
+        }
+        stats.cells += cell_count;
+        std::vector<std::pair<Position, Cell>> cells;
+        cells.reserve(cell_count);
+        for (auto& rows : parsed){
+            for (auto& formula : rows.formulas){
+                auto& [pos, cell] = rows.cells[formula.cell];
+                if (formula.tree == NO_TREE){
+                    cell.Set(std::move(formula.text), sheet, pos);
+                }
+                else{
+                    cell.SetFormula(rows.keys[formula.tree], rows.trees[formula.tree], sheet, pos);
+                }
+            }
+            std::move(rows.cells.begin(), rows.cells.end(), std::back_inserter(cells));
+        }
+        parsed.clear();
+        if (!cells.empty()){
+            sheet.SetPreparedCells(std::move(cells));
+        }
+
+        // незаконченная строка переносится в начало буфера; если строка
+        // длиннее блока, буфер растёт, пока она не прочитается целиком
+        carried = data.size() - end;
+        std::memmove(buffer.data(), buffer.data() + end, carried);
+    }
+    return stats;
+}
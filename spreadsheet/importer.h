@@ -0,0 +1,50 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <iosfwd>
+
+class Sheet;
+
+// Настройки импорта таблицы из текста с разделителями.
+struct ImportOptions {
+    // разделитель полей: '\t' для TSV, ',' для CSV
+    char delimiter = '\t';
+    // символ кавычек (CSV): поле в кавычках может содержать разделители и
+    // переводы строк, две кавычки подряд означают одну. 0 - кавычки не
+    // обрабатываются, как в TSV
+    char quote = '\0';
+    // позиция, в которую попадает первое поле первой строки
+    Position origin{0, 0};
+    // число потоков разбора, 0 - по числу ядер
+    size_t threads = 0;
+    // размер блока чтения в байтах. Память импорта ограничена несколькими
+    // такими блоками и не зависит от размера входа
+    size_t chunk_size = 1 << 20;
+
+    static ImportOptions Tsv() {
+        return {};
+    }
+    static ImportOptions Csv() {
+        ImportOptions options;
+        options.delimiter = ',';
+        options.quote = '"';
+        return options;
+    }
+};
+
+struct ImportStats {
+    size_t rows = 0;
+    // непустые поля, записанные в ячейки
+    size_t cells = 0;
+    size_t bytes = 0;
+};
+
+// Читает таблицу из in блоками по options.chunk_size и записывает её в sheet:
+// строка входа - строка листа, поле - ячейка, пустые поля пропускаются.
+// Строки блока делятся между потоками, которые разбирают поля, вычисляют
+// числовые значения текстов и разбирают формулы; затем блок целиком
+// записывается в лист через Sheet::SetPreparedCells. Исключения те же,
+// что у SetCells; блоки, записанные до ошибки, остаются в листе.
+ImportStats ImportTable(Sheet& sheet, std::istream& in, const ImportOptions& options = {});
@@ -0,0 +1,143 @@
+#include "sheet.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+void Sheet::SetUndoLimit(size_t limit){
+    undo_limit_ = limit;
+    // у обоих списков первыми выбрасываются самые давние правки
+    while (undo_journal_.size() > limit){
+        undo_journal_.pop_front();
+    }
+    while (redo_journal_.size() > limit){
+        redo_journal_.pop_front();
+    }
+}
+
+bool Sheet::Undo(){
+    return ReplayJournal(undo_journal_, redo_journal_);
+}
+
+bool Sheet::Redo(){
+    return ReplayJournal(redo_journal_, undo_journal_);
+}
+
+size_t Sheet::GetUndoCount() const{
+    return undo_journal_.size();
+}
+
+size_t Sheet::GetRedoCount() const{
+    return redo_journal_.size();
+}
+
+size_t Sheet::GetJournalMemory() const{
+    // короткий текст лежит внутри std::string и отдельно память не занимает
+    const size_t short_text = std::string().capacity();
+    size_t bytes = 0;
+    for (const auto* journal : {&undo_journal_, &redo_journal_}){
+        for (const auto& entry : *journal){
+            bytes += sizeof(JournalEntry) + entry.capacity() * sizeof(JournalDelta);
+            for (const auto& delta : entry){
+                const std::string* text = delta.content ? std::get_if<std::string>(&*delta.content) : nullptr;
+                if (text && text->capacity() > short_text){
+                    bytes += text->capacity() + 1;
+                }
+            }
+        }
+    }
+    return bytes;
+}
+
+void Sheet::ShiftJournal(ReferenceShift& shift){
+    // записи о ячейках удалённых строк (столбцов) выпадают, опустевшие
+    // правки - целиком
+    for (auto* journal : {&undo_journal_, &redo_journal_}){
+        for (auto& entry : *journal){
+            size_t kept = 0;
+            for (auto& delta : entry){
+                const auto pos = shift.MovePosition(delta.pos);
+                if (!pos){
+                    continue;
+                }
+                Formula* formula = delta.content ? std::get_if<Formula>(&*delta.content) : nullptr;
+                if (formula){
+                    shift.MoveFormula(*formula, *pos);
+                }
+                delta.pos = *pos;
+                if (&entry[kept] != &delta){
+                    entry[kept] = std::move(delta);
+                }
+                ++kept;
+            }
+            entry.erase(entry.begin() + kept, entry.end());
+        }
+        journal->erase(std::remove_if(journal->begin(), journal->end(), [](const JournalEntry& entry){
+            return entry.empty();
+        }), journal->end());
+    }
+}
+
+void Sheet::PushUndo(JournalEntry entry){
+    redo_journal_.clear();
+    undo_journal_.push_back(std::move(entry));
+    if (undo_journal_.size() > undo_limit_){
+        undo_journal_.pop_front();
+    }
+}
+
+bool Sheet::ReplayJournal(std::deque<JournalEntry>& from, std::deque<JournalEntry>& to){
+    if (from.empty()){
+        return false;
+    }
+    // правки внутри ApplyJournalEntry пишут прежнее содержимое сюда
+    JournalEntry reverse;
+    journal_ = &reverse;
+    try{
+        ApplyJournalEntry(from.back());
+    }
+    catch (...){
+        journal_ = nullptr;
+        throw;
+    }
+    journal_ = nullptr;
+    from.pop_back();
+    to.push_back(std::move(reverse));
+    return true;
+}
+
+void Sheet::ApplyJournalEntry(const JournalEntry& entry){
+    // первая запись о позиции хранит её состояние до правки, поздние - уже
+    // промежуточные
+    std::unordered_set<Position> seen;
+    std::vector<std::pair<Position, Cell>> cells;
+    std::vector<Position> absent;
+    for (const auto& [pos, content] : entry){
+        if (!seen.insert(pos).second){
+            continue;
+        }
+        if (content){
+            Cell cell;
+            cell.SetContent(*content, *this);
+            cells.emplace_back(pos, std::move(cell));
+        }
+        else{
+            absent.push_back(pos);
+        }
+    }
+    // прежнее содержимое возвращается одним пакетом: связи, проверка на
+    // циклы и сброс кешей зависимых формул - как у обычной правки
+    if (!cells.empty()){
+        SetPreparedCells(std::move(cells));
+    }
+    // ячеек, созданных правкой, не было: сначала убираются формулы, затем
+    // пустые ячейки, на которые ссылались только они
+    for (const auto& pos : absent){
+        ClearCell(pos);
+    }
+    for (const auto& pos : absent){
+        const Cell* cell = table_.Find(pos);
+        if (cell && cell->cell_depend_up_.Empty()){
+            ClearCell(pos);
+        }
+    }
+}
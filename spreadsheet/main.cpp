@@ -1,6 +1,18 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
 #include <limits>
+#include <random>
+#include <thread>
 #include "common.h"
 #include "formula.h"
+#include "importer.h"
+#include "sheet.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -131,6 +143,39 @@ void TestClearCell() {
     sheet->ClearCell("J10"_pos);
 }
 
+void TestPrintableSizeAfterClear() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("C5"_pos, "2");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{5, 3}));
+    sheet.ClearCell("C5"_pos);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{0, 0}));
+
+    std::mt19937 generator(11);
+    for (int i = 0; i < 2000; ++i) {
+        Position pos{static_cast<int>(generator() % 40), static_cast<int>(generator() % 30)};
+        if (generator() % 2) {
+            sheet.SetCell(pos, "x");
+        } else {
+            sheet.ClearCell(pos);
+        }
+        Size expected{0, 0};
+        for (int row = 0; row < 40; ++row) {
+            for (int col = 0; col < 30; ++col) {
+                if (sheet.GetCell({row, col})) {
+                    expected.rows = std::max(expected.rows, row + 1);
+                    expected.cols = std::max(expected.cols, col + 1);
+                }
+            }
+        }
+        ASSERT_EQUAL(sheet.GetPrintableSize(), expected);
+    }
+    sheet.SetCell({Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "corner");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+}
+
 void TestFormulaArithmetic() {
     auto sheet = CreateSheet();
     auto evaluate = [&](std::string expr) {
@@ -292,6 +337,79 @@ void TestPrint() {
     ASSERT_EQUAL(values.str(), "\t\nmeow\t35\n");
 }
 
+void TestPrintMatchesStreamOutput() {
+    // Печать идёт мимо ostream, результат должен совпадать с ним байт в байт
+    Sheet sheet;
+    const std::vector<std::string> texts = {
+        "0.1", "123456789", "1e-7", "-2.5", "'=text", "text", "=1/3", "=A1*1e20",
+        "=1/0", "=B1", "=-0", "=1234567", "=0.000123456789", "=ZZ1+1", "'",
+    };
+    std::mt19937 generator(3);
+    for (int i = 0; i < 300; ++i) {
+        Position pos{static_cast<int>(generator() % 200), static_cast<int>(generator() % 130)};
+        try {
+            sheet.SetCell(pos, texts[generator() % texts.size()]);
+        } catch (const CircularDependencyException&) {
+        }
+        if (generator() % 5 == 0) {
+            sheet.ClearCell(pos);
+        }
+    }
+
+    auto print_by_stream = [&sheet](bool values, const std::ios& format = std::ostringstream()) {
+        std::ostringstream output;
+        output.copyfmt(format);
+        const Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                if (const CellInterface* cell = sheet.GetCell({row, col})) {
+                    if (values) {
+                        output << cell->GetValue();
+                    } else {
+                        output << cell->GetText();
+                    }
+                }
+                if (col < size.cols - 1) {
+                    output << '\t';
+                }
+            }
+            output << '\n';
+        }
+        return output.str();
+    };
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), print_by_stream(true));
+    std::ostringstream texts_output;
+    sheet.PrintTexts(texts_output);
+    ASSERT_EQUAL(texts_output.str(), print_by_stream(false));
+
+    // точность и флаги потока действуют так же, как у operator<<, и при
+    // печати опубликованной версии
+    const auto version = sheet.PublishVersion();
+    auto check_format = [&](auto configure) {
+        std::ostringstream format;
+        configure(format);
+        std::ostringstream sheet_values;
+        configure(sheet_values);
+        sheet.PrintValues(sheet_values);
+        ASSERT_EQUAL(sheet_values.str(), print_by_stream(true, format));
+        std::ostringstream version_values;
+        configure(version_values);
+        version->PrintValues(version_values);
+        ASSERT_EQUAL(version_values.str(), print_by_stream(true, format));
+    };
+    check_format([](std::ostream& output) {
+        output << std::setprecision(10);
+    });
+    check_format([](std::ostream& output) {
+        output << std::fixed << std::setprecision(2);
+    });
+    check_format([](std::ostream& output) {
+        output << std::scientific << std::uppercase << std::showpos;
+    });
+}
+
 void TestCellReferences() {
     auto sheet = CreateSheet();
     sheet->SetCell("A1"_pos, "1");
@@ -316,6 +434,47 @@ void TestCellReferences() {
     ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
 }
 
+void TestHandParserMatchesAntlr() {
+    // Случайные строки из алфавита грамматики и почти корректные формулы:
+    // ручной разбор должен принимать и отвергать то же, что и ANTLR, и
+    // строить то же дерево
+    SetParserValidation(true);
+    std::mt19937 generator(5);
+    const std::string alphabet = "0123456789.eE+-*/() \tAZBz:,SUM";
+    auto random_token = [&generator]() -> std::string {
+        static const std::vector<std::string> tokens = {
+            "1", "2.5", ".5", "1e3", "1E+2", "3e-1", "1e", "1.", "1e400", "1e-400", "A1", "ZZ9", "B12",
+            "A0", "AAAAA1", "XFD16384", "XFE1", "A16385", "+", "-", "*", "/", "(", ")", " ", "",
+            ":", ",", "SUM(", "MAX(", "COUNT(", "FOO(", "SUM", "A1:B2", "B3:A1", "A1:XFE1",
+        };
+        return tokens[generator() % tokens.size()];
+    };
+    int parsed = 0;
+    std::string disagreement;
+    for (int i = 0; i < 20000 && disagreement.empty(); ++i) {
+        std::string text;
+        const size_t length = generator() % 12;
+        for (size_t j = 0; j < length; ++j) {
+            text += i % 2 ? std::string(1, alphabet[generator() % alphabet.size()]) : random_token();
+        }
+        try {
+            ParseFormulaAST(text);
+            ++parsed;
+        } catch (const std::logic_error& e) {
+            disagreement = e.what();
+        } catch (const std::exception&) {
+        }
+    }
+    SetParserValidation(false);
+    ASSERT_EQUAL(disagreement, "");
+    ASSERT(parsed > 1000);
+
+    ASSERT_EQUAL(ParseFormula("-1*2+3/-(A1)")->GetExpression(), "-1*2+3/-A1");
+    ASSERT_EQUAL(ParseFormula("1-2-3")->GetExpression(), "1-2-3");
+    ASSERT_EQUAL(ParseFormula("1-(2-3)")->GetExpression(), "1-(2-3)");
+    ASSERT_EQUAL(ParseFormula("SUM( B3:A1 , (1+2) )*2")->GetExpression(), "SUM(A1:B3,1+2)*2");
+}
+
 void TestFormulaIncorrect() {
     auto isIncorrect = [](std::string expression) {
         try {
@@ -350,8 +509,1429 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestClearReferencedCell() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B1+1");
+    sheet.SetCell("B1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+    sheet.SetCell("B1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+    sheet.ClearCell("B1"_pos);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.ClearCell("B1"_pos);
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+}
+
+void TestCircularCheckOnLargeGraph() {
+    // Больше 100k связей: проверка идёт по топологическому порядку. Правки в
+    // углу листа сверяются с маленьким листом, где работает обход в глубину.
+    Sheet large;
+    std::vector<std::pair<Position, std::string>> ballast;
+    for (int i = 0; i < 100100; ++i) {
+        ballast.push_back({{100 + i / 100, 10 + i % 100}, "=A100+" + std::to_string(i % 7)});
+    }
+    large.SetCells(std::move(ballast));
+    Sheet small;
+
+    std::mt19937 generator(9);
+    auto random_pos = [&generator] {
+        return Position{static_cast<int>(generator() % 5), static_cast<int>(generator() % 5)};
+    };
+    for (int i = 0; i < 3000; ++i) {
+        const Position pos = random_pos();
+        std::string text = "=" + random_pos().ToString();
+        if (generator() % 2) {
+            text += "+" + random_pos().ToString();
+        }
+        if (generator() % 3 == 0) {
+            text += "+SUM(" + random_pos().ToString() + ":" + random_pos().ToString() + ")";
+        }
+        if (generator() % 4 == 0) {
+            text = std::to_string(i);
+        }
+        bool small_caught = false;
+        bool large_caught = false;
+        try {
+            small.SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            small_caught = true;
+        }
+        try {
+            large.SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            large_caught = true;
+        }
+        ASSERT_EQUAL(large_caught, small_caught);
+        if (generator() % 10 == 0) {
+            large.ClearCell(pos);
+            small.ClearCell(pos);
+        }
+    }
+    for (int row = 0; row < 5; ++row) {
+        for (int col = 0; col < 5; ++col) {
+            const CellInterface* small_cell = small.GetCell({row, col});
+            const CellInterface* large_cell = large.GetCell({row, col});
+            ASSERT_EQUAL(large_cell == nullptr, small_cell == nullptr);
+            if (small_cell) {
+                ASSERT_EQUAL(large_cell->GetValue(), small_cell->GetValue());
+            }
+        }
+    }
+
+    large.SetCell("A100"_pos, "2");
+    ASSERT_EQUAL(large.GetCell("K101"_pos)->GetValue(), CellInterface::Value(2.0));
+    bool caught = false;
+    try {
+        large.SetCell("A100"_pos, "=K101");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestSharedFormulaTrees() {
+    FormulaCache cache;
+    auto c1 = ParseFormula("A1*B1+C2", "C1"_pos, cache);
+    auto c2 = ParseFormula("A2*B2+C3", "C2"_pos, cache);
+    auto other = ParseFormula("A1*B1+C2", "C2"_pos, cache);
+    ASSERT_EQUAL(cache.Size(), 2u);
+    ASSERT_EQUAL(c2->GetExpression(), "A2*B2+C3");
+    ASSERT_EQUAL(c2->GetReferencedCells(), (std::vector{"A2"_pos, "B2"_pos, "C3"_pos}));
+    ASSERT_EQUAL(other->GetExpression(), "A1*B1+C2");
+    c1.reset();
+    other.reset();
+    ASSERT_EQUAL(cache.Size(), 1u);
+
+    bool caught = false;
+    try {
+        ParseFormula("A1 2", "C1"_pos, cache);
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    Sheet sheet;
+    sheet.SetCell("C1"_pos, "0");
+    for (int row = 1; row < 100; ++row) {
+        const std::string r = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, r);
+        sheet.SetCell({row, 2}, "=A" + r + "*2+C" + std::to_string(row));
+    }
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetValue(), CellInterface::Value(10098.0));
+    ASSERT_EQUAL(sheet.GetCell("C50"_pos)->GetText(), "=A50*2+C49");
+    sheet.SetCell("A2"_pos, "0");
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetValue(), CellInterface::Value(10094.0));
+}
+
+void TestBytecodeMatchesTreeEvaluation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("A2"_pos, "-0.5");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("B2"_pos, "=1/0");
+    sheet.SetCell("C1"_pos, "=A1*A2");
+
+    const std::vector<std::string> operands = {"A1", "A2", "B1", "B2", "C1", "C3", "0", "2", "1e300"};
+    const std::string operators = "+-*/";
+    const std::vector<std::string> functions = {"SUM", "MIN", "MAX", "AVERAGE", "COUNT"};
+    const std::vector<std::string> ranges = {"A1:A2", "A1:C3", "C1:C3", "D1:D5"};
+    std::mt19937 gen(42);
+    auto random_index = [&gen](size_t size) {
+        return std::uniform_int_distribution<size_t>(0, size - 1)(gen);
+    };
+    std::function<std::string(int)> make_expr = [&](int depth) -> std::string {
+        if (depth == 0 || random_index(3) == 0) {
+            return operands[random_index(operands.size())];
+        }
+        if (random_index(5) == 0) {
+            return std::string(1, operators[random_index(2)]) + "(" + make_expr(depth - 1) + ")";
+        }
+        if (random_index(5) == 0) {
+            std::string call = functions[random_index(functions.size())] + "(";
+            const size_t args = 1 + random_index(3);
+            for (size_t arg = 0; arg < args; ++arg) {
+                call += arg ? "," : "";
+                call += random_index(2) ? ranges[random_index(ranges.size())] : make_expr(depth - 1);
+            }
+            return call + ")";
+        }
+        return "(" + make_expr(depth - 1) + ")" + operators[random_index(operators.size())] + "("
+               + make_expr(depth - 1) + ")";
+    };
+
+    auto fcell = [&sheet](Position pos) {
+        return sheet.GetCellNumber(pos);
+    };
+    auto frange = [&sheet](CellRange range, Aggregate& aggregate) {
+        return sheet.AddRangeNumbers(range, aggregate);
+    };
+    auto execute = [&](auto method, const FormulaAST& ast) -> CellInterface::Value {
+        ExecResult result = (ast.*method)(fcell, Position{0, 0}, frange);
+        if (std::holds_alternative<FormulaError>(result)) {
+            return std::get<FormulaError>(result);
+        }
+        return std::get<double>(result);
+    };
+
+    for (int i = 0; i < 1000; ++i) {
+        std::string expr = make_expr(6);
+        FormulaAST ast = ParseFormulaAST(expr);
+        ASSERT_EQUAL(execute(&FormulaAST::Execute, ast), execute(&FormulaAST::ExecuteTree, ast));
+    }
+}
+
+void TestLongDependencyChain() {
+    Sheet sheet;
+    const int length = 50000;
+    auto chain_pos = [](int i) {
+        return Position{i % Position::MAX_ROWS, i / Position::MAX_ROWS};
+    };
+    // заполняем с конца, чтобы каждая вставка ссылалась на ещё пустую ячейку
+    for (int i = length - 1; i > 0; --i) {
+        sheet.SetCell(chain_pos(i), "=" + chain_pos(i - 1).ToString() + "+1");
+    }
+    sheet.SetCell(chain_pos(0), "1");
+    ASSERT_EQUAL(sheet.GetCell(chain_pos(length - 1))->GetValue(), CellInterface::Value(double(length)));
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+
+    sheet.SetCell(chain_pos(0), "2");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), size_t(length - 1));
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(sheet.GetCell(chain_pos(length - 1))->GetValue(), CellInterface::Value(double(length + 1)));
+}
+
+void TestRecalculateOnlyDirty() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1*2");
+    sheet.SetCell("A3"_pos, "=A2+A1");
+    sheet.SetCell("B1"_pos, "=10");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 3u);
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 2u);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 1u);
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(15.0));
+
+    sheet.ClearCell("A3"_pos);
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 1u);
+}
+
+void TestParallelRecalculation() {
+    auto fill = [](Sheet& sheet) {
+        for (int row = 0; row < 2000; ++row) {
+            std::string prev = Position{row, 0}.ToString();
+            sheet.SetCell({row, 0}, std::to_string(row));
+            sheet.SetCell({row, 1}, "=" + prev + "*2");
+            sheet.SetCell({row, 2}, "=" + prev + "/(" + prev + "-7)");
+            sheet.SetCell({row, 3}, "=B" + std::to_string(row + 1) + "+C" + std::to_string(row + 1));
+            if (row > 0) {
+                sheet.SetCell({row, 4}, "=E" + std::to_string(row) + "+B" + std::to_string(row + 1));
+            }
+        }
+    };
+    Sheet sequential;
+    fill(sequential);
+    sequential.Recalculate();
+
+    Sheet parallel;
+    parallel.SetRecalculationThreads(4);
+    fill(parallel);
+    parallel.Recalculate();
+    ASSERT_EQUAL(parallel.GetDirtyCount(), 0u);
+
+    std::ostringstream expected, actual;
+    sequential.PrintValues(expected);
+    parallel.PrintValues(actual);
+    ASSERT_EQUAL(actual.str(), expected.str());
+
+    parallel.SetCell("A1"_pos, "100");
+    sequential.SetCell("A1"_pos, "100");
+    parallel.Recalculate();
+    ASSERT_EQUAL(parallel.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(parallel.GetCell("E2000"_pos)->GetValue(), sequential.GetCell("E2000"_pos)->GetValue());
+}
+
+void TestSetCellsBatch() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("C1"_pos, "=A1+1");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    sheet.SetCells({{"A1"_pos, "=B1*2"}, {"B1"_pos, "=B2+3"}, {"B2"_pos, "4"}, {"B2"_pos, "5"}});
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(16.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(17.0));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "5");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{2, 3}));
+
+    std::ostringstream before;
+    sheet.PrintTexts(before);
+
+    bool caught = false;
+    try {
+        sheet.SetCells({{"B2"_pos, "=D5+1"}, {"D5"_pos, "=A1"}, {"E9"_pos, "=F10"}});
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    std::ostringstream after;
+    sheet.PrintTexts(after);
+    ASSERT_EQUAL(after.str(), before.str());
+    ASSERT(sheet.GetCell("D5"_pos) == nullptr);
+    ASSERT(sheet.GetCell("F10"_pos) == nullptr);
+    ASSERT_EQUAL(static_cast<Cell*>(sheet.GetCell("B2"_pos))->GetUpDependencesCells(), std::vector{"B1"_pos});
+
+    caught = false;
+    try {
+        sheet.SetCells({{"B2"_pos, "7"}, {"D5"_pos, "=1+"}});
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "5");
+
+    sheet.SetCell("B2"_pos, "6");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(19.0));
+}
+
+void TestRangeFunctions() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "'4");
+    sheet.SetCell("A3"_pos, "text");
+    sheet.SetCell("A4"_pos, "");
+    sheet.SetCell("B1"_pos, "=A1*10");
+    sheet.SetCell("C1"_pos, "=SUM(A1:B4)");
+    sheet.SetCell("C2"_pos, "=MIN(A1:B4,-2)");
+    sheet.SetCell("C3"_pos, "=MAX(A1:B4)");
+    sheet.SetCell("C4"_pos, "=AVERAGE(A1:B4)");
+    sheet.SetCell("C5"_pos, "=COUNT(A1:B4,7,D1:D9)");
+    sheet.SetCell("C6"_pos, "=AVERAGE(D1:D9)");
+    sheet.SetCell("C7"_pos, "=MAX(D1:D9)+SUM(A1,A1:A1)");
+    auto value = [&sheet](Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    // пустые ячейки и текст без числа пропускаются
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(15.0));
+    ASSERT_EQUAL(value("C2"_pos), CellInterface::Value(-2.0));
+    ASSERT_EQUAL(value("C3"_pos), CellInterface::Value(10.0));
+    ASSERT_EQUAL(value("C4"_pos), CellInterface::Value(5.0));
+    ASSERT_EQUAL(value("C5"_pos), CellInterface::Value(4.0));
+    ASSERT_EQUAL(value("C6"_pos), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(value("C7"_pos), CellInterface::Value(2.0));
+
+    // диапазон не разворачивается в ссылки на ячейки
+    const auto* sum_cell = sheet.GetCell("C7"_pos);
+    ASSERT_EQUAL(sum_cell->GetReferencedCells(), std::vector<Position>{"A1"_pos});
+    ASSERT(!sheet.GetCell("D1"_pos));
+    ASSERT_EQUAL(ParseFormula("SUM(A1:B2,B2:A1,1)")->GetReferencedRanges().size(), 1u);
+
+    // правка внутри диапазона, в том числе новой и удалённой ячейки,
+    // сбрасывает кеш зависимых формул
+    sheet.SetCell("B4"_pos, "=A1/0");
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(FormulaError::Category::Div0));
+    sheet.ClearCell("B4"_pos);
+    sheet.SetCell("B2"_pos, "5");
+    ASSERT_EQUAL(value("C1"_pos), CellInterface::Value(20.0));
+    sheet.SetCell("D5"_pos, "=C1");
+    ASSERT_EQUAL(value("C7"_pos), CellInterface::Value(22.0));
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 9u);
+    sheet.Recalculate();
+    ASSERT_EQUAL(value("C7"_pos), CellInterface::Value(35.0));
+
+    auto is_circular = [&sheet](Position pos, std::string text) {
+        try {
+            sheet.SetCell(pos, std::move(text));
+        } catch (const CircularDependencyException&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(is_circular("A2"_pos, "=C1"));
+    ASSERT(is_circular("E1"_pos, "=SUM(A1:E1)"));
+    ASSERT(is_circular("D9"_pos, "=C7"));
+    ASSERT_EQUAL(value("C7"_pos), CellInterface::Value(35.0));
+
+    auto is_incorrect = [](std::string expression) {
+        try {
+            ParseFormula(std::move(expression));
+        } catch (const FormulaException&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(is_incorrect("A1:B2"));
+    ASSERT(is_incorrect("SUM(A1:B2)+A1:B2"));
+    ASSERT(is_incorrect("-(A1:B2)"));
+    ASSERT(is_incorrect("FOO(1)"));
+    ASSERT(is_incorrect("SUM()"));
+    ASSERT(is_incorrect("SUM (1)"));
+    ASSERT(is_incorrect("SUM(A1:)"));
+    ASSERT(is_incorrect("SUM(A1:XFE1)"));
+}
+
+void TestRangeIndexMatchesScan() {
+    // индекс должен находить те же формулы, что и перебор всех диапазонов
+    RangeIndex index;
+    std::vector<std::pair<CellRange, Position>> entries;
+    std::mt19937 generator(17);
+    auto random_range = [&generator] {
+        const int row = static_cast<int>(generator() % 200);
+        const int col = static_cast<int>(generator() % 50);
+        const int rows = generator() % 8 == 0 ? static_cast<int>(generator() % 150) : static_cast<int>(generator() % 5);
+        return CellRange{{row, col}, {row + rows, col + static_cast<int>(generator() % 10)}};
+    };
+    for (int i = 0; i < 20000; ++i) {
+        if (entries.empty() || generator() % 3) {
+            const CellRange range = random_range();
+            const Position formula{i, 0};
+            index.Insert(range, formula);
+            entries.push_back({range, formula});
+        } else {
+            const size_t erased = generator() % entries.size();
+            index.Erase(entries[erased].first, entries[erased].second);
+            entries[erased] = entries.back();
+            entries.pop_back();
+        }
+        if (i % 20 == 0) {
+            const Position pos{static_cast<int>(generator() % 220), static_cast<int>(generator() % 60)};
+            std::vector<Position> expected;
+            for (const auto& [range, formula] : entries) {
+                if (range.Contains(pos)) {
+                    expected.push_back(formula);
+                }
+            }
+            std::vector<Position> found;
+            index.ForEachCovering(pos, [&found](Position formula) {
+                found.push_back(formula);
+            });
+            std::sort(expected.begin(), expected.end());
+            std::sort(found.begin(), found.end());
+            ASSERT_EQUAL(found, expected);
+        }
+    }
+    ASSERT_EQUAL(index.Size(), entries.size());
+}
+
+void TestTextNumberInterpretation() {
+    auto number = [](std::string_view text) {
+        ExecResult result = TextToNumber(text);
+        return std::holds_alternative<double>(result) ? CellInterface::Value(std::get<double>(result))
+                                                      : CellInterface::Value(std::get<FormulaError>(result));
+    };
+    const auto value_error = CellInterface::Value(FormulaError::Category::Value);
+
+    ASSERT_EQUAL(number(""), CellInterface::Value(0.0));
+    ASSERT_EQUAL(number("12.5"), CellInterface::Value(12.5));
+    ASSERT_EQUAL(number("-3e2"), CellInterface::Value(-300.0));
+    ASSERT_EQUAL(number(" 7"), CellInterface::Value(7.0));
+    ASSERT_EQUAL(number("+7"), CellInterface::Value(7.0));
+    ASSERT_EQUAL(number("0x10"), CellInterface::Value(16.0));
+    ASSERT_EQUAL(number("7 "), value_error);
+    ASSERT_EQUAL(number("3D"), value_error);
+    ASSERT_EQUAL(number("1e999"), value_error);
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "'42");
+    sheet.SetCell("A2"_pos, "'");
+    sheet.SetCell("B1"_pos, "=A1+A2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(42.0));
+    sheet.SetCell("A1"_pos, "forty-two");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), value_error);
+}
+
+void TestCachedErrorsAndText() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=1/0");
+    sheet.SetCell("A2"_pos, "'=text");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SetCell("B2"_pos, "=A2");
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value("=text"));
+
+    sheet.SetCell("A1"_pos, "=2/1");
+    sheet.SetCell("A2"_pos, "3");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 3u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(3.0));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value("3"));
+}
 }  // namespace
 
+void TestDependentsGrowAndShrink() {
+    // обратные связи хранятся в ячейке до двух штук, дальше - в хеш-таблице
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    const auto* a1 = static_cast<const Cell*>(sheet.GetCell("A1"_pos));
+    std::vector<Position> expected;
+    for (int row = 0; row < 5; ++row){
+        const Position pos{row, 1};
+        sheet.SetCell(pos, "=A1*" + std::to_string(row));
+        expected.push_back(pos);
+        ASSERT_EQUAL(a1->GetUpDependencesCells(), expected);
+    }
+    sheet.SetCell("B1"_pos, "=A1*10");
+    ASSERT_EQUAL(a1->GetUpDependencesCells(), expected);
+
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(30.0));
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(12.0));
+
+    while (!expected.empty()){
+        sheet.ClearCell(expected.back());
+        expected.pop_back();
+        ASSERT_EQUAL(a1->GetUpDependencesCells(), expected);
+    }
+    sheet.SetCell("C1"_pos, "=A1+1");
+    ASSERT_EQUAL(a1->GetUpDependencesCells(), std::vector{"C1"_pos});
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+}
+
+void TestFormulaMemoryStats() {
+    CountingResource upstream(std::pmr::new_delete_resource());
+    {
+        Sheet sheet(&upstream);
+        ASSERT_EQUAL(sheet.GetAllocationStats().allocations, 0u);
+        for (int row = 0; row < 1000; ++row){
+            sheet.SetCell({row, 1}, "=A" + std::to_string(row + 1) + "*2");
+        }
+        // все формулы столбца делят одно дерево
+        const AllocationStats shared = sheet.GetAllocationStats();
+        ASSERT(shared.allocations > 0 && shared.allocations <= 3);
+        ASSERT(shared.bytes_in_use > 0);
+        ASSERT(upstream.GetStats().allocations > 0);
+
+        sheet.SetCell("C1"_pos, "=SUM(A1:A1000)/COUNT(B1:B1000)");
+        const AllocationStats distinct = sheet.GetAllocationStats();
+        ASSERT(distinct.allocations > shared.allocations);
+        ASSERT(distinct.bytes_in_use > shared.bytes_in_use);
+        sheet.ClearCell("C1"_pos);
+        ASSERT(sheet.GetAllocationStats().deallocations > distinct.deallocations);
+        ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetValue(), CellInterface::Value(0.0));
+    }
+    // пулы листа вернули всю память вместе с ним
+    ASSERT_EQUAL(upstream.GetStats().bytes_in_use, 0u);
+}
+
+void TestFormulaTreeSerialization() {
+    for (const char* text : {"1", "-A1", "+(1+2)*B3/4-C5", "SUM(A1:B3,2,MIN(C1:C2,-1))",
+                             "1/3", "AVERAGE(A1:A3)+COUNT(B1:C2,D4)"}) {
+        FormulaAST ast = ParseFormulaAST(text);
+        std::string data;
+        ast.Serialize(data);
+        FormulaAST copy = FormulaAST::Deserialize(data);
+        std::ostringstream expected, actual;
+        expected.precision(17);
+        actual.precision(17);
+        ast.Print(expected);
+        ast.PrintCells(expected);
+        copy.Print(actual);
+        copy.PrintCells(actual);
+        ASSERT_EQUAL(actual.str(), expected.str());
+        ASSERT_EQUAL(copy.GetCode().size(), ast.GetCode().size());
+
+        // оборванный узел, лишний операнд и неизвестный узел не собираются
+        for (const std::string& bad : {data.substr(0, data.size() - 1), data + data, data + 'X'}) {
+            try {
+                FormulaAST::Deserialize(bad);
+                ASSERT(false);
+            } catch (const ParsingError&) {
+            }
+        }
+    }
+}
+
+void TestImportTable() {
+    // вход во всех разбиениях на блоки даёт тот же лист, что и SetCell
+    std::string tsv;
+    std::vector<std::pair<Position, std::string>> expected;
+    std::mt19937 random(7);
+    for (int row = 0; row < 300; ++row) {
+        for (int col = 0; col < 6; ++col) {
+            std::string text;
+            switch (random() % 6) {
+            case 0:
+                break;
+            case 1:
+                text = std::to_string(random() % 1000);
+                break;
+            case 2:
+                text = "'=text " + std::to_string(row);
+                break;
+            case 3:
+                text = "=" + Position{row + 1, col}.ToString() + "*2";
+                break;
+            case 4:
+                if (col >= 2) {
+                    text = "=SUM(A1:B" + std::to_string(row + 1) + ")+" + std::to_string(col);
+                }
+                break;
+            default:
+                text = "=";
+            }
+            tsv += (col ? "\t" : "") + text;
+            if (!text.empty()) {
+                expected.push_back({{row, col}, text});
+            }
+        }
+        tsv += row % 2 ? "\r\n" : "\n";
+    }
+    Sheet reference;
+    for (auto& [pos, text] : expected) {
+        reference.SetCell(pos, text);
+    }
+    std::ostringstream texts, values;
+    reference.PrintTexts(texts);
+    reference.PrintValues(values);
+
+    for (size_t chunk_size : {1, 7, 100, 1 << 20}) {
+        for (size_t threads : {1, 4}) {
+            ImportOptions options;
+            options.chunk_size = chunk_size;
+            options.threads = threads;
+            Sheet sheet;
+            std::istringstream in(tsv);
+            const ImportStats stats = ImportTable(sheet, in, options);
+            ASSERT_EQUAL(stats.rows, 300u);
+            ASSERT_EQUAL(stats.cells, expected.size());
+            ASSERT_EQUAL(stats.bytes, tsv.size());
+            std::ostringstream sheet_texts, sheet_values;
+            sheet.PrintTexts(sheet_texts);
+            sheet.PrintValues(sheet_values);
+            ASSERT_EQUAL(sheet_texts.str(), texts.str());
+            ASSERT_EQUAL(sheet_values.str(), values.str());
+        }
+    }
+}
+
+void TestImportCsvAndErrors() {
+    {
+        Sheet sheet;
+        std::istringstream in("\"a,b\",\"say \"\"hi\"\"\",\"two\nlines\"\n,,=A3+1\n5,\"=B3\"\n");
+        ImportOptions options = ImportOptions::Csv();
+        options.origin = "B2"_pos;
+        options.chunk_size = 3;
+        ImportTable(sheet, in, options);
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "a,b");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "say \"hi\"");
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "two\nlines");
+        ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value("5"));
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=B3");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{4, 4}));
+    }
+    {
+        // кавычка посреди поля - обычный символ и строки не склеивает
+        Sheet sheet;
+        std::istringstream in("5\" pipe,2\n3,say \"x\"\n\"q\"\"\",4\n");
+        ImportOptions options = ImportOptions::Csv();
+        options.chunk_size = 4;
+        ImportTable(sheet, in, options);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "5\" pipe");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "2");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "3");
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "say \"x\"");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "q\"");
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "4");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 2}));
+    }
+    {
+        Sheet sheet;
+        std::istringstream in("1\t=A1+\n");
+        try {
+            ImportTable(sheet, in);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+        ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+    }
+    {
+        Sheet sheet;
+        std::istringstream in("=B1\t=A1\n");
+        try {
+            ImportTable(sheet, in);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    }
+}
+
+void TestPerfCounters() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    // та же относительная формула: дерево берётся из кеша, без разбора
+    sheet.SetCell("B2"_pos, "=A2+1");
+    sheet.SetCell("C1"_pos, "=B1*2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+    sheet.SetCell("A1"_pos, "2");
+    sheet.Recalculate();
+
+    PerfSnapshot snapshot = sheet.GetPerfSnapshot();
+    const PerfCounters& counters = snapshot.counters;
+    if (!PERF_INSTRUMENTATION){
+        ASSERT_EQUAL(counters.formula_evaluations, 0u);
+        ASSERT_EQUAL(counters.parses, 0u);
+        ASSERT(snapshot.events.empty());
+        return;
+    }
+    ASSERT_EQUAL(counters.parses, 2u);
+    ASSERT(counters.parse_ns > 0);
+    // B1 и C1 при первом чтении, при пересчёте они же и ещё не читанная B2
+    ASSERT_EQUAL(counters.formula_evaluations, 5u);
+    ASSERT_EQUAL(counters.cache_misses, 1u);
+    ASSERT_EQUAL(counters.cache_hits, 1u);
+    ASSERT_EQUAL(counters.cache_invalidations, 2u);
+    ASSERT(counters.cycle_check_visits >= 3);
+    ASSERT(counters.hash_probes >= 3);
+    ASSERT(std::any_of(snapshot.events.begin(), snapshot.events.end(), [](const TraceEvent& event){
+        return event.name == "Recalculate";
+    }));
+
+    std::ostringstream trace;
+    WriteChromeTrace(trace, snapshot);
+    ASSERT(trace.str().find("\"traceEvents\": [") == 1);
+    ASSERT(trace.str().find("{\"name\": \"Recalculate\", \"cat\": \"sheet\", \"ph\": \"X\"") != std::string::npos);
+    ASSERT(trace.str().find("\"formula_evaluations\": 5") != std::string::npos);
+
+    sheet.ResetPerfCounters();
+    snapshot = sheet.GetPerfSnapshot();
+    ASSERT_EQUAL(snapshot.counters.formula_evaluations, 0u);
+    ASSERT(snapshot.events.empty());
+}
+
+void TestSheetVersions() {
+    Sheet sheet;
+    ASSERT(sheet.GetPublishedVersion() == nullptr);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "'=text");
+    sheet.SetCell("Z1000"_pos, "far");
+    auto first = sheet.PublishVersion();
+    ASSERT(sheet.GetPublishedVersion() == first);
+    ASSERT_EQUAL(first->GetNumber(), 1u);
+    ASSERT_EQUAL(first->GetCell("B1"_pos)->value, CellInterface::Value(2.0));
+    ASSERT_EQUAL(first->GetCell("B1"_pos)->text, "=A1*2");
+    ASSERT_EQUAL(first->GetCell("C1"_pos)->value, CellInterface::Value("=text"));
+    ASSERT(first->GetCell("D1"_pos) == nullptr);
+    ASSERT_EQUAL(first->GetPrintableSize(), (Size{1000, 26}));
+
+    sheet.SetCell("A1"_pos, "5");
+    sheet.ClearCell("C1"_pos);
+    sheet.SetCell("A2"_pos, "=B1+1");
+    // версия не меняется вместе с листом
+    ASSERT_EQUAL(first->GetCell("B1"_pos)->value, CellInterface::Value(2.0));
+    ASSERT(first->GetCell("C1"_pos) != nullptr);
+    auto second = sheet.PublishVersion();
+    ASSERT_EQUAL(second->GetNumber(), 2u);
+    ASSERT_EQUAL(second->GetCell("B1"_pos)->value, CellInterface::Value(10.0));
+    ASSERT_EQUAL(second->GetCell("A2"_pos)->value, CellInterface::Value(11.0));
+    ASSERT(second->GetCell("C1"_pos) == nullptr);
+    // нетронутый блок общий с прошлой версией
+    ASSERT(second->GetCell("Z1000"_pos) == first->GetCell("Z1000"_pos));
+    ASSERT(second->GetCell("B1"_pos) != first->GetCell("B1"_pos));
+    try {
+        second->GetCell(Position{-1, 0});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+
+    // случайные правки: каждая версия печатается так же, как лист в момент
+    // публикации, и не меняется после следующих правок
+    std::mt19937 generator(31);
+    std::vector<std::pair<std::shared_ptr<const SheetVersion>, std::string>> versions;
+    auto print = [](const auto& printable, bool values){
+        std::ostringstream out;
+        values ? printable.PrintValues(out) : printable.PrintTexts(out);
+        return out.str();
+    };
+    for (int step = 0; step < 40; ++step){
+        for (int edit = 0; edit < 50; ++edit){
+            const Position pos{static_cast<int>(generator() % 200), static_cast<int>(generator() % 100)};
+            switch (generator() % 4){
+            case 0:
+                sheet.ClearCell(pos);
+                break;
+            case 1:
+                sheet.SetCell(pos, std::to_string(generator() % 100));
+                break;
+            default:
+                if (pos.col > 0){
+                    const Position ref{static_cast<int>(generator() % 200), static_cast<int>(generator() % pos.col)};
+                    sheet.SetCell(pos, "=" + ref.ToString() + "+1");
+                }
+            }
+        }
+        auto version = sheet.PublishVersion();
+        ASSERT_EQUAL(print(*version, true), print(sheet, true));
+        ASSERT_EQUAL(print(*version, false), print(sheet, false));
+        versions.push_back({version, print(*version, true)});
+    }
+    for (const auto& [version, values] : versions){
+        ASSERT_EQUAL(print(*version, true), values);
+    }
+}
+
+void TestSheetVersionsConcurrentReaders() {
+    // читатели проверяют, что в каждой версии B1 = A1 * 2, пока писатель
+    // правит лист и публикует версии
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=0");
+    for (int row = 0; row < 100; ++row){
+        sheet.SetCell({row, 1}, "=A1*2");
+    }
+    sheet.PublishVersion();
+    std::atomic<bool> done{false};
+    std::atomic<int> mismatches{0};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 3; ++i){
+        readers.emplace_back([&] {
+            while (!done){
+                auto version = sheet.GetPublishedVersion();
+                const double a1 = std::get<double>(version->GetCell("A1"_pos)->value);
+                for (int row = 0; row < 100; ++row){
+                    if (std::get<double>(version->GetCell({row, 1})->value) != a1 * 2){
+                        ++mismatches;
+                    }
+                }
+            }
+        });
+    }
+    for (int i = 1; i <= 300; ++i){
+        sheet.SetCell("A1"_pos, "=" + std::to_string(i));
+        sheet.PublishVersion();
+    }
+    done = true;
+    for (auto& reader : readers){
+        reader.join();
+    }
+    ASSERT_EQUAL(mismatches.load(), 0);
+    ASSERT_EQUAL(sheet.GetPublishedVersion()->GetCell("B7"_pos)->value, CellInterface::Value(600.0));
+}
+
+void TestConcurrentEvaluation() {
+    // Нарастающий итог в столбце B, формулы над ним в C и D. Потоки читают
+    // D в разном порядке одновременно; каждая формула считается один раз.
+    const int rows = 2000;
+    auto fill = [](Sheet& sheet) {
+        for (int row = 0; row < rows; ++row){
+            const std::string r = std::to_string(row + 1);
+            sheet.SetCell({row, 0}, std::to_string(row % 7));
+            sheet.SetCell({row, 1}, row == 0 ? "=A1" : "=B" + std::to_string(row) + "+A" + r);
+            sheet.SetCell({row, 2}, "=B" + r + "*2+SUM(A1:A10)");
+            sheet.SetCell({row, 3}, "=C" + r + "-B" + r);
+        }
+    };
+    Sheet reference;
+    fill(reference);
+    Sheet sheet;
+    fill(sheet);
+    sheet.SetConcurrentEvaluation(true);
+
+    auto read_concurrently = [&] {
+        std::atomic<int> mismatches{0};
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i){
+            threads.emplace_back([&, i] {
+                std::vector<int> order(rows);
+                for (int row = 0; row < rows; ++row){
+                    order[row] = row;
+                }
+                std::shuffle(order.begin(), order.end(), std::mt19937(i));
+                for (int row : order){
+                    if (!(sheet.GetCell({row, 3})->GetValue() == reference.GetCell({row, 3})->GetValue())){
+                        ++mismatches;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads){
+            thread.join();
+        }
+        return mismatches.load();
+    };
+    // эталон считается заранее, в одном потоке
+    for (int row = 0; row < rows; ++row){
+        reference.GetCell({row, 3})->GetValue();
+    }
+    ASSERT_EQUAL(read_concurrently(), 0);
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    if (PERF_INSTRUMENTATION){
+        ASSERT_EQUAL(sheet.GetPerfSnapshot().counters.formula_evaluations, 3u * rows);
+    }
+
+    // правка в начале итога и в SUM(A1:A10) сбрасывает все формулы, кроме B1
+    sheet.ResetPerfCounters();
+    sheet.SetCell("A2"_pos, "100");
+    reference.SetCell("A2"_pos, "100");
+    for (int row = 0; row < rows; ++row){
+        reference.GetCell({row, 3})->GetValue();
+    }
+    ASSERT_EQUAL(read_concurrently(), 0);
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    if (PERF_INSTRUMENTATION){
+        ASSERT_EQUAL(sheet.GetPerfSnapshot().counters.formula_evaluations, 3u * rows - 1);
+    }
+    std::ostringstream values;
+    std::ostringstream reference_values;
+    sheet.PrintValues(values);
+    reference.PrintValues(reference_values);
+    ASSERT_EQUAL(values.str(), reference_values.str());
+}
+
+void TestSnapshotRoundTrip() {
+    const std::string path = "sheet_snapshot_test.bin";
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2.5");
+    sheet.SetCell("A3"_pos, "'=text");
+    sheet.SetCell("A4"_pos, "text");
+    for (int row = 0; row < 2; ++row) {
+        sheet.SetCell({row, 1}, "=A" + std::to_string(row + 1) + "*2");
+    }
+    sheet.SetCell("C1"_pos, "=SUM(A1:B4)");
+    sheet.SetCell("C2"_pos, "=1/0");
+    sheet.SetCell("C3"_pos, "=E5+C1");
+    // часть значений вычислена, остальные ждут пересчёта
+    sheet.GetCell("B1"_pos)->GetValue();
+    sheet.GetCell("C2"_pos)->GetValue();
+    sheet.SaveSnapshot(path);
+
+    std::unique_ptr<Sheet> loaded = Sheet::LoadSnapshot(path);
+    std::remove(path.c_str());
+    ASSERT_EQUAL(loaded->GetPrintableSize(), sheet.GetPrintableSize());
+    ASSERT_EQUAL(loaded->GetDirtyCount(), sheet.GetDirtyCount());
+    std::ostringstream texts, loaded_texts;
+    sheet.PrintTexts(texts);
+    loaded->PrintTexts(loaded_texts);
+    ASSERT_EQUAL(loaded_texts.str(), texts.str());
+    std::ostringstream values, loaded_values;
+    sheet.PrintValues(values);
+    loaded->PrintValues(loaded_values);
+    ASSERT_EQUAL(loaded_values.str(), values.str());
+    ASSERT_EQUAL(loaded->GetDirtyCount(), 0u);
+
+    // пустая ячейка, на которую ссылается формула, и обратные связи на месте
+    ASSERT(loaded->GetCell("E5"_pos) != nullptr);
+    ASSERT_EQUAL(static_cast<const Cell*>(loaded->GetCell("A1"_pos))->GetUpDependencesCells(),
+                 std::vector{"B1"_pos});
+    ASSERT_EQUAL(static_cast<const Cell*>(loaded->GetCell("C1"_pos))->GetUpDependencesCells(),
+                 std::vector{"C3"_pos});
+
+    // правки после загрузки доходят до зависимых формул, и через диапазоны тоже
+    loaded->SetCell("A1"_pos, "10");
+    ASSERT_EQUAL(loaded->GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(loaded->GetCell("C3"_pos)->GetValue(), CellInterface::Value(37.5));
+    loaded->SetCell("B5"_pos, "=A5*2");
+    ASSERT_EQUAL(loaded->GetCell("B5"_pos)->GetText(), "=A5*2");
+    try {
+        loaded->SetCell("A2"_pos, "=C3");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(loaded->GetCell("A2"_pos)->GetText(), "2.5");
+
+    // дерево, переписанное вставкой строк, в кеше формул не лежит, но после
+    // загрузки тоже размещается в памяти формул листа
+    Sheet shifted;
+    shifted.SetCell("B2"_pos, "=A1+1");
+    shifted.InsertRows(1);
+    shifted.SaveSnapshot(path);
+    loaded = Sheet::LoadSnapshot(path);
+    std::remove(path.c_str());
+    ASSERT_EQUAL(loaded->GetCell("B3"_pos)->GetText(), "=A1+1");
+    ASSERT(loaded->GetAllocationStats().allocations > 0);
+    ASSERT(loaded->GetAllocationStats().bytes_in_use > 0);
+}
+
+void TestSnapshotSaveKeepsOldFileOnError() {
+    const std::string path = "sheet_snapshot_test.bin";
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1+1");
+    sheet.SaveSnapshot(path);
+
+    // временный файл не создать: запись падает, прежний снимок цел
+    std::filesystem::create_directory(path + ".tmp");
+    sheet.SetCell("A1"_pos, "5");
+    try {
+        sheet.SaveSnapshot(path);
+        ASSERT(false);
+    } catch (const SnapshotException&) {
+    }
+    std::filesystem::remove(path + ".tmp");
+    std::unique_ptr<Sheet> loaded = Sheet::LoadSnapshot(path);
+    ASSERT_EQUAL(loaded->GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    sheet.SaveSnapshot(path);
+    ASSERT(!std::filesystem::exists(path + ".tmp"));
+    loaded = Sheet::LoadSnapshot(path);
+    std::remove(path.c_str());
+    ASSERT_EQUAL(loaded->GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+}
+
+void TestSnapshotRejectsBadFiles() {
+    const std::string path = "sheet_snapshot_test.bin";
+    auto expect_failure = [&path](const std::string& bytes) {
+        {
+            std::ofstream out(path, std::ios::binary);
+            out << bytes;
+        }
+        try {
+            Sheet::LoadSnapshot(path);
+            ASSERT(false);
+        } catch (const SnapshotException&) {
+        }
+    };
+
+    try {
+        Sheet::LoadSnapshot("no_such_snapshot.bin");
+        ASSERT(false);
+    } catch (const SnapshotException&) {
+    }
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=SUM(B1:B3)+C1");
+    sheet.SetCell("B2"_pos, "=C1*2");
+    sheet.SetCell("C1"_pos, "text");
+    sheet.SaveSnapshot(path);
+    std::string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    expect_failure("");
+    expect_failure(bytes.substr(0, bytes.size() - 1));
+    expect_failure(bytes + '\0');
+    std::string other_version = bytes;
+    ++other_version[8];
+    expect_failure(other_version);
+    std::string not_snapshot = bytes;
+    not_snapshot[0] = 'X';
+    expect_failure(not_snapshot);
+
+    // испорченный байт либо отвергается, либо даёт корректный лист
+    std::mt19937 random(42);
+    for (int i = 0; i < 2000; ++i) {
+        std::string corrupted = bytes;
+        corrupted[random() % corrupted.size()] ^= static_cast<char>(1 << (random() % 8));
+        {
+            std::ofstream out(path, std::ios::binary);
+            out << corrupted;
+        }
+        try {
+            Sheet::LoadSnapshot(path);
+        } catch (const SnapshotException&) {
+        }
+    }
+    std::remove(path.c_str());
+}
+
+void TestUndoRedo() {
+    Sheet sheet;
+    ASSERT(!sheet.Undo());
+    sheet.SetCell("A1"_pos, "1");
+    // журнал выключен по умолчанию
+    ASSERT_EQUAL(sheet.GetUndoCount(), 0u);
+    sheet.SetUndoLimit(10);
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("D1"_pos, "=10");
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(10.0));
+    sheet.ResetPerfCounters();
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(10.0));
+    if (PERF_INSTRUMENTATION){
+        // пересчитана только формула, зависящая от A1
+        ASSERT_EQUAL(sheet.GetPerfSnapshot().counters.formula_evaluations, 1u);
+    }
+    ASSERT_EQUAL(sheet.GetRedoCount(), 1u);
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT(!sheet.Redo());
+
+    // ячейки, созданные правкой, после отмены исчезают
+    sheet.SetCell("C1"_pos, "=Z9+1");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{9, 26}));
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("Z9"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 4}));
+    ASSERT(sheet.Redo());
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=Z9+1");
+    ASSERT(sheet.GetCell("Z9"_pos) != nullptr);
+
+    // очистка формулы, на которую ссылаются, и пакет - по одной записи
+    sheet.ClearCell("B1"_pos);
+    sheet.SetCells({{"E1"_pos, "=B1+1"}, {"F1"_pos, "text"}});
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(1.0));
+    const size_t undo_count = sheet.GetUndoCount();
+    // отвергнутая правка в журнал не попадает
+    try {
+        sheet.SetCell("B1"_pos, "=E1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetUndoCount(), undo_count);
+    ASSERT(sheet.Undo());
+    ASSERT(sheet.GetCell("F1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+    ASSERT(sheet.Undo());
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    // новая правка очищает список для Redo
+    sheet.SetCell("G1"_pos, "x");
+    ASSERT_EQUAL(sheet.GetRedoCount(), 0u);
+    ASSERT(sheet.GetJournalMemory() > 0);
+    sheet.SetUndoLimit(2);
+    ASSERT_EQUAL(sheet.GetUndoCount(), 2u);
+    sheet.SetUndoLimit(0);
+    ASSERT(!sheet.Undo());
+    ASSERT_EQUAL(sheet.GetJournalMemory(), 0u);
+
+    // случайные правки: каждая отмена возвращает лист в точности к
+    // состоянию до правки, а Redo - обратно
+    Sheet random_sheet;
+    random_sheet.SetUndoLimit(1000);
+    std::mt19937 generator(47);
+    auto print = [&random_sheet]{
+        std::ostringstream texts;
+        std::ostringstream values;
+        random_sheet.PrintTexts(texts);
+        random_sheet.PrintValues(values);
+        return texts.str() + values.str();
+    };
+    auto random_pos = [&generator]{
+        return Position{static_cast<int>(generator() % 30), static_cast<int>(generator() % 10)};
+    };
+    std::vector<std::string> states{print()};
+    for (int edit = 0; edit < 300; ++edit){
+        const Position pos = random_pos();
+        try {
+            switch (generator() % 4){
+            case 0:
+                random_sheet.ClearCell(pos);
+                break;
+            case 1:
+                random_sheet.SetCell(pos, std::to_string(generator() % 100));
+                break;
+            case 2:
+                random_sheet.SetCells({{pos, "=" + random_pos().ToString() + "+1"},
+                                       {random_pos(), "=SUM(A1:" + random_pos().ToString() + ")"}});
+                break;
+            default:
+                random_sheet.SetCell(pos, "=" + random_pos().ToString() + "*2");
+            }
+        } catch (const CircularDependencyException&) {
+        }
+        if (random_sheet.GetUndoCount() == states.size()){
+            states.push_back(print());
+        }
+    }
+    ASSERT_EQUAL(random_sheet.GetUndoCount() + 1, states.size());
+    for (size_t i = states.size() - 1; i > 0; --i){
+        ASSERT(random_sheet.Undo());
+        ASSERT_EQUAL(print(), states[i - 1]);
+    }
+    for (size_t i = 1; i < states.size(); ++i){
+        ASSERT(random_sheet.Redo());
+        ASSERT_EQUAL(print(), states[i]);
+    }
+}
+
+void TestInsertDeleteRowsAndCols() {
+    auto value = [](const Sheet& sheet, std::string_view pos){
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    auto text = [](const Sheet& sheet, std::string_view pos){
+        return sheet.GetCell(Position::FromString(pos))->GetText();
+    };
+    const CellInterface::Value ref_error = FormulaError(FormulaError::Category::Ref);
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("A3"_pos, "3");
+        sheet.SetCell("B1"_pos, "=A1+A3");
+        sheet.SetCell("B10"_pos, "=SUM(A1:A3)");
+        sheet.SetCell("C10"_pos, "=A2*2");
+        sheet.SetCell("D10"_pos, "=B1+1");
+        ASSERT_EQUAL(value(sheet, "D10"), CellInterface::Value(5.0));
+
+        sheet.InsertRows(1, 2);
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(text(sheet, "A4"), "2");
+        ASSERT_EQUAL(text(sheet, "B1"), "=A1+A5");
+        ASSERT_EQUAL(text(sheet, "B12"), "=SUM(A1:A5)");
+        ASSERT_EQUAL(text(sheet, "C12"), "=A4*2");
+        ASSERT_EQUAL(text(sheet, "D12"), "=B1+1");
+        ASSERT_EQUAL(value(sheet, "B12"), CellInterface::Value(6.0));
+        ASSERT_EQUAL(value(sheet, "C12"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{12, 4}));
+        // диапазон расширился на вставленные строки
+        sheet.SetCell("A2"_pos, "10");
+        ASSERT_EQUAL(value(sheet, "B12"), CellInterface::Value(16.0));
+
+        sheet.DeleteRows(4);
+        ASSERT_EQUAL(text(sheet, "B1"), "=A1+#REF!");
+        ASSERT_EQUAL(value(sheet, "B1"), ref_error);
+        ASSERT_EQUAL(value(sheet, "D11"), ref_error);
+        ASSERT_EQUAL(text(sheet, "B11"), "=SUM(A1:A4)");
+        ASSERT_EQUAL(value(sheet, "B11"), CellInterface::Value(13.0));
+        ASSERT_EQUAL(value(sheet, "C11"), CellInterface::Value(4.0));
+        // связи перенесены: правка доходит до формул
+        sheet.SetCell("A4"_pos, "5");
+        ASSERT_EQUAL(value(sheet, "C11"), CellInterface::Value(10.0));
+        ASSERT_EQUAL(value(sheet, "B11"), CellInterface::Value(16.0));
+
+        sheet.DeleteRows(0, 5);
+        ASSERT_EQUAL(text(sheet, "B6"), "=SUM(#REF!)");
+        ASSERT_EQUAL(value(sheet, "B6"), ref_error);
+        ASSERT_EQUAL(text(sheet, "C6"), "=#REF!*2");
+        ASSERT_EQUAL(text(sheet, "D6"), "=#REF!+1");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{6, 4}));
+        // формулы с #REF! переживают снимок
+        const std::string path = "/tmp/spreadsheet_rows_test.snapshot";
+        sheet.SaveSnapshot(path);
+        auto loaded = Sheet::LoadSnapshot(path);
+        std::remove(path.c_str());
+        ASSERT_EQUAL(text(*loaded, "B6"), "=SUM(#REF!)");
+        ASSERT_EQUAL(value(*loaded, "D6"), ref_error);
+    }
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "2");
+        sheet.SetCell("C1"_pos, "=A1+B1");
+        sheet.SetCell("D1"_pos, "=SUM(A1:B1)");
+        sheet.InsertCols(1);
+        ASSERT_EQUAL(text(sheet, "D1"), "=A1+C1");
+        ASSERT_EQUAL(text(sheet, "E1"), "=SUM(A1:C1)");
+        sheet.DeleteCols(0);
+        ASSERT_EQUAL(text(sheet, "C1"), "=#REF!+B1");
+        ASSERT_EQUAL(text(sheet, "D1"), "=SUM(A1:B1)");
+        ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(2.0));
+
+        try {
+            sheet.InsertRows(-1);
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        try {
+            sheet.DeleteCols(Position::MAX_COLS - 1, 2);
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        sheet.SetCell({Position::MAX_ROWS - 1, 0}, "last");
+        try {
+            sheet.InsertRows(0);
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        ASSERT_EQUAL(text(sheet, "C1"), "=#REF!+B1");
+    }
+    {
+        // журнал отмены сдвигается вместе с листом, правки удалённых ячеек
+        // из него выпадают
+        Sheet sheet;
+        sheet.SetUndoLimit(10);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("B3"_pos, "=A1+A2");
+        sheet.SetCell("B3"_pos, "=A2");
+        sheet.InsertRows(1);
+        ASSERT_EQUAL(sheet.GetUndoCount(), 4u);
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(text(sheet, "B4"), "=A1+A3");
+        ASSERT_EQUAL(value(sheet, "B4"), CellInterface::Value(3.0));
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.GetCell("B4"_pos) == nullptr);
+        sheet.DeleteRows(0);
+        ASSERT_EQUAL(sheet.GetUndoCount(), 1u);
+        ASSERT_EQUAL(sheet.GetRedoCount(), 2u);
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT(!sheet.Undo());
+        ASSERT(sheet.Redo());
+        ASSERT_EQUAL(text(sheet, "A2"), "2");
+        ASSERT(sheet.Redo());
+        ASSERT_EQUAL(text(sheet, "B3"), "=#REF!+A2");
+        ASSERT(sheet.Redo());
+        ASSERT_EQUAL(text(sheet, "B3"), "=A2");
+        ASSERT_EQUAL(value(sheet, "B3"), CellInterface::Value(2.0));
+        ASSERT(!sheet.Redo());
+    }
+    {
+        // вставка за последней занятой строкой внутрь диапазона: лишние
+        // строки не уходят за край молча
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=SUM(A1:A20)");
+        try {
+            sheet.InsertRows(10, std::numeric_limits<int>::max());
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        try {
+            sheet.InsertCols(0, Position::MAX_COLS + 1);
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+        ASSERT_EQUAL(text(sheet, "B1"), "=SUM(A1:A20)");
+        sheet.InsertRows(10, Position::MAX_ROWS - 10);
+        ASSERT_EQUAL(text(sheet, "B1"), "=SUM(A1:A" + std::to_string(Position::MAX_ROWS) + ")");
+    }
+    {
+        // скопированные формулы делят дерево; пересчитываются только те,
+        // чьи ссылки пересекли вставленную строку, и зависящие от них
+        Sheet sheet;
+        std::vector<std::pair<Position, std::string>> cells;
+        for (int row = 0; row < 100; ++row){
+            const std::string r = std::to_string(row + 1);
+            cells.push_back({{row, 0}, r});
+            cells.push_back({{row, 1}, "=A" + r + "*2"});
+            if (row > 0){
+                cells.push_back({{row, 2}, "=C" + std::to_string(row) + "+1"});
+            }
+        }
+        sheet.SetCells(std::move(cells));
+        sheet.SetUndoLimit(10);
+        sheet.SetCell("E1"_pos, "x");
+        sheet.Recalculate();
+        sheet.ResetPerfCounters();
+        sheet.InsertRows(50);
+        ASSERT_EQUAL(sheet.GetUndoCount(), 1u);
+        sheet.Recalculate();
+        if (PERF_INSTRUMENTATION){
+            ASSERT_EQUAL(sheet.GetPerfSnapshot().counters.formula_evaluations, 50u);
+        }
+        ASSERT(sheet.GetCell("B51"_pos) == nullptr);
+        ASSERT_EQUAL(text(sheet, "B52"), "=A52*2");
+        ASSERT_EQUAL(value(sheet, "B52"), CellInterface::Value(102.0));
+        ASSERT_EQUAL(text(sheet, "C52"), "=C50+1");
+        ASSERT_EQUAL(value(sheet, "C101"), CellInterface::Value(99.0));
+        // новые формулы той же записи и старые считаются одинаково
+        sheet.SetCell("B51"_pos, "=A51*2");
+        sheet.SetCell("C51"_pos, "=C50+1");
+        sheet.SetCell("C52"_pos, "=C51+1");
+        ASSERT_EQUAL(value(sheet, "C101"), CellInterface::Value(100.0));
+    }
+
+    // Случайные листы: вставка и удаление тех же строк возвращают лист к
+    // исходному, а значения после сдвигов совпадают со значениями листа,
+    // заново собранного из текстов ячеек
+    std::mt19937 generator(53);
+    auto random_pos = [&generator](int rows, int cols){
+        return Position{static_cast<int>(generator() % rows), static_cast<int>(generator() % cols)};
+    };
+    // пустые ячейки не печатаются: без ссылок на них они могут остаться
+    // в листе после прошлых правок
+    auto print = [](const Sheet& sheet){
+        std::ostringstream output;
+        const Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row){
+            for (int col = 0; col < size.cols; ++col){
+                const CellInterface* cell = sheet.GetCell({row, col});
+                if (cell && !cell->GetText().empty()){
+                    output << Position{row, col}.ToString() << ' ' << cell->GetText() << ' '
+                           << cell->GetValue() << '\n';
+                }
+            }
+        }
+        return output.str();
+    };
+    auto rebuild = [](const Sheet& sheet){
+        auto copy = std::make_unique<Sheet>();
+        const Size size = sheet.GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row){
+            for (int col = 0; col < size.cols; ++col){
+                const CellInterface* cell = sheet.GetCell({row, col});
+                if (cell && !cell->GetText().empty()){
+                    copy->SetCell({row, col}, cell->GetText());
+                }
+            }
+        }
+        return copy;
+    };
+    for (int round = 0; round < 20; ++round){
+        Sheet sheet;
+        for (int edit = 0; edit < 80; ++edit){
+            const Position pos = random_pos(20, 8);
+            try {
+                switch (generator() % 3){
+                case 0:
+                    sheet.SetCell(pos, std::to_string(generator() % 100));
+                    break;
+                case 1:
+                    sheet.SetCell(pos, "=" + random_pos(20, 8).ToString() + "+1");
+                    break;
+                default:
+                    sheet.SetCell(pos, "=SUM(" + random_pos(20, 8).ToString() + ":" +
+                                       random_pos(20, 8).ToString() + ")");
+                }
+            } catch (const CircularDependencyException&) {
+            }
+        }
+        const std::string before = print(sheet);
+        const bool rows = round % 2 == 0;
+        const int first = static_cast<int>(generator() % 10);
+        const int count = 1 + static_cast<int>(generator() % 4);
+        rows ? sheet.InsertRows(first, count) : sheet.InsertCols(first, count);
+        ASSERT_EQUAL(print(sheet), print(*rebuild(sheet)));
+        rows ? sheet.DeleteRows(first, count) : sheet.DeleteCols(first, count);
+        ASSERT_EQUAL(print(sheet), before);
+
+        rows ? sheet.DeleteRows(first, count) : sheet.DeleteCols(first, count);
+        // формулы с #REF! заново не разбираются; остальные должны совпасть
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        if (texts.str().find("#REF!") == std::string::npos){
+            ASSERT_EQUAL(print(sheet), print(*rebuild(sheet)));
+        }
+        for (int edit = 0; edit < 10; ++edit){
+            sheet.SetCell(random_pos(20, 8), std::to_string(generator() % 100));
+        }
+        for (int row = 0; row < 20; ++row){
+            for (int col = 0; col < 8; ++col){
+                const CellInterface* cell = sheet.GetCell({row, col});
+                if (cell && cell->GetText().find("#REF!") == std::string::npos){
+                    // сверка с формулой, разобранной заново на том же листе
+                    auto formula = cell->GetText().size() > 1 && cell->GetText()[0] == '=' ?
+                                   ParseFormula(cell->GetText().substr(1)) : nullptr;
+                    if (formula){
+                        const auto expected = formula->Evaluate(sheet);
+                        const auto actual = cell->GetValue();
+                        ASSERT(std::holds_alternative<FormulaError>(expected) ?
+                               actual == CellInterface::Value(std::get<FormulaError>(expected)) :
+                               actual == CellInterface::Value(std::get<double>(expected)));
+                    }
+                }
+            }
+        }
+    }
+}
+
 int main() {
     using namespace std::literals;
 
@@ -363,6 +1943,7 @@ int main() {
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
     RUN_TEST(tr, TestClearCell);
+    RUN_TEST(tr, TestPrintableSizeAfterClear);
     RUN_TEST(tr, TestFormulaArithmetic);
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
@@ -373,9 +1954,37 @@ int main() {
 
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
+    RUN_TEST(tr, TestPrintMatchesStreamOutput);
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestHandParserMatchesAntlr);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestClearReferencedCell);
+    RUN_TEST(tr, TestCircularCheckOnLargeGraph);
+    RUN_TEST(tr, TestBytecodeMatchesTreeEvaluation);
+    RUN_TEST(tr, TestSharedFormulaTrees);
+    RUN_TEST(tr, TestLongDependencyChain);
+    RUN_TEST(tr, TestRecalculateOnlyDirty);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestSetCellsBatch);
+    RUN_TEST(tr, TestCachedErrorsAndText);
+    RUN_TEST(tr, TestTextNumberInterpretation);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestRangeIndexMatchesScan);
+    RUN_TEST(tr, TestDependentsGrowAndShrink);
+    RUN_TEST(tr, TestFormulaMemoryStats);
+    RUN_TEST(tr, TestFormulaTreeSerialization);
+    RUN_TEST(tr, TestSnapshotRoundTrip);
+    RUN_TEST(tr, TestSnapshotSaveKeepsOldFileOnError);
+    RUN_TEST(tr, TestSnapshotRejectsBadFiles);
+    RUN_TEST(tr, TestImportTable);
+    RUN_TEST(tr, TestImportCsvAndErrors);
+    RUN_TEST(tr, TestPerfCounters);
+    RUN_TEST(tr, TestSheetVersions);
+    RUN_TEST(tr, TestSheetVersionsConcurrentReaders);
+    RUN_TEST(tr, TestConcurrentEvaluation);
+    RUN_TEST(tr, TestUndoRedo);
+    RUN_TEST(tr, TestInsertDeleteRowsAndCols);
 
     return 0;
 }
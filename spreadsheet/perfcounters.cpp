@@ -0,0 +1,100 @@
+#include "perfcounters.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+
+namespace {
+
+void WriteJsonString(std::ostream& output, const std::string& text){
+    output << '"';
+    for (char ch : text){
+        if (ch == '"' || ch == '\\'){
+            output << '\\' << ch;
+        }
+        else if (static_cast<unsigned char>(ch) < 0x20){
+            output << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                   << static_cast<int>(ch) << std::dec << std::setfill(' ');
+        }
+        else{
+            output << ch;
+        }
+    }
+    output << '"';
+}
+
+}  // namespace
+
+void WriteChromeTrace(std::ostream& output, const PerfSnapshot& snapshot){
+    // полные события ("ph": "X") с длительностью, время в микросекундах
+    output << "{\"traceEvents\": [";
+    bool first = true;
+    for (const auto& event : snapshot.events){
+        output << (first ? "\n" : ",\n") << "  {\"name\": ";
+        WriteJsonString(output, event.name);
+        output << ", \"cat\": \"sheet\", \"ph\": \"X\", \"ts\": " << event.start_us
+               << ", \"dur\": " << event.duration_us << ", \"pid\": 1, \"tid\": " << event.thread << "}";
+        first = false;
+    }
+    const PerfCounters& counters = snapshot.counters;
+    output << "\n], \"displayTimeUnit\": \"ms\", \"metadata\": {"
+           << "\"formula_evaluations\": " << counters.formula_evaluations
+           << ", \"cache_hits\": " << counters.cache_hits
+           << ", \"cache_misses\": " << counters.cache_misses
+           << ", \"cache_invalidations\": " << counters.cache_invalidations
+           << ", \"cycle_check_visits\": " << counters.cycle_check_visits
+           << ", \"parses\": " << counters.parses
+           << ", \"parse_ns\": " << counters.parse_ns
+           << ", \"hash_probes\": " << counters.hash_probes
+           << "}}\n";
+}
+
+#ifdef SPREADSHEET_INSTRUMENTATION
+
+PerfSnapshot PerfRecorder::GetSnapshot() const{
+    PerfSnapshot snapshot;
+    PerfCounters& counters = snapshot.counters;
+    counters.formula_evaluations = formula_evaluations.load(std::memory_order_relaxed);
+    counters.cache_hits = cache_hits.load(std::memory_order_relaxed);
+    counters.cache_misses = cache_misses.load(std::memory_order_relaxed);
+    counters.cache_invalidations = cache_invalidations.load(std::memory_order_relaxed);
+    counters.cycle_check_visits = cycle_check_visits.load(std::memory_order_relaxed);
+    counters.parses = parses.load(std::memory_order_relaxed);
+    counters.parse_ns = parse_ns.load(std::memory_order_relaxed);
+    counters.hash_probes = hash_probes.load(std::memory_order_relaxed);
+    std::lock_guard lock(mutex_);
+    snapshot.events = events_;
+    return snapshot;
+}
+
+void PerfRecorder::Reset(){
+    for (auto* counter : {&formula_evaluations, &cache_hits, &cache_misses, &cache_invalidations,
+                          &cycle_check_visits, &parses, &parse_ns, &hash_probes}){
+        counter->store(0, std::memory_order_relaxed);
+    }
+    std::lock_guard lock(mutex_);
+    epoch_ = Clock::now();
+    events_.clear();
+}
+
+void PerfRecorder::AddEvent(const char* name, Clock::time_point start, Clock::time_point end){
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    std::lock_guard lock(mutex_);
+    if (events_.size() >= MAX_EVENTS || start < epoch_){
+        return;
+    }
+    const auto id = std::this_thread::get_id();
+    auto thread = std::find(threads_.begin(), threads_.end(), id);
+    if (thread == threads_.end()){
+        thread = threads_.insert(threads_.end(), id);
+    }
+    TraceEvent event;
+    event.name = name;
+    event.start_us = duration_cast<microseconds>(start - epoch_).count();
+    event.duration_us = duration_cast<microseconds>(end - start).count();
+    event.thread = static_cast<std::uint32_t>(thread - threads_.begin());
+    events_.push_back(std::move(event));
+}
+
+#endif
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#ifdef SPREADSHEET_INSTRUMENTATION
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#endif
+
+// Инструментация горячих путей листа. Включается при сборке определением
+// SPREADSHEET_INSTRUMENTATION (опция CMake с тем же именем); без него
+// макросы PERF_* раскрываются в пустоту, а лист не хранит ни счётчиков,
+// ни событий, и Sheet::GetPerfSnapshot() возвращает нули.
+#ifdef SPREADSHEET_INSTRUMENTATION
+constexpr bool PERF_INSTRUMENTATION = true;
+#else
+constexpr bool PERF_INSTRUMENTATION = false;
+#endif
+
+// Значения счётчиков листа на момент снимка.
+struct PerfCounters {
+    // вычисления формул
+    std::uint64_t formula_evaluations = 0;
+    // чтения значения формулы через Cell::GetValue: из кеша и с вычислением
+    std::uint64_t cache_hits = 0;
+    std::uint64_t cache_misses = 0;
+    // кеши формул, сброшенные правками
+    std::uint64_t cache_invalidations = 0;
+    // ячейки, пройденные проверками на циклы
+    std::uint64_t cycle_check_visits = 0;
+    // разборы текста формул и их суммарное время в наносекундах
+    std::uint64_t parses = 0;
+    std::uint64_t parse_ns = 0;
+    // обращения к хеш-таблицам: кешу деревьев формул и таблицам обхода
+    // графа при пересчёте
+    std::uint64_t hash_probes = 0;
+};
+
+// Интервал, замеренный PerfScope. Время в микросекундах от создания листа
+// или последнего Sheet::ResetPerfCounters().
+struct TraceEvent {
+    std::string name;
+    std::uint64_t start_us = 0;
+    std::uint64_t duration_us = 0;
+    // порядковый номер потока в порядке первого события
+    std::uint32_t thread = 0;
+};
+
+struct PerfSnapshot {
+    PerfCounters counters;
+    std::vector<TraceEvent> events;
+};
+
+// Пишет события в формате Chrome trace event (JSON, открывается в
+// chrome://tracing и Perfetto). Счётчики снимка попадают в metadata.
+void WriteChromeTrace(std::ostream& output, const PerfSnapshot& snapshot);
+
+#ifdef SPREADSHEET_INSTRUMENTATION
+
+// Счётчики и события одного листа. Счётчики атомарные, потому что формулы
+// вычисляются и в потоках параллельного пересчёта.
+class PerfRecorder {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // больше событий не хранится, остальные отбрасываются
+    static const size_t MAX_EVENTS = 1 << 20;
+
+    std::atomic<std::uint64_t> formula_evaluations{0};
+    std::atomic<std::uint64_t> cache_hits{0};
+    std::atomic<std::uint64_t> cache_misses{0};
+    std::atomic<std::uint64_t> cache_invalidations{0};
+    std::atomic<std::uint64_t> cycle_check_visits{0};
+    std::atomic<std::uint64_t> parses{0};
+    std::atomic<std::uint64_t> parse_ns{0};
+    std::atomic<std::uint64_t> hash_probes{0};
+
+    PerfSnapshot GetSnapshot() const;
+    void Reset();
+    void AddEvent(const char* name, Clock::time_point start, Clock::time_point end);
+
+private:
+    mutable std::mutex mutex_;
+    Clock::time_point epoch_ = Clock::now();
+    std::vector<TraceEvent> events_;
+    std::vector<std::thread::id> threads_;
+};
+
+// Замеряет время жизни объекта и записывает его событием name.
+class PerfScope {
+public:
+    PerfScope(PerfRecorder& recorder, const char* name) :
+        recorder_(recorder),
+        name_(name){
+    }
+    ~PerfScope() {
+        recorder_.AddEvent(name_, start_, PerfRecorder::Clock::now());
+    }
+
+    PerfScope(const PerfScope&) = delete;
+    PerfScope& operator=(const PerfScope&) = delete;
+
+private:
+    PerfRecorder& recorder_;
+    const char* name_;
+    PerfRecorder::Clock::time_point start_ = PerfRecorder::Clock::now();
+};
+
+// Прибавляет время жизни объекта в наносекундах к счётчику.
+class PerfDuration {
+public:
+    explicit PerfDuration(std::atomic<std::uint64_t>& counter) :
+        counter_(counter){
+    }
+    ~PerfDuration() {
+        const auto elapsed = PerfRecorder::Clock::now() - start_;
+        counter_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                           std::memory_order_relaxed);
+    }
+
+    PerfDuration(const PerfDuration&) = delete;
+    PerfDuration& operator=(const PerfDuration&) = delete;
+
+private:
+    std::atomic<std::uint64_t>& counter_;
+    PerfRecorder::Clock::time_point start_ = PerfRecorder::Clock::now();
+};
+
+#define PERF_CONCAT_IMPL(lhs, rhs) lhs##rhs
+#define PERF_CONCAT(lhs, rhs) PERF_CONCAT_IMPL(lhs, rhs)
+// прибавляет n к счётчику recorder
+#define PERF_COUNT(recorder, counter, n) \
+    ((recorder).counter.fetch_add((n), std::memory_order_relaxed))
+// событие трассировки до конца области видимости
+#define PERF_SCOPE(recorder, name) \
+    PerfScope PERF_CONCAT(perf_scope_, __LINE__)((recorder), (name))
+// время до конца области видимости прибавляется к счётчику
+#define PERF_DURATION(recorder, counter) \
+    PerfDuration PERF_CONCAT(perf_duration_, __LINE__)((recorder).counter)
+
+#else
+
+#define PERF_COUNT(recorder, counter, n) ((void)0)
+#define PERF_SCOPE(recorder, name) ((void)0)
+#define PERF_DURATION(recorder, counter) ((void)0)
+
+#endif
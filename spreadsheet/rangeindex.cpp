@@ -0,0 +1,100 @@
+#include "rangeindex.h"
+
+#include <algorithm>
+#include <cassert>
+
+void RangeIndex::Insert(const CellRange& range, Position formula) {
+    int node;
+    if (!free_nodes_.empty()){
+        node = free_nodes_.back();
+        free_nodes_.pop_back();
+        nodes_[node] = Node{};
+    }
+    else{
+        node = static_cast<int>(nodes_.size());
+        nodes_.emplace_back();
+    }
+    nodes_[node].range = range;
+    nodes_[node].formula = formula;
+    nodes_[node].priority = static_cast<std::uint32_t>(random_());
+    Update(node);
+
+    int less;
+    int greater;
+    Split(root_, KeyOf(node), less, greater);
+    root_ = Merge(Merge(less, node), greater);
+    ++size_;
+}
+
+void RangeIndex::Erase(const CellRange& range, Position formula) {
+    root_ = Erase(root_, KeyOf(range, formula));
+}
+
+int RangeIndex::Erase(int node, const Key& key) {
+    if (node == NONE){
+        assert(false);
+        return NONE;
+    }
+    const Key node_key = KeyOf(node);
+    if (key == node_key){
+        const int merged = Merge(nodes_[node].left, nodes_[node].right);
+        free_nodes_.push_back(node);
+        --size_;
+        return merged;
+    }
+    if (key < node_key){
+        nodes_[node].left = Erase(nodes_[node].left, key);
+    }
+    else{
+        nodes_[node].right = Erase(nodes_[node].right, key);
+    }
+    Update(node);
+    return node;
+}
+
+void RangeIndex::Update(int node) {
+    Node& current = nodes_[node];
+    current.max_row = current.range.last.row;
+    current.min_col = current.range.first.col;
+    current.max_col = current.range.last.col;
+    for (int child : {current.left, current.right}){
+        if (child != NONE){
+            current.max_row = std::max(current.max_row, nodes_[child].max_row);
+            current.min_col = std::min(current.min_col, nodes_[child].min_col);
+            current.max_col = std::max(current.max_col, nodes_[child].max_col);
+        }
+    }
+}
+
+void RangeIndex::Split(int node, const Key& key, int& less, int& greater) {
+    if (node == NONE){
+        less = greater = NONE;
+        return;
+    }
+    if (KeyOf(node) < key){
+        Split(nodes_[node].right, key, nodes_[node].right, greater);
+        less = node;
+    }
+    else{
+        Split(nodes_[node].left, key, less, nodes_[node].left);
+        greater = node;
+    }
+    Update(node);
+}
+
+int RangeIndex::Merge(int less, int greater) {
+    if (less == NONE){
+        return greater;
+    }
+    if (greater == NONE){
+        return less;
+    }
+    if (nodes_[less].priority > nodes_[greater].priority){
+        nodes_[less].right = Merge(nodes_[less].right, greater);
+        Update(less);
+        return less;
+    }
+    nodes_[greater].left = Merge(less, nodes_[greater].left);
+    Update(greater);
+    return greater;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "FormulaAST.h"
+#include "common.h"
+
+#include <cstdint>
+#include <random>
+#include <tuple>
+#include <vector>
+
+// Индекс диапазонов из формул листа: по ячейке находит все формулы, чьи
+// диапазоны её покрывают. Это дерево интервалов по строкам - декартово
+// дерево, упорядоченное по верхнему левому углу диапазона. В каждой вершине
+// хранится охватывающий прямоугольник её поддерева, так что поиск спускается
+// только туда, где диапазоны могут содержать ячейку: O(log n + k) в
+// среднем вместо просмотра всех диапазонов.
+class RangeIndex {
+public:
+    RangeIndex() = default;
+    RangeIndex(RangeIndex&&) = default;
+    RangeIndex& operator=(RangeIndex&&) = default;
+
+    // Пара (range, formula) добавляется не больше одного раза.
+    void Insert(const CellRange& range, Position formula);
+    void Erase(const CellRange& range, Position formula);
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Вызывает func(formula) для каждого диапазона, содержащего pos.
+    template <typename Func>
+    void ForEachCovering(Position pos, Func func) const {
+        ForEachCovering(root_, pos, func);
+    }
+
+private:
+    static const int NONE = -1;
+
+    struct Node {
+        CellRange range;
+        Position formula;
+        std::uint32_t priority = 0;
+        int left = NONE;
+        int right = NONE;
+        // границы диапазонов поддерева; сверху их ограничивает сам порядок
+        // ключей, поэтому наименьшая первая строка не хранится
+        int max_row = 0;
+        int min_col = 0;
+        int max_col = 0;
+    };
+
+    using Key = std::tuple<int, int, int, int, int, int>;
+
+    static Key KeyOf(const CellRange& range, Position formula) {
+        return {range.first.row, range.first.col, range.last.row, range.last.col,
+                formula.row, formula.col};
+    }
+    Key KeyOf(int node) const {
+        return KeyOf(nodes_[node].range, nodes_[node].formula);
+    }
+
+    void Update(int node);
+    // делит поддерево на ключи < key и >= key
+    void Split(int node, const Key& key, int& less, int& greater);
+    // все ключи less меньше ключей greater
+    int Merge(int less, int greater);
+    int Erase(int node, const Key& key);
+
+    template <typename Func>
+    void ForEachCovering(int node, Position pos, Func& func) const {
+        // глубина дерева логарифмическая, рекурсия здесь безопасна
+        while (node != NONE){
+            const Node& current = nodes_[node];
+            if (current.max_row < pos.row || current.min_col > pos.col || current.max_col < pos.col){
+                return;
+            }
+            ForEachCovering(current.left, pos, func);
+            // правее лежат диапазоны, начинающиеся не выше current
+            if (current.range.first.row > pos.row){
+                return;
+            }
+            if (current.range.Contains(pos)){
+                func(current.formula);
+            }
+            node = current.right;
+        }
+    }
+
+    // вершины лежат в одном массиве, освободившиеся места используются снова
+    std::vector<Node> nodes_;
+    std::vector<int> free_nodes_;
+    int root_ = NONE;
+    size_t size_ = 0;
+    std::minstd_rand random_;
+};
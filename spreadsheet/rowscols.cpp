@@ -0,0 +1,103 @@
+#include "sheet.h"
+
+#include <variant>
+
+void Sheet::InsertRows(int before, int count){
+    ShiftLines(ReferenceShift::Axis::ROWS, before, count, true);
+}
+
+void Sheet::InsertCols(int before, int count){
+    ShiftLines(ReferenceShift::Axis::COLS, before, count, true);
+}
+
+void Sheet::DeleteRows(int first, int count){
+    ShiftLines(ReferenceShift::Axis::ROWS, first, count, false);
+}
+
+void Sheet::DeleteCols(int first, int count){
+    ShiftLines(ReferenceShift::Axis::COLS, first, count, false);
+}
+
+void Sheet::ShiftLines(ReferenceShift::Axis axis, int first, int count, bool insert){
+    const bool rows = axis == ReferenceShift::Axis::ROWS;
+    const int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    // вставлять можно и после последней линии, удалять - только существующие;
+    // вставка длиннее остатка листа тоже ошибка, даже если за first пусто
+    if (first < 0 || count < 0 || first > limit || count > limit - first){
+        throw InvalidPositionException(rows ? "Invalid rows" : "Invalid columns");
+    }
+    if (count == 0){
+        return;
+    }
+    const Size bounds = table_.GetBounds();
+    const int end = rows ? bounds.rows : bounds.cols;
+    if (insert && end > first && count > limit - end){
+        throw InvalidPositionException("Cells would be pushed off the sheet");
+    }
+    ReferenceShift shift(axis, first, count, insert, &formula_memory_);
+    MoveCells(shift);
+}
+
+void Sheet::MoveCells(ReferenceShift& shift){
+    PERF_SCOPE(perf_, "MoveCells");
+    // ячейки переезжают в новую таблицу, удалённые уничтожаются вместе со
+    // старой. Перед переносом формул деревья держат только живые ячейки
+    CellTable moved;
+    table_.ForEach([&moved, &shift](Position pos, Cell& cell){
+        if (auto new_pos = shift.MovePosition(pos)){
+            moved.Insert(*new_pos) = std::move(cell);
+        }
+    });
+    table_ = std::move(moved);
+
+    // связи переносятся тем же сдвигом, связи удалённых формул пропадают;
+    // диапазоны и список грязных ячеек собираются заново
+    range_index_ = RangeIndex();
+    edge_count_ = 0;
+    dirty_cells_.clear();
+    size_t dirty_count = 0;
+    std::vector<Position> changed;
+    std::vector<Position> unused;
+    table_.ForEach([&](Position pos, Cell& cell){
+        if (!cell.cell_depend_up_.Empty()){
+            PositionSet dependents;
+            cell.cell_depend_up_.ForEach([&](Position dependent){
+                if (auto new_dependent = shift.MovePosition(dependent)){
+                    edge_count_ += dependents.Insert(*new_dependent);
+                }
+            });
+            if (dependents.Empty() && std::holds_alternative<std::monostate>(cell.content_)){
+                // пустая ячейка держалась только ссылками удалённых формул
+                unused.push_back(pos);
+            }
+            cell.cell_depend_up_ = std::move(dependents);
+        }
+        if (Formula* formula = std::get_if<Formula>(&cell.content_)){
+            if (shift.MoveFormula(*formula, pos)){
+                changed.push_back(pos);
+            }
+            for (const auto& range : formula->GetReferencedRanges()){
+                range_index_.Insert(range, pos);
+            }
+        }
+        if (cell.is_dirty_){
+            ++dirty_count;
+            dirty_cells_.push_back(pos);
+        }
+    });
+    dirty_count_ = dirty_count;
+    for (const auto& pos : unused){
+        table_.Erase(pos);
+    }
+    ShiftJournal(shift);
+    formula_cache_.Forget(shift.GetRewritten());
+
+    // сдвинулся весь лист: следующая версия собирается целиком
+    versioning_ = false;
+    version_edits_.clear();
+    version_values_.clear();
+    // Порядок вычисления остаётся верным: связи и покрытия диапазонов
+    // сохранились или пропали, новых нет
+    ResetCache(std::move(changed));
+    UpdateTopologicalOrder();
+}
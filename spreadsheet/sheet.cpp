@@ -2,222 +2,866 @@
 
 #include "cell.h"
 #include "common.h"
+#include "tableprinter.h"
 
 #include <algorithm>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <optional>
+#include <unordered_map>
 
 using namespace std::literals;
 
-inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value)
-{
-    std::visit(
-        [&](const auto& x) {
-            output << x;
-        },
-        value);
-    return output;
+Sheet::Sheet() :
+    Sheet(std::pmr::get_default_resource()){
 }
 
-void Sheet::IsValidPos(const Position& pos, const std::string& str) const{
+Sheet::Sheet(std::pmr::memory_resource* upstream) :
+    formula_pool_(upstream){
+#ifdef SPREADSHEET_INSTRUMENTATION
+    formula_cache_.SetRecorder(&perf_);
+#endif
+}
+
+// Пока жива, правка сохраняет прежнее содержимое ячеек в свою запись. В
+// журнал запись попадает по Commit(), то есть только если правка удалась.
+// Вложенные правки (Undo, Redo) пишут в запись, заданную снаружи.
+class Sheet::JournalRecord {
+public:
+    explicit JournalRecord(Sheet& sheet) :
+        sheet_(sheet),
+        active_(sheet.undo_limit_ > 0 && !sheet.journal_){
+        if (active_){
+            sheet_.journal_ = &entry_;
+        }
+    }
+    ~JournalRecord() {
+        if (active_){
+            sheet_.journal_ = nullptr;
+        }
+    }
+
+    JournalRecord(const JournalRecord&) = delete;
+    JournalRecord& operator=(const JournalRecord&) = delete;
+
+    void Commit(){
+        if (!active_){
+            return;
+        }
+        sheet_.journal_ = nullptr;
+        active_ = false;
+        if (!entry_.empty()){
+            sheet_.PushUndo(std::move(entry_));
+        }
+    }
+
+private:
+    Sheet& sheet_;
+    JournalEntry entry_;
+    bool active_;
+};
+
+void Sheet::IsValidPos(const Position& pos, const char* str) const{
     if(!pos.IsValid()){
         throw InvalidPositionException(str);
     }
 }
 
 void Sheet::SetCell(Position pos, std::string text) {    
-    IsValidPos(pos,"SetCell Invalid position:: Set Cell"s);
-    std::unique_ptr<CellInterface> tempcellptr = std::make_unique<Cell>();
-    Cell* tempcell = static_cast<Cell*>(tempcellptr.get());
-    tempcell->Set(std::move(text),*this);
-    std::unique_ptr<CellInterface> old_cellptr;
-    if (table_.count(pos)){
+    IsValidPos(pos,"SetCell Invalid position:: Set Cell");
+    JournalRecord record(*this);
+    RecordVersionEdit(pos);
+    Cell tempcell;
+    tempcell.Set(std::move(text), *this, pos);
+    std::optional<Cell> old_cell;
+    Cell* cell = table_.Find(pos);
+    if (cell){
         ClearDependences(pos);
-        old_cellptr = std::move(table_[pos]);
-        Cell* old_cell_ptr = static_cast<Cell*>(old_cellptr.get());
-        tempcell->cell_depend_up_ = old_cell_ptr->cell_depend_up_;
+        old_cell.emplace(std::move(*cell));
+        tempcell.cell_depend_up_ = old_cell->cell_depend_up_;
+        tempcell.topo_order_ = old_cell->topo_order_;
+    }
+    else{
+        cell = &table_.Insert(pos);
+        tempcell.topo_order_ = NewCellOrder(tempcell);
     }
-    table_[pos] = std::move(tempcellptr);
+    *cell = std::move(tempcell);
     if (!CheckCircularDependences(pos)){
-        if (old_cellptr){
-            table_[pos] = std::move(old_cellptr);
+        if (old_cell){
+            *cell = std::move(*old_cell);
             RestoreDependences(pos);
         }
         else{
-            table_.erase(pos);
+            table_.Erase(pos);
+        }
+        if (topo_order_enabled_){
+            // порядок мог измениться под часть новых связей и не учитывает
+            // вернувшиеся старые
+            BuildTopologicalOrder();
         }
         throw CircularDependencyException("#CIRC!");
     }
+    if (old_cell && old_cell->is_dirty_){
+        --dirty_count_;
+    }
+    RecordJournal(pos, old_cell ? std::optional(std::move(old_cell->content_)) : std::nullopt);
     RestoreDependences(pos);
     ResetCache(pos);
-    table_size_.cols <= pos.col ? table_size_.cols = pos.col + 1 : 0;
-    table_size_.rows <= pos.row ? table_size_.rows = pos.row + 1 : 0;
+    UpdateTopologicalOrder();
+    record.Commit();
 }
 
-const CellInterface* Sheet::GetCell(Position pos) const {
-    IsValidPos(pos,"SetCell Invalid position:: Get Cell const"s);
-    if(table_.find(pos)!=table_.end()){
-        return table_.at(pos).get();
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    for (const auto& [pos, text] : cells){
+        IsValidPos(pos,"SetCells Invalid position:: Set Cells");
+    }
+    // разбираем всё заранее: при синтаксической ошибке таблица не меняется
+    std::vector<std::pair<Position, Cell>> parsed(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i){
+        parsed[i].first = cells[i].first;
+        parsed[i].second.Set(std::move(cells[i].second), *this, cells[i].first);
     }
-    return nullptr;
+    SetPreparedCells(std::move(parsed));
 }
 
-CellInterface* Sheet::GetCell(Position pos) {
-    IsValidPos(pos,"SetCell Invalid position:: Get Cell"s);
-    if(table_.count(pos)){
-        return table_.at(pos).get();
+void Sheet::SetPreparedCells(std::vector<std::pair<Position, Cell>> cells) {
+    PERF_SCOPE(perf_, "SetCells");
+    for (const auto& [pos, cell] : cells){
+        IsValidPos(pos,"SetCells Invalid position:: Set Cells");
+    }
+    JournalRecord record(*this);
+    std::unordered_map<Position, size_t> index_of;
+    std::vector<Position> positions;
+    std::vector<Cell> new_cells;
+    index_of.reserve(cells.size());
+    positions.reserve(cells.size());
+    new_cells.reserve(cells.size());
+    PERF_COUNT(perf_, hash_probes, cells.size());
+    for (auto& [pos, new_cell] : cells){
+        auto [it, inserted] = index_of.emplace(pos, positions.size());
+        if (inserted){
+            positions.push_back(pos);
+            new_cells.push_back(std::move(new_cell));
+        }
+        else{
+            new_cells[it->second] = std::move(new_cell);
+        }
     }
-    return nullptr;
-}
 
-int Sheet::GetRows(const Position& old_pos){
-    if(old_pos.row + 1 != table_size_.rows){
-        for(int row = table_size_.rows - 1; row >= 0; --row){
-            for(int col = table_size_.cols - 1; col >= 0; --col){
-                if(table_.count({row, col})){
-                    return row + 1;
-                }
+    std::vector<std::optional<Cell>> old_cells(positions.size());
+    for (const auto& pos : positions){
+        RecordVersionEdit(pos);
+        ClearDependences(pos);
+    }
+    for (size_t i = 0; i < positions.size(); ++i){
+        Cell* cell = table_.Find(positions[i]);
+        if (cell){
+            old_cells[i].emplace(std::move(*cell));
+            new_cells[i].cell_depend_up_ = old_cells[i]->cell_depend_up_;
+            new_cells[i].topo_order_ = old_cells[i]->topo_order_;
+        }
+        else{
+            cell = &table_.Insert(positions[i]);
+            new_cells[i].topo_order_ = NewCellOrder(new_cells[i]);
+        }
+        *cell = std::move(new_cells[i]);
+    }
+    std::vector<Position> inserted_empty;
+    for (const auto& pos : positions){
+        RestoreDependences(pos, &inserted_empty);
+    }
+
+    if (!CheckCircularDependences(positions)){
+        for (const auto& pos : positions){
+            ClearDependences(pos);
+        }
+        for (size_t i = 0; i < positions.size(); ++i){
+            Cell* cell = table_.Find(positions[i]);
+            if (old_cells[i]){
+                // связи от ячеек вне пакета остались на месте, связи от
+                // старых формул пакета вернёт RestoreDependences ниже
+                old_cells[i]->cell_depend_up_ = std::move(cell->cell_depend_up_);
+                *cell = std::move(*old_cells[i]);
+            }
+            else{
+                table_.Erase(positions[i]);
             }
-     }
+        }
+        for (size_t i = 0; i < positions.size(); ++i){
+            if (old_cells[i]){
+                RestoreDependences(positions[i]);
+            }
+        }
+        for (const auto& pos : inserted_empty){
+            table_.Erase(pos);
+        }
+        if (topo_order_enabled_){
+            BuildTopologicalOrder();
+        }
+        throw CircularDependencyException("#CIRC!");
     }
-    return table_size_.rows;
+
+    for (size_t i = 0; i < positions.size(); ++i){
+        auto& old_cell = old_cells[i];
+        if (old_cell && old_cell->is_dirty_){
+            --dirty_count_;
+        }
+        RecordJournal(positions[i], old_cell ? std::optional(std::move(old_cell->content_)) : std::nullopt);
+    }
+    // связи пакета в порядок по одной не вносились; порядок строится заново,
+    // только если пакет его нарушил
+    const bool rebuild_order = topo_order_enabled_ && !IsTopologicalOrder(positions);
+    ResetCache(std::move(positions));
+    if (rebuild_order){
+        BuildTopologicalOrder();
+    }
+    UpdateTopologicalOrder();
+    record.Commit();
 }
 
-int Sheet::GetCol(const Position& old_pos,int rows){
-    if(old_pos.col + 1 == table_size_.cols){
-        for(int col = table_size_.cols - 1; col >= 0; --col){
-            for(int row = rows - 1 ; row >= 0; --row){
-                if(table_.count({row, col})){
-                    return col + 1;
-                }
-            }
+const CellInterface* Sheet::GetCell(Position pos) const {
+    IsValidPos(pos,"SetCell Invalid position:: Get Cell const");
+    return table_.Find(pos);
+}
+
+CellInterface* Sheet::GetCell(Position pos) {
+    IsValidPos(pos,"SetCell Invalid position:: Get Cell");
+    return table_.Find(pos);
+}
+
+ExecResult Sheet::GetCellNumber(Position pos) const {
+    const Cell* cell = table_.Find(pos);
+    if (!cell){
+        return 0.0;
+    }
+    return cell->GetNumber();
+}
+
+std::optional<FormulaError> Sheet::AddRangeNumbers(CellRange range, Aggregate& aggregate) const {
+    // Обходятся только занятые ячейки. Числа копятся в буфере и уходят в
+    // aggregate пачками, которые он складывает векторизуемым циклом.
+    static const size_t BATCH_SIZE = 64;
+    double batch[BATCH_SIZE];
+    size_t count = 0;
+    std::optional<FormulaError> error;
+    table_.ForEachInRange(range, [&](Position, const Cell& cell){
+        auto number = cell.GetRangeNumber();
+        if (!number){
+            return true;
+        }
+        if (const FormulaError* cell_error = std::get_if<FormulaError>(&*number)){
+            error = *cell_error;
+            return false;
         }
+        batch[count++] = std::get<double>(*number);
+        if (count == BATCH_SIZE){
+            aggregate.Add(batch, count);
+            count = 0;
+        }
+        return true;
+    });
+    if (!error){
+        aggregate.Add(batch, count);
     }
-    return table_size_.cols;
+    return error;
+}
+
+const AllocationStats& Sheet::GetAllocationStats() const{
+    return formula_memory_.GetStats();
+}
+
+PerfSnapshot Sheet::GetPerfSnapshot() const{
+#ifdef SPREADSHEET_INSTRUMENTATION
+    return perf_.GetSnapshot();
+#else
+    return {};
+#endif
 }
 
-Size Sheet::SetTableSize(const Position& old_pos){
-    Size new_size;
-    new_size.rows = GetRows(old_pos);
-    new_size.cols = GetCol(old_pos, new_size.rows);
-    return new_size;
+void Sheet::ResetPerfCounters(){
+#ifdef SPREADSHEET_INSTRUMENTATION
+    perf_.Reset();
+#endif
 }
 
 void Sheet::ClearCell(Position pos) {
-    IsValidPos(pos,"SetCell Invalid position:: Clear Cell const"s);
+    IsValidPos(pos,"SetCell Invalid position:: Clear Cell const");
 
-    if(table_.count(pos)){
+    Cell* cell = table_.Find(pos);
+    if(cell){
+        JournalRecord record(*this);
+        RecordVersionEdit(pos);
         ClearDependences(pos);
         ResetCache(pos);
-        table_.erase(pos);
-        table_size_ = SetTableSize(pos);
+        if (cell->is_dirty_){
+            cell->is_dirty_ = false;
+            --dirty_count_;
+        }
+        RecordJournal(pos, std::move(cell->content_));
+        if (!cell->cell_depend_up_.Empty()){
+            // на ячейку ссылаются формулы: оставляем её пустой, иначе
+            // потеряются обратные связи
+            cell->Clear();
+        }
+        else{
+            table_.Erase(pos);
+        }
+        record.Commit();
     }
 }
 Size Sheet::GetPrintableSize() const {
-    return table_size_;
+    return table_.GetBounds();
+}
+
+template <typename CellPrinter>
+void Sheet::PrintCells(std::ostream& output, CellPrinter print_cell) const {
+    // обходятся только занятые ячейки
+    PrintTable(output, table_.GetBounds(), [this](auto visit){
+        table_.ForEach(visit);
+    }, print_cell);
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    for(int r = 0; r < table_size_.rows; ++r){
-        for( int c = 0; c < table_size_.cols; ++c){
-            Position pos{r,c};
-            if(table_.count(pos)){
-                output << table_.at(pos)->GetValue();
-            }
-            if(c < table_size_.cols - 1){
-                output <<'\t';
+    ValuePrinter print_value(output);
+    PrintCells(output, [&print_value](std::string& buffer, const Cell& cell){
+        cell.PrintValue(buffer, print_value);
+    });
+}
+void Sheet::PrintTexts(std::ostream& output) const {
+    PrintCells(output, [](std::string& buffer, const Cell& cell){
+        buffer += cell.GetText();
+    });
+}
+
+void Sheet::ClearDependences(const Position& pos){
+    Cell* del_cell = table_.Find(pos);
+    if (!del_cell){
+        return;
+    }
+    for (const auto& range : del_cell->GetReferencedRanges()){
+        range_index_.Erase(range, pos);
+    }
+    auto erase_edge = [this, &pos](Position current_pos){
+        Cell& current_cell = *table_.Find(current_pos);
+        edge_count_ -= current_cell.cell_depend_up_.Erase(pos);
+    };
+    del_cell->ForEachReferencedCell(std::ref(erase_edge));
+}
+
+Cell& Sheet::InsertEmpty(const Position& pos){
+    IsValidPos(pos,"SetCell Invalid position:: InsertEmpty");
+    // пустая ячейка ни на что не ссылается и может идти первой в порядке
+    RecordVersionEdit(pos);
+    RecordJournal(pos, std::nullopt);
+    Cell& cell = table_.Insert(pos);
+    cell.topo_order_ = --first_order_;
+    return cell;
+}
+
+void Sheet::RestoreDependences(const Position& pos, std::vector<Position>* inserted){
+    Cell* cell = table_.Find(pos);
+    if (!cell){
+        return;
+    }
+    // ссылки обходятся без промежуточного вектора, повторы отсеивает Insert
+    auto insert_edge = [this, &pos, inserted](Position current_pos){
+        Cell* current_cell = table_.Find(current_pos);
+        if (!current_cell){
+            current_cell = &InsertEmpty(current_pos);
+            if (inserted){
+                inserted->push_back(current_pos);
             }
         }
-        output << '\n';
+        edge_count_ += current_cell->cell_depend_up_.Insert(pos);
+    };
+    cell->ForEachReferencedCell(std::ref(insert_edge));
+    for (const auto& range : cell->GetReferencedRanges()){
+        range_index_.Insert(range, pos);
     }
 }
-void Sheet::PrintTexts(std::ostream& output) const {
-    for(int r = 0; r < table_size_.rows; ++r){
-        for( int c = 0; c < table_size_.cols; ++c){
-            Position pos{r,c};
-            if(table_.count(pos)){
-                output << table_.at(pos)->GetText();
-            }
-            if(c < table_size_.cols - 1){
-                output <<'\t';
-            }
+
+std::int64_t Sheet::NewCellOrder(const Cell& cell){
+    // ячейка без ссылок может идти первой, формула - последней: всё, на что
+    // она ссылается, уже упорядочено раньше
+    return cell.IsFormula() ? next_order_++ : --first_order_;
+}
+
+template <typename Func>
+void Sheet::ForEachReference(const Cell& cell, Func func) const{
+    auto visit = [this, &func](Position ref_pos){
+        func(ref_pos, table_.Find(ref_pos));
+    };
+    cell.ForEachReferencedCell(std::ref(visit));
+    for (const auto& range : cell.GetReferencedRanges()){
+        table_.ForEachInRange(range, [&func](Position ref_pos, const Cell& ref_cell){
+            func(ref_pos, &ref_cell);
+            return true;
+        });
+    }
+}
+
+template <typename Func>
+void Sheet::ForEachDependent(Position pos, const Cell& cell, Func func) const{
+    cell.cell_depend_up_.ForEach(std::ref(func));
+    range_index_.ForEachCovering(pos, func);
+}
+
+void Sheet::ResetCache(const Position& pos){
+    reset_stack_.clear();
+    reset_stack_.push_back(pos);
+    ResetStackedCaches();
+}
+
+void Sheet::ResetCache(std::vector<Position> positions){
+    reset_stack_ = std::move(positions);
+    ResetStackedCaches();
+}
+
+void Sheet::ResetStackedCaches(){
+    std::vector<Position>& stack = reset_stack_;
+    while (!stack.empty()){
+        Position current_pos = stack.back();
+        stack.pop_back();
+        Cell* reset_cell = table_.Find(current_pos);
+        if (!reset_cell){
+            continue;
         }
-        output << '\n';
+        const bool was_cached = reset_cell->IsCached();
+        PERF_COUNT(perf_, cache_invalidations, was_cached);
+        if (versioning_ && was_cached){
+            version_values_.push_back(current_pos);
+        }
+        reset_cell->cache_state_.Store(CacheState::INVALID);
+        MarkDirty(current_pos, *reset_cell);
+        ForEachDependent(current_pos, *reset_cell, [this, &stack](Position depend_pos){
+            Cell* depend_cell = table_.Find(depend_pos);
+            if (depend_cell && depend_cell->IsCached()){
+                stack.push_back(depend_pos);
+            }
+        });
     }
 }
 
-void Sheet::ClearDependences(const Position& pos){
-    if (!table_.count(pos)){
+void Sheet::MarkDirty(const Position& pos, const Cell& cell){
+    if (!cell.IsFormula() || cell.is_dirty_){
         return;
     }
-    Cell& del_cell = static_cast<Cell&>(*table_.at(pos));
-    for (const auto& current_pos : del_cell.GetReferencedCells()){
-        Cell& current_cell = static_cast<Cell&>(*table_.at(current_pos));
-        current_cell.cell_depend_up_.erase(pos);
+    cell.is_dirty_ = true;
+    ++dirty_count_;
+    dirty_cells_.push_back(pos);
+    // список пополняется и при ленивом вычислении не чистится, поэтому
+    // время от времени выбрасываем из него уже вычисленные ячейки
+    if (dirty_cells_.size() > 2 * dirty_count_ + 64){
+        auto not_dirty = [this](const Position& dirty_pos){
+            const Cell* dirty_cell = table_.Find(dirty_pos);
+            return !dirty_cell || !dirty_cell->is_dirty_;
+        };
+        dirty_cells_.erase(std::remove_if(dirty_cells_.begin(), dirty_cells_.end(), not_dirty),
+                           dirty_cells_.end());
     }
 }
 
-void Sheet::InsertEmpty(const Position& pos){
-    IsValidPos(pos,"SetCell Invalid position:: InsertEmpty"s);
-    table_[pos] = std::make_unique<Cell>();
-    if ((pos.row + 1) > table_size_.rows){
-        table_size_.rows = pos.row + 1;
+std::vector<const Cell*> Sheet::GetCalculationOrder(const std::vector<const Cell*>& roots) const{
+    // Обход в глубину на явном стеке. Ячейка попадает в результат при
+    // повторном снятии со стека, когда все её зависимости уже там, т.е. в
+    // топологическом порядке.
+    std::vector<const Cell*> order;
+    std::vector<std::pair<const Cell*, bool>> stack;
+    std::unordered_set<const Cell*> visited;
+    for (const Cell* root : roots){
+        stack.push_back({root, false});
     }
-    if ((pos.col + 1) > table_size_.cols){
-        table_size_.cols = pos.col + 1;
+    while (!stack.empty()){
+        auto& [current_cell, expanded] = stack.back();
+        if (expanded){
+            order.push_back(current_cell);
+            stack.pop_back();
+            continue;
+        }
+        PERF_COUNT(perf_, hash_probes, 1);
+        if (!visited.insert(current_cell).second){
+            stack.pop_back();
+            continue;
+        }
+        expanded = true;
+        const Cell* expand_cell = current_cell;
+        ForEachReference(*expand_cell, [&](Position, const Cell* ref_cell){
+            // текст считать не нужно, а в диапазоне его может быть очень много
+            if (ref_cell && ref_cell->sheet_ && !ref_cell->IsCached()){
+                PERF_COUNT(perf_, hash_probes, 1);
+                if (!visited.count(ref_cell)){
+                    stack.push_back({ref_cell, false});
+                }
+            }
+        });
     }
+    return order;
 }
 
-void Sheet::RestoreDependences(const Position& pos){
-    if (!table_.count(pos)){
-        return;
+void Sheet::CalculateReferences(const Cell& cell) const{
+    auto order = GetCalculationOrder({&cell});
+    // последней в порядке идёт сама ячейка, её досчитает вызывающий
+    order.pop_back();
+    for (const Cell* calc_cell : order){
+        calc_cell->Calculate();
     }
-    for (const auto& current_pos : table_.at(pos)->GetReferencedCells()){
-        if (!table_.count(current_pos)){
-            InsertEmpty(current_pos);
+}
+
+void Sheet::CalculateConcurrently(const Cell& cell) const{
+    // Ячейки порядка считает тот поток, который первым перевёл их в
+    // COMPUTING. Занятые другим потоком ячейки пропускаются: их ждут только
+    // формулы, которые этот поток взялся считать. Ожидание идёт вдоль связей
+    // ациклического графа, поэтому потоки не ждут друг друга по кругу.
+    for (const Cell* calc_cell : GetCalculationOrder({&cell})){
+        if (!calc_cell->cache_state_.TryStartComputing()){
+            continue;
+        }
+        try{
+            ForEachReference(*calc_cell, [](Position, const Cell* ref_cell){
+                if (ref_cell && ref_cell->sheet_){
+                    ref_cell->WaitCalculated();
+                }
+            });
+            calc_cell->Calculate();
+        }
+        catch (...){
+            // ждущие потоки досчитают ячейку сами
+            calc_cell->cache_state_.Store(CacheState::INVALID);
+            throw;
         }
-        Cell& current_cell = static_cast<Cell&>(*table_.at(current_pos));
-        current_cell.cell_depend_up_.insert(pos);
     }
+    cell.WaitCalculated();
 }
 
-void Sheet::ResetCache(const Position& pos){
-    if (!table_.count(pos)){
+void Sheet::Recalculate(){
+    PERF_SCOPE(perf_, "Recalculate");
+    std::vector<const Cell*> roots;
+    for (const auto& pos : dirty_cells_){
+        const Cell* cell = table_.Find(pos);
+        if (cell && cell->is_dirty_){
+            roots.push_back(cell);
+        }
+    }
+    dirty_cells_.clear();
+    if (pool_){
+        RecalculateParallel(roots);
         return;
     }
-    Cell& reset_cell = static_cast<Cell&>(*table_.at(pos));
-    reset_cell.cashvalue_.reset();
-    for (const auto& current_pos : reset_cell.cell_depend_up_){
-        if (table_.count(current_pos)){
-            Cell& current_cell = static_cast<Cell&>(*table_.at(current_pos));
-            if (current_cell.cashvalue_){
-                ResetCache(current_pos);
+    for (const Cell* cell : roots){
+        if (cell->is_dirty_){
+            CalculateReferences(*cell);
+            cell->Calculate();
+        }
+    }
+}
+
+void Sheet::RecalculateParallel(const std::vector<const Cell*>& roots){
+    // Уровень ячейки на единицу больше максимального уровня ячеек, на которые
+    // она ссылается. Ячейки одного уровня друг от друга не зависят.
+    const auto order = GetCalculationOrder(roots);
+    std::unordered_map<const Cell*, size_t> cell_level;
+    std::vector<std::vector<const Cell*>> levels;
+    for (const Cell* cell : order){
+        size_t level = 0;
+        ForEachReference(*cell, [&](Position, const Cell* ref_cell){
+            PERF_COUNT(perf_, hash_probes, 1);
+            auto it = cell_level.find(ref_cell);
+            if (it != cell_level.end()){
+                level = std::max(level, it->second + 1);
+            }
+        });
+        PERF_COUNT(perf_, hash_probes, 1);
+        cell_level[cell] = level;
+        if (levels.size() <= level){
+            levels.resize(level + 1);
+        }
+        levels[level].push_back(cell);
+    }
+
+    // Формула читает только кеши ячеек предыдущих уровней, поэтому каждый
+    // поток пишет лишь в кеш той ячейки, которую считает. Отметки о грязных
+    // ячейках снимаются между уровнями, в одном потоке.
+    for (const auto& level_cells : levels){
+        PERF_SCOPE(perf_, "RecalculateLevel");
+        pool_->ParallelFor(level_cells.size(), [&level_cells](size_t i){
+            level_cells[i]->CalculateValue();
+        });
+        for (const Cell* cell : level_cells){
+            if (cell->is_dirty_){
+                cell->is_dirty_ = false;
+                --dirty_count_;
             }
         }
     }
 }
 
-bool Sheet::CheckCircularDependences(const Position& pos){
-    std::unordered_set<Position> cell;
-    return CheckCircular(pos, pos, cell);
+void Sheet::SetRecalculationThreads(size_t threads){
+    if (threads <= 1){
+        pool_.reset();
+    }
+    else if (!pool_ || pool_->GetThreadCount() != threads){
+        pool_ = std::make_unique<ThreadPool>(threads);
+    }
+}
+
+void Sheet::SetConcurrentEvaluation(bool enabled){
+    concurrent_evaluation_ = enabled;
 }
 
-bool Sheet::CheckCircular(const Position& pos,const Position& start_pos,std::unordered_set<Position>& cell){
-    if (!table_.count(pos)){
+size_t Sheet::GetDirtyCount() const{
+    return dirty_count_;
+}
+
+std::uint32_t Sheet::NextVisitGeneration(std::uint32_t step) const{
+    if (visit_generation_ > std::numeric_limits<std::uint32_t>::max() - step){
+        // после переполнения старые отметки совпали бы с новыми
+        table_.ForEach([](Position, const Cell& cell){
+            cell.visit_mark_ = 0;
+        });
+        visit_generation_ = 0;
+    }
+    const std::uint32_t generation = visit_generation_ + 1;
+    visit_generation_ += step;
+    return generation;
+}
+
+bool Sheet::CheckCircularDependences(const Position& pos){
+    Cell* start_cell = table_.Find(pos);
+    // цикл может замкнуть только формула, ссылающаяся на другие ячейки
+    if (!start_cell->IsFormula()){
         return true;
     }
-    Cell& check_cell = static_cast<Cell&>(*table_.at(pos));
-    cell.insert(pos);
-    for (const auto& current_pos : check_cell.GetReferencedCells()){
-        if (current_pos == start_pos){
+    bool acyclic = true;
+    if (topo_order_enabled_){
+        // новая ячейка могла попасть в диапазон формулы, стоящей в порядке
+        // раньше неё; связи, которые уже учтены порядком, вставляются даром
+        ForEachDependent(pos, *start_cell, [&](Position depend_pos){
+            if (acyclic && !InsertOrderedEdge(pos, depend_pos)){
+                acyclic = false;
+            }
+        });
+        auto insert_edge = [&](Position ref_pos, const Cell* ref_cell){
+            if (!acyclic){
+                return;
+            }
+            if (ref_cell == start_cell ||
+                (ref_cell && !InsertOrderedEdge(ref_pos, pos))){
+                acyclic = false;
+            }
+        };
+        ForEachReference(*start_cell, std::ref(insert_edge));
+        return acyclic;
+    }
+
+    // Обход в глубину по ссылкам на явном стеке: цикл есть, если из новой
+    // формулы достижима она сама. Посещённые ячейки отмечаются номером
+    // обхода, std::ref не даёт std::function выделять память под лямбду.
+    const std::uint32_t generation = NextVisitGeneration();
+    visit_stack_.clear();
+    visit_stack_.push_back(start_cell);
+    start_cell->visit_mark_ = generation;
+    auto visit = [&](Position, const Cell* ref_cell){
+        if (ref_cell == start_cell){
+            acyclic = false;
+        }
+        else if (ref_cell && ref_cell->visit_mark_ != generation){
+            ref_cell->visit_mark_ = generation;
+            visit_stack_.push_back(ref_cell);
+        }
+    };
+    while (acyclic && !visit_stack_.empty()){
+        const Cell* cell = visit_stack_.back();
+        visit_stack_.pop_back();
+        PERF_COUNT(perf_, cycle_check_visits, 1);
+        ForEachReference(*cell, std::ref(visit));
+    }
+    return acyclic;
+}
+
+bool Sheet::CheckCircularDependences(const std::vector<Position>& positions) const{
+    // Раскраска вершин при обходе в глубину на явном стеке: ссылка на
+    // ячейку, которая ещё на стеке (в обработке), означает цикл. До пакета
+    // граф был ацикличен, значит любой новый цикл проходит через ячейку пакета.
+    // Цвет хранится в отметке обхода: два номера подряд на один обход.
+    const std::uint32_t in_progress = NextVisitGeneration(2);
+    const std::uint32_t done = in_progress + 1;
+    auto& stack = color_stack_;
+    bool acyclic = true;
+    auto visit = [&](Position, const Cell* ref_cell){
+        if (!ref_cell || ref_cell->visit_mark_ == done){
+            return;
+        }
+        if (ref_cell->visit_mark_ == in_progress){
+            acyclic = false;
+        }
+        else{
+            stack.push_back({ref_cell, false});
+        }
+    };
+    for (const auto& start_pos : positions){
+        stack.clear();
+        stack.push_back({table_.Find(start_pos), false});
+        while (acyclic && !stack.empty()){
+            auto& [cell, expanded] = stack.back();
+            if (expanded){
+                cell->visit_mark_ = done;
+                stack.pop_back();
+                continue;
+            }
+            if (cell->visit_mark_ == in_progress || cell->visit_mark_ == done){
+                stack.pop_back();
+                continue;
+            }
+            expanded = true;
+            cell->visit_mark_ = in_progress;
+            PERF_COUNT(perf_, cycle_check_visits, 1);
+            const Cell* expand_cell = cell;
+            ForEachReference(*expand_cell, std::ref(visit));
+        }
+        if (!acyclic){
             return false;
         }
-        if (!cell.count(current_pos)){
-            if (!CheckCircular(current_pos, start_pos, cell)){
-                return false;
+    }
+    return true;
+}
+
+void Sheet::UpdateTopologicalOrder(){
+    if (!topo_order_enabled_ && edge_count_ > INCREMENTAL_ORDER_EDGES){
+        BuildTopologicalOrder();
+        topo_order_enabled_ = true;
+    }
+}
+
+void Sheet::BuildTopologicalOrder(){
+    PERF_SCOPE(perf_, "BuildTopologicalOrder");
+    // Алгоритм Кана. Пока ячейка не получила номер, в topo_order_ лежит
+    // число ещё не упорядоченных ячеек, на которые она ссылается.
+    auto& order = forward_cells_;
+    order.clear();
+    table_.ForEach([](Position, Cell& cell){
+        cell.topo_order_ = 0;
+    });
+    table_.ForEach([this](Position pos, Cell& cell){
+        ForEachDependent(pos, cell, [this](Position depend_pos){
+            ++table_.Find(depend_pos)->topo_order_;
+        });
+    });
+    table_.ForEach([&order](Position pos, Cell& cell){
+        if (cell.topo_order_ == 0){
+            order.push_back({pos, &cell});
+        }
+    });
+    for (size_t i = 0; i < order.size(); ++i){
+        auto [pos, cell] = order[i];
+        cell->topo_order_ = static_cast<std::int64_t>(i);
+        ForEachDependent(pos, *cell, [this, &order](Position depend_pos){
+            Cell* depend_cell = table_.Find(depend_pos);
+            if (--depend_cell->topo_order_ == 0){
+                order.push_back({depend_pos, depend_cell});
             }
+        });
+    }
+    first_order_ = 0;
+    next_order_ = static_cast<std::int64_t>(order.size());
+}
+
+bool Sheet::IsTopologicalOrder(const std::vector<Position>& positions) const{
+    // Связи вне пакета порядок не нарушали, поэтому проверяются только связи
+    // ячеек пакета. Так при импорте блок за блоком новые формулы, которые
+    // получили номера по возрастанию, не перестраивают порядок всего листа.
+    for (const auto& pos : positions){
+        const Cell& cell = *table_.Find(pos);
+        bool ordered = true;
+        ForEachReference(cell, [&](Position, const Cell* ref_cell){
+            if (ref_cell && ref_cell->topo_order_ >= cell.topo_order_){
+                ordered = false;
+            }
+        });
+        ForEachDependent(pos, cell, [&](Position depend_pos){
+            if (table_.Find(depend_pos)->topo_order_ <= cell.topo_order_){
+                ordered = false;
+            }
+        });
+        if (!ordered){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Sheet::InsertOrderedEdge(Position from_pos, Position to_pos){
+    // Пирс-Келли: связь from -> to нарушает порядок, только если from стоит
+    // позже to. Тогда переставляются лишь ячейки между ними: достижимые из
+    // to (forward) и те, от которых зависит from (backward). Если из to
+    // достижима from, связь замыкает цикл.
+    Cell& from = *table_.Find(from_pos);
+    Cell& to = *table_.Find(to_pos);
+    const std::int64_t lower = to.topo_order_;
+    const std::int64_t upper = from.topo_order_;
+    if (upper < lower){
+        return true;
+    }
+    const std::uint32_t generation = NextVisitGeneration();
+    forward_cells_.clear();
+    forward_cells_.push_back({to_pos, &to});
+    to.visit_mark_ = generation;
+    bool acyclic = true;
+    for (size_t i = 0; acyclic && i < forward_cells_.size(); ++i){
+        auto [pos, cell] = forward_cells_[i];
+        ForEachDependent(pos, *cell, [&](Position depend_pos){
+            Cell* depend_cell = table_.Find(depend_pos);
+            if (depend_cell == &from){
+                acyclic = false;
+            }
+            else if (depend_cell->visit_mark_ != generation && depend_cell->topo_order_ < upper){
+                depend_cell->visit_mark_ = generation;
+                forward_cells_.push_back({depend_pos, depend_cell});
+            }
+        });
+    }
+    PERF_COUNT(perf_, cycle_check_visits, forward_cells_.size());
+    if (!acyclic){
+        return false;
+    }
+    backward_cells_.clear();
+    backward_cells_.push_back(&from);
+    from.visit_mark_ = generation;
+    auto visit = [&](Position ref_pos, const Cell*){
+        Cell* ref_cell = table_.Find(ref_pos);
+        if (ref_cell && ref_cell->visit_mark_ != generation && ref_cell->topo_order_ > lower){
+            ref_cell->visit_mark_ = generation;
+            backward_cells_.push_back(ref_cell);
         }
+    };
+    for (size_t i = 0; i < backward_cells_.size(); ++i){
+        ForEachReference(*backward_cells_[i], std::ref(visit));
+    }
+    PERF_COUNT(perf_, cycle_check_visits, backward_cells_.size());
+
+    // освободившиеся номера раздаются заново: сначала backward, потом forward,
+    // внутри каждой группы относительный порядок сохраняется
+    auto by_order = [](const Cell* lhs, const Cell* rhs){
+        return lhs->topo_order_ < rhs->topo_order_;
+    };
+    std::sort(forward_cells_.begin(), forward_cells_.end(), [&by_order](const auto& lhs, const auto& rhs){
+        return by_order(lhs.second, rhs.second);
+    });
+    std::sort(backward_cells_.begin(), backward_cells_.end(), by_order);
+    orders_.clear();
+    for (const Cell* cell : backward_cells_){
+        orders_.push_back(cell->topo_order_);
+    }
+    for (const auto& [pos, cell] : forward_cells_){
+        orders_.push_back(cell->topo_order_);
+    }
+    std::sort(orders_.begin(), orders_.end());
+    size_t next = 0;
+    for (Cell* cell : backward_cells_){
+        cell->topo_order_ = orders_[next++];
+    }
+    for (const auto& [pos, cell] : forward_cells_){
+        cell->topo_order_ = orders_[next++];
     }
     return true;
 }
@@ -1,16 +1,42 @@
 #pragma once
 
 #include "cell.h"
+#include "celltable.h"
 #include "common.h"
+#include "countingresource.h"
+#include "perfcounters.h"
+#include "rangeindex.h"
+#include "sheetversion.h"
+#include "threadpool.h"
 
+#include <atomic>
+#include <cstdint>
+#include <deque>
 #include <functional>
-#include <unordered_map>
 #include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <vector>
 
 class Sheet : public SheetInterface {
 public:
+    friend class Cell;
+
+    Sheet();
+    // Память под деревья формул листа берётся из upstream.
+    explicit Sheet(std::pmr::memory_resource* upstream);
 
     void SetCell(Position pos, std::string text) override;
+    // Задаёт содержимое сразу многих ячеек. Зависимости перестраиваются,
+    // проверка на циклы и сброс кеша выполняются один раз на весь пакет.
+    // Исключения те же, что у SetCell; при любом из них таблица остаётся
+    // в исходном состоянии. Если позиция встречается несколько раз,
+    // действует последнее значение.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+    // То же для ячеек, подготовленных заранее через Cell::SetText и
+    // Cell::SetFormula, например при параллельном импорте (importer.h).
+    void SetPreparedCells(std::vector<std::pair<Position, Cell>> cells);
     void InsertEmptyCell(Position pos);
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
@@ -19,22 +45,215 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Пересчитывает формулы, кеш которых был сброшен правками. Ячейки
+    // вычисляются в топологическом порядке, без рекурсии, поэтому длинные
+    // цепочки зависимостей не переполняют стек.
+    void Recalculate();
+    // Количество формул, ожидающих пересчёта.
+    size_t GetDirtyCount() const;
+    // Включает параллельный пересчёт в Recalculate() на threads потоках.
+    // Независимые ячейки одного уровня графа зависимостей считаются
+    // одновременно. 0 или 1 - последовательный пересчёт (по умолчанию).
+    void SetRecalculationThreads(size_t threads);
+    // Включает режим, в котором значения можно читать из многих потоков
+    // одновременно: GetCell()->GetValue(), GetCellNumber(), PrintValues().
+    // Формулу считает один поток, остальные, которым нужно её значение,
+    // считают пока другие ячейки и ждут её лишь тогда, когда без неё не
+    // обойтись. Правки по-прежнему требуют исключительного доступа к листу.
+    void SetConcurrentEvaluation(bool enabled);
+
+    // Вставляют count пустых строк (столбцов) перед строкой (столбцом)
+    // before. Ячейки сдвигаются целиком, ссылки и диапазоны в формулах
+    // переписываются в уже разобранных деревьях; диапазон, внутрь которого
+    // вставлены строки, расширяется. Ссылки, ушедшие за край листа,
+    // становятся #REF!. Бросают InvalidPositionException, если before вне
+    // листа, count больше числа линий от before до края или занятые ячейки
+    // ушли бы за край. Позиции и формулы в журнале отмены сдвигаются так же,
+    // как в листе; сама вставка не отменяется.
+    void InsertRows(int before, int count = 1);
+    void InsertCols(int before, int count = 1);
+    // Удаляют count строк (столбцов), начиная с first. Ссылки на удалённые
+    // ячейки становятся #REF!, диапазоны сужаются, а удалённые целиком -
+    // #REF!. Пересчитываются только формулы, ссылки которых изменились, и
+    // зависящие от них. Бросают InvalidPositionException, если строки вне
+    // листа. Правки удалённых ячеек выпадают из журнала отмены, остальные
+    // сдвигаются; само удаление не отменяется.
+    void DeleteRows(int first, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    // Журнал отмены правок: каждый вызов SetCell, SetCells, SetPreparedCells
+    // или ClearCell - одна запись. Копия листа не хранится, только прежнее
+    // содержимое затронутых ячеек: текст или формула с общим деревом.
+    // Хранятся limit последних правок; 0 - журнал выключен (по умолчанию)
+    // и очищен.
+    void SetUndoLimit(size_t limit);
+    // Отменяет последнюю правку и возвращает отменённую. Связи и кеши
+    // меняются так же, как при обычной правке тех же ячеек: сбрасываются
+    // только значения зависимых формул. false, если отменять нечего; новая
+    // правка очищает список для Redo().
+    bool Undo();
+    bool Redo();
+    size_t GetUndoCount() const;
+    size_t GetRedoCount() const;
+    // Память журнала в байтах: записи и длинные тексты. Деревья формул общие
+    // с листом и не учитываются.
+    size_t GetJournalMemory() const;
+
+    // Значение ячейки как операнда формулы; пустая ячейка даёт 0.
+    ExecResult GetCellNumber(Position pos) const;
+    // Добавляет в aggregate числа диапазона для функций SUM, MIN и т.д.
+    // Пустые ячейки и текст, не являющийся числом, пропускаются; при ошибке
+    // в ячейке обход прекращается и возвращается эта ошибка.
+    std::optional<FormulaError> AddRangeNumbers(CellRange range, Aggregate& aggregate) const;
+
+    // Статистика выделений памяти под деревья формул: по разнице до и
+    // после правки видно, сколько аллокаций ей понадобилось.
+    const AllocationStats& GetAllocationStats() const;
+
+    // Публикует текущее состояние листа неизменяемой версией для читателей
+    // из других потоков (sheetversion.h). Сначала пересчитывает формулы. С
+    // прошлой версией общие все блоки ячеек, которые с тех пор не менялись,
+    // поэтому публикация стоит пропорционально правкам, а не размеру листа.
+    std::shared_ptr<const SheetVersion> PublishVersion();
+    // Последняя опубликованная версия или nullptr. Единственный метод листа,
+    // который можно вызывать из других потоков одновременно с правками и
+    // публикацией: указатель читается атомарно.
+    std::shared_ptr<const SheetVersion> GetPublishedVersion() const;
+
+    // Счётчики горячих путей и события трассировки (perfcounters.h). Ведутся
+    // только в сборке с SPREADSHEET_INSTRUMENTATION, иначе снимок пуст.
+    PerfSnapshot GetPerfSnapshot() const;
+    void ResetPerfCounters();
+
+    // Записывает лист в файл снимка: тексты ячеек, деревья формул, граф
+    // зависимостей и вычисленные значения. Формат версионирован, см.
+    // snapshot.h; при ошибке записи бросается SnapshotException. Файл
+    // подменяется только готовым снимком, прежний при ошибке остаётся.
+    void SaveSnapshot(const std::string& path) const;
+    // Загружает лист из снимка. Файл отображается в память, записи ячеек
+    // читаются прямо из неё; формулы не разбираются заново, а собираются из
+    // сохранённых деревьев, значения и связи не пересчитываются. Бросает
+    // SnapshotException, если файл не открывается, повреждён или записан
+    // другой версией формата.
+    static std::unique_ptr<Sheet> LoadSnapshot(const std::string& path,
+                                               std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+
 private:
+    // Пулы памяти под деревья формул. Объявлены первыми: всё, что в них
+    // лежит, уничтожается раньше, а сами пулы отдают память целиком.
+    std::pmr::unsynchronized_pool_resource formula_pool_;
+    CountingResource formula_memory_{&formula_pool_};
+
+#ifdef SPREADSHEET_INSTRUMENTATION
+    mutable PerfRecorder perf_;
+#endif
+    CellTable table_;
+    std::vector<Position> dirty_cells_;
+    // атомарный: ячейки, вычисленные в разных потоках, снимаются со счёта
+    // одновременно
+    mutable std::atomic<size_t> dirty_count_{0};
+    bool concurrent_evaluation_ = false;
+    std::unique_ptr<ThreadPool> pool_;
+    // общие деревья формул, скопированных вдоль строк и столбцов
+    FormulaCache formula_cache_{&formula_memory_};
+    // диапазоны из формул листа. Связи от ячеек диапазона не заводятся:
+    // зависимые формулы ищутся в индексе
+    RangeIndex range_index_;
+
+    // последняя опубликованная версия, меняется только через std::atomic_store
+    std::shared_ptr<const SheetVersion> published_;
+    // ячейки, изменённые с последней публикации: содержимое или только
+    // значение. Записываются после первой публикации; без неё следующая
+    // версия собирается из всего листа
+    std::vector<Position> version_edits_;
+    std::vector<Position> version_values_;
+    bool versioning_ = false;
+    std::uint64_t version_number_ = 0;
+
+    // Прежнее содержимое ячейки до правки; nullopt - ячейки не было.
+    // Изменения связей отдельно не хранятся: они следуют из формул.
+    struct JournalDelta {
+        Position pos;
+        std::optional<Cell::Content> content;
+    };
+    using JournalEntry = std::vector<JournalDelta>;
+    class JournalRecord;
+    std::deque<JournalEntry> undo_journal_;
+    std::deque<JournalEntry> redo_journal_;
+    size_t undo_limit_ = 0;
+    // запись текущей правки; nullptr - правка не записывается
+    JournalEntry* journal_ = nullptr;
+
+    // Начиная с этого числа связей проверка на циклы ведётся по
+    // поддерживаемому топологическому порядку (алгоритм Пирса-Келли)
+    static const size_t INCREMENTAL_ORDER_EDGES = 100000;
 
-    std::unordered_map<Position,std::unique_ptr<CellInterface>>  table_;
-    Size table_size_;
+    // число связей "ячейка -> формула, которая на неё ссылается"
+    size_t edge_count_ = 0;
+    bool topo_order_enabled_ = false;
+    // новые пустые ячейки ставятся в начало порядка, новые формулы - в конец
+    std::int64_t first_order_ = 0;
+    std::int64_t next_order_ = 0;
+    // поколение обхода для отметок Cell::visit_mark_ и буферы обходов,
+    // чтобы не выделять память на каждой проверке
+    mutable std::uint32_t visit_generation_ = 0;
+    mutable std::vector<const Cell*> visit_stack_;
+    mutable std::vector<std::pair<const Cell*, bool>> color_stack_;
+    std::vector<std::pair<Position, Cell*>> forward_cells_;
+    std::vector<Cell*> backward_cells_;
+    std::vector<std::int64_t> orders_;
+    std::vector<Position> reset_stack_;
 
-    Size SetTableSize(const Position&);
+    void RecordVersionEdit(const Position& pos){
+        if (versioning_){
+            version_edits_.push_back(pos);
+        }
+    }
+    void RecordJournal(const Position& pos, std::optional<Cell::Content> content){
+        if (journal_){
+            journal_->push_back({pos, std::move(content)});
+        }
+    }
+    void PushUndo(JournalEntry entry);
+    // Применяет последнюю запись from, обратную ей запись кладёт в to
+    bool ReplayJournal(std::deque<JournalEntry>& from, std::deque<JournalEntry>& to);
+    void ApplyJournalEntry(const JournalEntry& entry);
+    void ShiftLines(ReferenceShift::Axis axis, int first, int count, bool insert);
+    void MoveCells(ReferenceShift& shift);
+    // Переносит позиции и формулы журнала отмены тем же сдвигом
+    void ShiftJournal(ReferenceShift& shift);
     void ClearDependences(const Position&) ;
-    void InsertEmpty(const Position&);
-    void RestoreDependences(const Position&);
+    Cell& InsertEmpty(const Position&);
+    std::int64_t NewCellOrder(const Cell&);
+    void RestoreDependences(const Position&, std::vector<Position>* inserted = nullptr);
     void ResetCache(const Position&);
+    void ResetCache(std::vector<Position> positions);
+    void ResetStackedCaches();
+    void MarkDirty(const Position&, const Cell&);
+    void CalculateReferences(const Cell&) const;
+    // Вычисляет формулу cell и всё, от чего она зависит, в режиме
+    // SetConcurrentEvaluation.
+    void CalculateConcurrently(const Cell&) const;
+    // Вызывает func(pos, cell) для ячеек, на которые ссылается формула cell,
+    // напрямую и через диапазоны; cell - nullptr, если ячейки нет
+    template <typename Func>
+    void ForEachReference(const Cell& cell, Func func) const;
+    // Вызывает func(pos) для формул, ссылающихся на ячейку pos, напрямую и
+    // через диапазоны
+    template <typename Func>
+    void ForEachDependent(Position pos, const Cell& cell, Func func) const;
+    template <typename CellPrinter>
+    void PrintCells(std::ostream& output, CellPrinter print_cell) const;
+    std::vector<const Cell*> GetCalculationOrder(const std::vector<const Cell*>& roots) const;
+    void RecalculateParallel(const std::vector<const Cell*>& roots);
     bool CheckCircularDependences(const Position&);
+    bool CheckCircularDependences(const std::vector<Position>&) const;
+    std::uint32_t NextVisitGeneration(std::uint32_t step = 1) const;
+    void UpdateTopologicalOrder();
+    void BuildTopologicalOrder();
+    bool IsTopologicalOrder(const std::vector<Position>&) const;
+    bool InsertOrderedEdge(Position from_pos, Position to_pos);
 
-    void IsValidPos(const Position& , const std::string&) const;
-    int GetRows(const Position&);
-    int GetCol(const Position& ,int);
-    bool CheckCircular(const Position& check_pos, const Position& start_pos,
-                  std::unordered_set<Position>& cell);
+    void IsValidPos(const Position& , const char*) const;
 
 };
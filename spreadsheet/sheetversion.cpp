@@ -0,0 +1,172 @@
+#include "sheetversion.h"
+
+#include "cell.h"
+#include "sheet.h"
+#include "tableprinter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <ostream>
+#include <tuple>
+
+const SheetVersion::CellData* SheetVersion::GetCell(Position pos) const {
+    if (!pos.IsValid()){
+        throw InvalidPositionException("SheetVersion Invalid position:: Get Cell");
+    }
+    const BlockRow* row_blocks = rows_[pos.row / BLOCK_ROWS].get();
+    if (!row_blocks){
+        return nullptr;
+    }
+    const Block* block = (*row_blocks)[pos.col / BLOCK_COLS].get();
+    if (!block){
+        return nullptr;
+    }
+    const std::uint16_t slot = block->slots[InBlockIndex(pos)];
+    return slot ? &block->cells[slot - 1] : nullptr;
+}
+
+void SheetVersion::PrintValues(std::ostream& output) const {
+    ValuePrinter print_value(output);
+    PrintTable(output, size_, [this](auto visit){
+        ForEach(visit);
+    }, [&print_value](std::string& buffer, const CellData& cell){
+        print_value(buffer, cell.value);
+    });
+}
+
+void SheetVersion::PrintTexts(std::ostream& output) const {
+    PrintTable(output, size_, [this](auto visit){
+        ForEach(visit);
+    }, [](std::string& buffer, const CellData& cell){
+        buffer += cell.text;
+    });
+}
+
+std::shared_ptr<const SheetVersion> Sheet::PublishVersion(){
+    using Block = SheetVersion::Block;
+    using BlockRow = SheetVersion::BlockRow;
+    // значения в версии уже вычислены: читателям нечего считать
+    Recalculate();
+    auto version = std::make_shared<SheetVersion>();
+    if (published_ && versioning_){
+        version->rows_ = published_->rows_;
+    }
+    else{
+        // первая публикация: в версию попадает весь лист
+        version_edits_.clear();
+        version_values_.clear();
+        table_.ForEach([this](Position pos, const Cell&){
+            version_edits_.push_back(pos);
+        });
+    }
+
+    // изменения по блокам; правка содержимого важнее смены значения
+    struct Change {
+        int block_row;
+        int block_col;
+        Position pos;
+        bool edit;
+    };
+    std::vector<Change> changes;
+    changes.reserve(version_edits_.size() + version_values_.size());
+    auto add_changes = [&changes](const std::vector<Position>& positions, bool edit){
+        for (const auto& pos : positions){
+            changes.push_back({pos.row / SheetVersion::BLOCK_ROWS, pos.col / SheetVersion::BLOCK_COLS, pos, edit});
+        }
+    };
+    add_changes(version_edits_, true);
+    add_changes(version_values_, false);
+    std::sort(changes.begin(), changes.end(), [](const Change& lhs, const Change& rhs){
+        return std::tie(lhs.block_row, lhs.block_col, lhs.pos.row, lhs.pos.col, rhs.edit) <
+               std::tie(rhs.block_row, rhs.block_col, rhs.pos.row, rhs.pos.col, lhs.edit);
+    });
+
+    std::shared_ptr<BlockRow> row_blocks;
+    auto finish_row = [&](int block_row){
+        const bool empty = std::none_of(row_blocks->begin(), row_blocks->end(), [](const auto& block){
+            return block != nullptr;
+        });
+        version->rows_[block_row] = empty ? nullptr : std::move(row_blocks);
+        row_blocks.reset();
+    };
+    for (size_t first = 0; first < changes.size(); ){
+        const int block_row = changes[first].block_row;
+        const int block_col = changes[first].block_col;
+        if (!row_blocks){
+            const auto& old_row = version->rows_[block_row];
+            row_blocks = old_row ? std::make_shared<BlockRow>(*old_row) : std::make_shared<BlockRow>();
+        }
+        const auto& old_block = (*row_blocks)[block_col];
+        auto block = old_block ? std::make_shared<Block>(*old_block) : std::make_shared<Block>();
+
+        size_t last = first;
+        for (; last < changes.size() && changes[last].block_row == block_row &&
+               changes[last].block_col == block_col; ++last){
+            const Change& change = changes[last];
+            if (last > first && change.pos == changes[last - 1].pos){
+                continue;
+            }
+            const int index = SheetVersion::InBlockIndex(change.pos);
+            const std::uint64_t bit = std::uint64_t{1} << (change.pos.col % SheetVersion::BLOCK_COLS);
+            std::uint16_t& slot = block->slots[index];
+            const Cell* cell = table_.Find(change.pos);
+            if (!change.edit){
+                // новые ячейки приходят правками, здесь меняется только значение
+                if (slot && cell){
+                    block->cells[slot - 1].value = cell->GetValue();
+                }
+                continue;
+            }
+            if (!cell){
+                if (slot){
+                    block->cells[slot - 1] = {};
+                    block->row_bits[change.pos.row % SheetVersion::BLOCK_ROWS] &= ~bit;
+                    slot = 0;
+                    --block->count;
+                }
+                continue;
+            }
+            SheetVersion::CellData data{cell->GetText(), cell->GetValue()};
+            if (slot){
+                block->cells[slot - 1] = std::move(data);
+                continue;
+            }
+            block->cells.push_back(std::move(data));
+            slot = static_cast<std::uint16_t>(block->cells.size());
+            block->row_bits[change.pos.row % SheetVersion::BLOCK_ROWS] |= bit;
+            ++block->count;
+        }
+
+        if (block->cells.size() > 2 * static_cast<size_t>(block->count) + 64){
+            // записи удалённых ячеек выбрасываются, номера слотов сдвигаются
+            std::vector<SheetVersion::CellData> cells;
+            cells.reserve(block->count);
+            for (auto& slot : block->slots){
+                if (slot){
+                    cells.push_back(std::move(block->cells[slot - 1]));
+                    slot = static_cast<std::uint16_t>(cells.size());
+                }
+            }
+            block->cells = std::move(cells);
+        }
+        (*row_blocks)[block_col] = block->count ? std::move(block) : nullptr;
+
+        first = last;
+        if (first == changes.size() || changes[first].block_row != block_row){
+            finish_row(block_row);
+        }
+    }
+
+    version->size_ = table_.GetBounds();
+    version->number_ = ++version_number_;
+    version_edits_.clear();
+    version_values_.clear();
+    versioning_ = true;
+    std::shared_ptr<const SheetVersion> published = std::move(version);
+    std::atomic_store(&published_, published);
+    return published;
+}
+
+std::shared_ptr<const SheetVersion> Sheet::GetPublishedVersion() const {
+    return std::atomic_load(&published_);
+}
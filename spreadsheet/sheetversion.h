@@ -0,0 +1,102 @@
+#pragma once
+
+#include "bits.h"
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Неизменяемая версия листа для чтения из многих потоков (см.
+// Sheet::PublishVersion). Значения формул вычислены при публикации, так что
+// читатели ничего не считают и не пишут: любые методы версии можно вызывать
+// одновременно из разных потоков без блокировок, пока лист правится дальше.
+//
+// Лист разбит на блоки BLOCK_ROWS x BLOCK_COLS, строки блоков и сами блоки
+// хранятся через shared_ptr. Новая версия копирует только блоки, в которых
+// что-то изменилось, и каталоги их строк; остальное общее с прошлой версией.
+class SheetVersion {
+public:
+    using Value = CellInterface::Value;
+
+    // Содержимое ячейки на момент публикации.
+    struct CellData {
+        std::string text;
+        Value value;
+    };
+
+    // Ячейка или nullptr, если её нет.
+    const CellData* GetCell(Position pos) const;
+    Size GetPrintableSize() const {
+        return size_;
+    }
+    // Печатают таблицу так же, как Sheet::PrintValues и Sheet::PrintTexts.
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+
+    // Номер версии: 1, 2, ... в порядке публикации листом.
+    std::uint64_t GetNumber() const {
+        return number_;
+    }
+
+    // Вызывает func(pos, cell) для каждой ячейки по строкам листа, в строке -
+    // слева направо.
+    template <typename Func>
+    void ForEach(Func func) const;
+
+private:
+    friend class Sheet;
+
+    static const int BLOCK_ROWS = 16;
+    static const int BLOCK_COLS = 64;
+    static const int BLOCK_SIZE = BLOCK_ROWS * BLOCK_COLS;
+    static const int BLOCKS_PER_ROW = Position::MAX_COLS / BLOCK_COLS;
+    static const int BLOCK_ROW_COUNT = Position::MAX_ROWS / BLOCK_ROWS;
+    static_assert(BLOCK_COLS == 64, "строка блока должна помещаться в std::uint64_t");
+
+    struct Block {
+        // 0 - ячейки нет, иначе номер в cells + 1
+        std::array<std::uint16_t, BLOCK_SIZE> slots{};
+        // бит col - занята ли ячейка (row, col) блока
+        std::array<std::uint64_t, BLOCK_ROWS> row_bits{};
+        // освобождённые при сборке записи остаются в векторе до сжатия
+        std::vector<CellData> cells;
+        int count = 0;
+    };
+    using BlockRow = std::array<std::shared_ptr<const Block>, BLOCKS_PER_ROW>;
+
+    static int InBlockIndex(Position pos) {
+        return pos.row % BLOCK_ROWS * BLOCK_COLS + pos.col % BLOCK_COLS;
+    }
+
+    // строки блоков; nullptr - строка пуста
+    std::array<std::shared_ptr<const BlockRow>, BLOCK_ROW_COUNT> rows_;
+    Size size_;
+    std::uint64_t number_ = 0;
+};
+
+template <typename Func>
+void SheetVersion::ForEach(Func func) const {
+    for (int block_row = 0; block_row < BLOCK_ROW_COUNT; ++block_row){
+        const BlockRow* row_blocks = rows_[block_row].get();
+        if (!row_blocks){
+            continue;
+        }
+        for (int in_row = 0; in_row < BLOCK_ROWS; ++in_row){
+            const int row = block_row * BLOCK_ROWS + in_row;
+            for (int block_col = 0; block_col < BLOCKS_PER_ROW; ++block_col){
+                const Block* block = (*row_blocks)[block_col].get();
+                if (!block){
+                    continue;
+                }
+                ForEachSetBit(block->row_bits[in_row], [&](int bit){
+                    const Position pos{row, block_col * BLOCK_COLS + bit};
+                    func(pos, block->cells[block->slots[InBlockIndex(pos)] - 1]);
+                });
+            }
+        }
+    }
+}
@@ -0,0 +1,441 @@
+#include "snapshot.h"
+
+#include "cell.h"
+#include "sheet.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string& path){
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE){
+        throw SnapshotException("Cannot open snapshot: " + path);
+    }
+    file_ = file;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)){
+        CloseHandle(file);
+        throw SnapshotException("Cannot open snapshot: " + path);
+    }
+    size_ = static_cast<size_t>(size.QuadPart);
+    // пустой файл не отображается, его заголовок просто не пройдёт проверку
+    if (size_ == 0){
+        return;
+    }
+    mapping_ = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_){
+        data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    }
+    if (!data_){
+        if (mapping_){
+            CloseHandle(mapping_);
+        }
+        CloseHandle(file);
+        throw SnapshotException("Cannot map snapshot: " + path);
+    }
+}
+
+MappedFile::~MappedFile(){
+    if (data_){
+        UnmapViewOfFile(data_);
+        CloseHandle(mapping_);
+    }
+    CloseHandle(file_);
+}
+#else
+MappedFile::MappedFile(const std::string& path){
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0){
+        throw SnapshotException("Cannot open snapshot: " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0){
+        close(fd);
+        throw SnapshotException("Cannot open snapshot: " + path);
+    }
+    size_ = static_cast<size_t>(info.st_size);
+    // пустой файл не отображается, его заголовок просто не пройдёт проверку
+    if (size_ != 0){
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED){
+            close(fd);
+            throw SnapshotException("Cannot map snapshot: " + path);
+        }
+        data_ = static_cast<const char*>(data);
+    }
+    // отображение остаётся действительным и после закрытия файла
+    close(fd);
+}
+
+MappedFile::~MappedFile(){
+    if (data_){
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
+#endif
+
+namespace {
+
+// Формат снимка. Все числа записаны в порядке байт машины, которая его
+// сохранила; чужой порядок распознаётся по BYTE_ORDER_MARK. Секции идут
+// подряд за заголовком и выровнены на 8 байт, так что записи читаются
+// прямо из отображённой памяти, без разбора:
+//   Header
+//   CellRecord[cell_count]        - ячейки по строкам листа
+//   Position[dependent_count]     - формулы, ссылающиеся на ячейки
+//   FormulaRecord[formula_count]  - деревья формул, каждое один раз
+//   данные: тексты, ключи и деревья (FormulaAST::Serialize)
+
+const char MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+const std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t file_size;
+    std::uint64_t cell_count;
+    std::uint64_t dependent_count;
+    std::uint64_t formula_count;
+    std::uint64_t data_size;
+    // состояние топологического порядка листа
+    std::int64_t first_order;
+    std::int64_t next_order;
+    std::uint64_t topo_order_enabled;
+};
+
+enum CellKind : std::uint8_t {
+    EMPTY_CELL,
+    TEXT_CELL,
+    FORMULA_CELL,
+};
+
+enum CellFlags : std::uint8_t {
+    // значение формулы вычислено и лежит в number
+    CACHED = 1,
+    DIRTY = 2,
+};
+
+struct CellRecord {
+    std::int32_t row;
+    std::int32_t col;
+    std::uint8_t kind;
+    std::uint8_t flags;
+    // 0 - в number число, иначе категория ошибки + 1
+    std::uint8_t error;
+    std::uint8_t reserved;
+    std::uint32_t dependent_count;
+    std::uint64_t first_dependent;
+    // число текста или закешированное значение формулы
+    double number;
+    std::int64_t topo_order;
+    // текст в секции данных или номер дерева формулы
+    std::uint64_t text_offset;
+    std::uint32_t text_size;
+    std::uint32_t formula;
+    // позиция, относительно которой записаны ячейки дерева
+    std::int32_t anchor_row;
+    std::int32_t anchor_col;
+};
+
+struct FormulaRecord {
+    std::uint64_t tree_offset;
+    std::uint64_t key_offset;
+    std::uint32_t tree_size;
+    // пустой ключ - дерево не общее и в кеш формул не попадает
+    std::uint32_t key_size;
+};
+
+static_assert(sizeof(Header) % 8 == 0 && sizeof(CellRecord) % 8 == 0 &&
+              sizeof(Position) % 8 == 0 && sizeof(FormulaRecord) % 8 == 0,
+              "секции снимка должны оставаться выровненными");
+static_assert(sizeof(Position) == 2 * sizeof(std::int32_t), "позиции пишутся как есть");
+static_assert(std::is_trivially_copyable_v<Position>, "позиции пишутся как есть");
+
+[[noreturn]] void ThrowCorrupted(){
+    throw SnapshotException("Corrupted snapshot");
+}
+
+// Массив записей из отображённого файла; границы проверяются.
+template <typename Record>
+const Record* GetRecords(std::string_view file, std::uint64_t offset, std::uint64_t count){
+    if (offset > file.size() || count > (file.size() - offset) / sizeof(Record)){
+        ThrowCorrupted();
+    }
+    return reinterpret_cast<const Record*>(file.data() + offset);
+}
+
+std::string_view GetBytes(std::string_view data, std::uint64_t offset, std::uint64_t size){
+    if (offset > data.size() || size > data.size() - offset){
+        ThrowCorrupted();
+    }
+    return data.substr(offset, size);
+}
+
+// Заменяет файл to файлом from; false, если не вышло.
+bool MoveOver(const std::string& from, const std::string& to){
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+    return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+template <typename Record>
+void WriteRecords(std::ofstream& out, const std::vector<Record>& records){
+    out.write(reinterpret_cast<const char*>(records.data()),
+              static_cast<std::streamsize>(records.size() * sizeof(Record)));
+}
+
+}  // namespace
+
+void Sheet::SaveSnapshot(const std::string& path) const{
+    PERF_SCOPE(perf_, "SaveSnapshot");
+    // ключи общих деревьев: при загрузке они вернутся в кеш формул
+    std::unordered_map<const FormulaAST*, const std::string*> keys;
+    formula_cache_.ForEach([&keys](const std::string& key, const FormulaAST& ast){
+        keys.emplace(&ast, &key);
+    });
+
+    std::vector<CellRecord> cells;
+    cells.reserve(table_.Size());
+    std::vector<Position> dependents;
+    dependents.reserve(edge_count_);
+    std::vector<FormulaRecord> formulas;
+    std::unordered_map<const FormulaAST*, std::uint32_t> formula_index;
+    std::string data;
+    table_.ForEach([&](Position pos, const Cell& cell){
+        CellRecord record{};
+        record.row = pos.row;
+        record.col = pos.col;
+        record.kind = EMPTY_CELL;
+        record.topo_order = cell.topo_order_;
+        record.first_dependent = dependents.size();
+        cell.cell_depend_up_.ForEach([&dependents](Position dependent){
+            dependents.push_back(dependent);
+        });
+        record.dependent_count = static_cast<std::uint32_t>(dependents.size() - record.first_dependent);
+
+        if (const std::string* text = std::get_if<std::string>(&cell.content_)){
+            record.kind = TEXT_CELL;
+            record.text_offset = data.size();
+            record.text_size = static_cast<std::uint32_t>(text->size());
+            data += *text;
+        }
+        else if (const Formula* formula = cell.GetFormula()){
+            record.kind = FORMULA_CELL;
+            record.anchor_row = formula->GetAnchor().row;
+            record.anchor_col = formula->GetAnchor().col;
+            const FormulaAST* ast = &formula->GetAST();
+            auto [it, inserted] = formula_index.emplace(ast, static_cast<std::uint32_t>(formulas.size()));
+            if (inserted){
+                FormulaRecord formula_record{};
+                formula_record.tree_offset = data.size();
+                ast->Serialize(data);
+                formula_record.tree_size = static_cast<std::uint32_t>(data.size() - formula_record.tree_offset);
+                if (auto key = keys.find(ast); key != keys.end()){
+                    formula_record.key_offset = data.size();
+                    formula_record.key_size = static_cast<std::uint32_t>(key->second->size());
+                    data += *key->second;
+                }
+                formulas.push_back(formula_record);
+            }
+            record.formula = it->second;
+            record.flags = (cell.IsCached() ? CACHED : 0) | (cell.is_dirty_ ? DIRTY : 0);
+        }
+        if (const FormulaError* error = std::get_if<FormulaError>(&cell.number_)){
+            record.error = static_cast<std::uint8_t>(error->GetCategory()) + 1;
+        }
+        else{
+            record.number = std::get<double>(cell.number_);
+        }
+        cells.push_back(record);
+    });
+
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.cell_count = cells.size();
+    header.dependent_count = dependents.size();
+    header.formula_count = formulas.size();
+    header.data_size = data.size();
+    header.file_size = sizeof(Header) + cells.size() * sizeof(CellRecord) +
+                       dependents.size() * sizeof(Position) +
+                       formulas.size() * sizeof(FormulaRecord) + data.size();
+    header.first_order = first_order_;
+    header.next_order = next_order_;
+    header.topo_order_enabled = topo_order_enabled_;
+
+    // снимок пишется во временный файл рядом и подменяет прежний только
+    // целиком: сбой записи не портит последний удачный снимок
+    const std::string temp_path = path + ".tmp";
+    std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    WriteRecords(out, cells);
+    WriteRecords(out, dependents);
+    WriteRecords(out, formulas);
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    out.close();
+    if (!out || !MoveOver(temp_path, path)){
+        std::remove(temp_path.c_str());
+        throw SnapshotException("Cannot write snapshot: " + path);
+    }
+}
+
+std::unique_ptr<Sheet> Sheet::LoadSnapshot(const std::string& path,
+                                           std::pmr::memory_resource* upstream){
+    MappedFile file(path);
+    const std::string_view bytes = file.GetData();
+    if (bytes.size() < sizeof(Header)){
+        ThrowCorrupted();
+    }
+    const Header& header = *reinterpret_cast<const Header*>(bytes.data());
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0){
+        throw SnapshotException("Not a sheet snapshot: " + path);
+    }
+    if (header.byte_order != BYTE_ORDER_MARK){
+        throw SnapshotException("Snapshot has foreign byte order: " + path);
+    }
+    if (header.version != SNAPSHOT_VERSION){
+        throw SnapshotException("Unsupported snapshot version " + std::to_string(header.version) +
+                                ": " + path);
+    }
+    if (header.file_size != bytes.size()){
+        ThrowCorrupted();
+    }
+    std::uint64_t offset = sizeof(Header);
+    const CellRecord* cells = GetRecords<CellRecord>(bytes, offset, header.cell_count);
+    offset += header.cell_count * sizeof(CellRecord);
+    const Position* dependents = GetRecords<Position>(bytes, offset, header.dependent_count);
+    offset += header.dependent_count * sizeof(Position);
+    const FormulaRecord* formulas = GetRecords<FormulaRecord>(bytes, offset, header.formula_count);
+    offset += header.formula_count * sizeof(FormulaRecord);
+    const std::string_view data = GetBytes(bytes, offset, header.data_size);
+
+    auto sheet = std::make_unique<Sheet>(upstream);
+    // деревья собираются из готовых узлов, текст формул не разбирается
+    std::vector<std::shared_ptr<const FormulaAST>> asts(header.formula_count);
+    std::string key;
+    for (std::uint64_t i = 0; i < header.formula_count; ++i){
+        const std::string_view tree = GetBytes(data, formulas[i].tree_offset, formulas[i].tree_size);
+        try{
+            if (formulas[i].key_size == 0){
+                // дерево вне кеша всё равно живёт в памяти формул листа
+                std::pmr::memory_resource* resource = &sheet->formula_memory_;
+                asts[i] = std::allocate_shared<FormulaAST>(std::pmr::polymorphic_allocator<FormulaAST>(resource),
+                                                           FormulaAST::Deserialize(tree, resource));
+                continue;
+            }
+            key = GetBytes(data, formulas[i].key_offset, formulas[i].key_size);
+            asts[i] = sheet->formula_cache_.Get(key, [tree](std::pmr::memory_resource* resource){
+                return FormulaAST::Deserialize(tree, resource);
+            });
+        }
+        catch (const ParsingError&){
+            ThrowCorrupted();
+        }
+    }
+
+    Position previous{-1, -1};
+    for (std::uint64_t i = 0; i < header.cell_count; ++i){
+        const CellRecord& record = cells[i];
+        const Position pos{record.row, record.col};
+        // строгий порядок по строкам заодно исключает повторы позиций
+        if (!pos.IsValid() || !(previous < pos)){
+            ThrowCorrupted();
+        }
+        previous = pos;
+        Cell& cell = sheet->table_.Insert(pos);
+        if (record.kind == TEXT_CELL){
+            cell.content_.emplace<std::string>(GetBytes(data, record.text_offset, record.text_size));
+        }
+        else if (record.kind == FORMULA_CELL){
+            // ячейки дерева записаны относительно anchor, это всегда позиция
+            // листа, поэтому сдвиг по ней не переполняется
+            const Position anchor{record.anchor_row, record.anchor_col};
+            if (record.formula >= header.formula_count || !anchor.IsValid()){
+                ThrowCorrupted();
+            }
+            cell.content_.emplace<Formula>(asts[record.formula], anchor);
+            cell.sheet_ = sheet.get();
+            cell.cache_state_.Store(record.flags & CACHED ? CacheState::VALID : CacheState::INVALID);
+            if (record.flags & DIRTY){
+                cell.is_dirty_ = true;
+                sheet->dirty_cells_.push_back(pos);
+                ++sheet->dirty_count_;
+            }
+        }
+        else if (record.kind != EMPTY_CELL){
+            ThrowCorrupted();
+        }
+        if (record.error > static_cast<int>(FormulaError::Category::Div0) + 1){
+            ThrowCorrupted();
+        }
+        if (record.error){
+            cell.number_ = FormulaError(static_cast<FormulaError::Category>(record.error - 1));
+        }
+        else{
+            cell.number_ = record.number;
+        }
+        cell.topo_order_ = record.topo_order;
+        if (record.first_dependent > header.dependent_count ||
+            record.dependent_count > header.dependent_count - record.first_dependent){
+            ThrowCorrupted();
+        }
+        for (std::uint32_t j = 0; j < record.dependent_count; ++j){
+            sheet->edge_count_ += cell.cell_depend_up_.Insert(dependents[record.first_dependent + j]);
+        }
+    }
+
+    // Связи проверяются, чтобы повреждённый снимок не оставил формул со
+    // ссылками на несуществующие ячейки. Индекс диапазонов строится заново.
+    const Sheet& loaded = *sheet;
+    sheet->table_.ForEach([&sheet, &loaded](Position pos, const Cell& cell){
+        auto check_formula = [&loaded](Position dependent){
+            const Cell* dependent_cell = dependent.IsValid() ? loaded.table_.Find(dependent) : nullptr;
+            if (!dependent_cell || !dependent_cell->IsFormula()){
+                ThrowCorrupted();
+            }
+        };
+        cell.cell_depend_up_.ForEach(std::ref(check_formula));
+        const Formula* formula = cell.GetFormula();
+        if (!formula){
+            return;
+        }
+        auto check_reference = [&loaded](Position reference){
+            if (!reference.IsValid() || !loaded.table_.Find(reference)){
+                ThrowCorrupted();
+            }
+        };
+        cell.ForEachReferencedCell(std::ref(check_reference));
+        if (formula->GetAST().GetRanges().empty()){
+            return;
+        }
+        for (const auto& range : cell.GetReferencedRanges()){
+            if (!range.first.IsValid() || !range.last.IsValid()){
+                ThrowCorrupted();
+            }
+            sheet->range_index_.Insert(range, pos);
+        }
+    });
+    sheet->first_order_ = header.first_order;
+    sheet->next_order_ = header.next_order;
+    sheet->topo_order_enabled_ = header.topo_order_enabled != 0;
+    return sheet;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Версия формата снимка листа (см. Sheet::SaveSnapshot). Увеличивается при
+// любом изменении формата; снимки других версий не загружаются.
+const std::uint32_t SNAPSHOT_VERSION = 1;
+
+// Исключение, выбрасываемое, если снимок не удаётся записать или прочитать:
+// файла нет, он повреждён или записан другой версией формата.
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Файл, отображённый в память только для чтения. Целиком файл не читается:
+// страницы подгружаются системой при первом обращении к ним.
+class MappedFile {
+public:
+    // Бросает SnapshotException, если файл не удаётся открыть.
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    std::string_view GetData() const {
+        return {data_, size_};
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#endif
+};
@@ -1,7 +1,7 @@
 #include "common.h"
 
 #include <cctype>
-#include <sstream>
+#include <charconv>
 #include <algorithm>
 
 const int LETTERS = 26;
@@ -58,9 +58,10 @@ Position Position::FromString(std::string_view str) {
         return Position::NONE;
     }
 
+    // без потока: позиции разбираются для каждой ссылки в каждой формуле
     int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
+    if (error != std::errc() || end != digits.data() + digits.size()) {
         return Position::NONE;
     }
 
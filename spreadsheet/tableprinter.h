@@ -0,0 +1,102 @@
+#pragma once
+
+#include "common.h"
+
+#include <charconv>
+#include <ios>
+#include <locale>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <variant>
+
+// Дописывает значение в буфер в том же виде, что и operator<< потока
+inline void AppendValue(std::string& buffer, const CellInterface::Value& value){
+    if (const double* number = std::get_if<double>(&value)){
+        // формат потока по умолчанию - %g с точностью 6
+        char chars[32];
+        auto result = std::to_chars(chars, chars + sizeof(chars), *number,
+                                    std::chars_format::general, 6);
+        buffer.append(chars, result.ptr);
+    }
+    else if (const std::string* text = std::get_if<std::string>(&value)){
+        buffer += *text;
+    }
+    else{
+        buffer += std::get<FormulaError>(value).ToString();
+    }
+}
+
+// Дописывает значения в буфер так же, как operator<< потока output. Пока
+// у потока точность, флаги и локаль по умолчанию, числа печатает
+// AppendValue; иначе - поток с настройками output, заведённый один раз.
+class ValuePrinter {
+public:
+    explicit ValuePrinter(const std::ostream& output){
+        const bool default_format = output.precision() == 6 &&
+                                    output.flags() == (std::ios_base::skipws | std::ios_base::dec) &&
+                                    output.getloc() == std::locale::classic();
+        if (!default_format){
+            stream_.emplace();
+            stream_->copyfmt(output);
+            stream_->exceptions(std::ios_base::goodbit);
+            // ширина действует на одно значение, таблица её не использует
+            stream_->width(0);
+        }
+    }
+
+    void operator()(std::string& buffer, const CellInterface::Value& value){
+        const double* number = std::get_if<double>(&value);
+        if (!stream_ || !number){
+            AppendValue(buffer, value);
+            return;
+        }
+        stream_->str({});
+        *stream_ << *number;
+        buffer += stream_->str();
+    }
+
+private:
+    std::optional<std::ostringstream> stream_;
+};
+
+// Печатает таблицу size: столбцы разделены табуляциями, строки - переводами
+// строк. for_each(visit) должна вызвать visit(pos, cell) для занятых ячеек
+// по строкам, в строке - слева направо; print_cell(buffer, cell) дописывает
+// ячейку в буфер. Пропуски заполняются табуляциями, а текст уходит в поток
+// крупными кусками.
+template <typename ForEachCell, typename CellPrinter>
+void PrintTable(std::ostream& output, Size size, ForEachCell for_each, CellPrinter print_cell){
+    static const size_t FLUSH_SIZE = 1 << 16;
+    std::string buffer;
+    buffer.reserve(FLUSH_SIZE);
+    auto flush_if_full = [&]{
+        if (buffer.size() >= FLUSH_SIZE){
+            output.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    };
+    int row = 0;
+    int col = 0;
+    auto finish_row = [&]{
+        buffer.append(size.cols - 1 - col, '\t');
+        buffer += '\n';
+        ++row;
+        col = 0;
+        flush_if_full();
+    };
+    for_each([&](Position pos, const auto& cell){
+        while (row < pos.row){
+            finish_row();
+        }
+        buffer.append(pos.col - col, '\t');
+        col = pos.col;
+        print_cell(buffer, cell);
+        flush_if_full();
+    });
+    while (row < size.rows){
+        finish_row();
+    }
+    output.write(buffer.data(), buffer.size());
+}
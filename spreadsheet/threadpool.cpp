@@ -0,0 +1,112 @@
+#include "threadpool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i){
+        queues_.push_back(std::make_unique<WorkerQueue>());
+    }
+    // очередь 0 принадлежит вызывающему потоку
+    for (size_t i = 1; i < threads; ++i){
+        workers_.emplace_back([this, i]{ WorkerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    start_cv_.notify_all();
+    for (auto& worker : workers_){
+        worker.join();
+    }
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& body) {
+    if (count == 0){
+        return;
+    }
+    if (queues_.size() == 1){
+        for (size_t i = 0; i < count; ++i){
+            body(i);
+        }
+        return;
+    }
+
+    // порций в несколько раз больше, чем потоков, чтобы было что перехватывать
+    const size_t chunk = std::max<size_t>(1, count / (queues_.size() * 8));
+    // счётчик выставляется до раздачи: порцию может подхватить поток,
+    // ещё не вышедший из предыдущего цикла работы
+    pending_ = (count + chunk - 1) / chunk;
+    body_ = &body;
+    for (size_t begin = 0, queue = 0; begin < count; begin += chunk){
+        WorkerQueue& worker_queue = *queues_[queue];
+        std::lock_guard lock(worker_queue.mutex);
+        worker_queue.tasks.push_back({begin, std::min(begin + chunk, count)});
+        queue = (queue + 1) % queues_.size();
+    }
+    {
+        std::lock_guard lock(mutex_);
+        ++generation_;
+    }
+    start_cv_.notify_all();
+
+    while (RunOneTask(0)){
+    }
+    std::unique_lock lock(mutex_);
+    done_cv_.wait(lock, [this]{ return pending_ == 0; });
+    body_ = nullptr;
+}
+
+bool ThreadPool::RunOneTask(size_t index) {
+    Task task;
+    bool found = false;
+    {
+        WorkerQueue& own = *queues_[index];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty()){
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            found = true;
+        }
+    }
+    for (size_t i = 1; !found && i < queues_.size(); ++i){
+        WorkerQueue& victim = *queues_[(index + i) % queues_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()){
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            found = true;
+        }
+    }
+    if (!found){
+        return false;
+    }
+
+    for (size_t i = task.begin; i < task.end; ++i){
+        (*body_)(i);
+    }
+    if (--pending_ == 0){
+        std::lock_guard lock(mutex_);
+        done_cv_.notify_all();
+    }
+    return true;
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+    size_t seen_generation = 0;
+    for (;;){
+        {
+            std::unique_lock lock(mutex_);
+            start_cv_.wait(lock, [&]{ return stop_ || generation_ != seen_generation; });
+            if (stop_){
+                return;
+            }
+            seen_generation = generation_;
+        }
+        while (RunOneTask(index)){
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с перехватом работы (work stealing). Работа раздаётся
+// порциями по очередям потоков; поток, разобравший свою очередь, забирает
+// порции из начала чужих очередей.
+class ThreadPool {
+public:
+    // threads - общее число потоков, включая вызывающий
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetThreadCount() const {
+        return queues_.size();
+    }
+
+    // Вызывает body(i) для каждого i из [0, count) и дожидается завершения.
+    // Вызывающий поток тоже участвует в работе.
+    void ParallelFor(size_t count, const std::function<void(size_t)>& body);
+
+private:
+    struct Task {
+        size_t begin;
+        size_t end;
+    };
+
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void WorkerLoop(size_t index);
+    bool RunOneTask(size_t index);
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable start_cv_;
+    std::condition_variable done_cv_;
+    size_t generation_ = 0;
+    bool stop_ = false;
+
+    const std::function<void(size_t)>* body_ = nullptr;
+    std::atomic<size_t> pending_{0};
+};